@@ -4,14 +4,32 @@
 #define CAIROPP_H
 
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <future>
 #include <iterator>
+#include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -27,6 +45,9 @@ namespace cairo {
     struct IncreaseReferenceType {};
     constexpr IncreaseReferenceType IncreaseReference = {};
 
+    struct BorrowReferenceType {};
+    constexpr BorrowReferenceType BorrowReference = {};
+
     template<typename T, void (*Destroy)(T*)>
     class BasicHandle {
     public:
@@ -76,6 +97,11 @@ namespace cairo {
         m_object = object;
       }
 
+      T* release() noexcept
+      {
+        return std::exchange(m_object, nullptr);
+      }
+
       operator T*() noexcept
       {
         return m_object;
@@ -114,7 +140,7 @@ namespace cairo {
       }
 
       Handle(const Handle& other)
-      : BasicHandle<T, Destroy>(other.get())
+      : BasicHandle<T, Destroy>(const_cast<T*>(other.get())) // NOLINT(cppcoreguidelines-pro-type-const-cast)
       {
         reference();
       }
@@ -130,7 +156,7 @@ namespace cairo {
         }
 
         destroy();
-        set(other.get());
+        set(const_cast<T*>(other.get())); // NOLINT(cppcoreguidelines-pro-type-const-cast)
         reference();
         return *this;
       }
@@ -188,6 +214,35 @@ namespace cairo {
       NonCopyableHandle& operator=(NonCopyableHandle&&) noexcept = default;
     };
 
+    // a view of a cairo object that does not own a reference, it must not outlive the object it comes from
+    template<typename T>
+    class Ref {
+    public:
+      template<typename U>
+      Ref(U* object, [[maybe_unused]] BorrowReferenceType borrow)
+      : m_object(object, BorrowReference)
+      {
+      }
+
+      Ref(const Ref&) = delete;
+      Ref(Ref&&) noexcept = delete;
+
+      ~Ref()
+      {
+        m_object.release();
+      }
+
+      Ref& operator=(const Ref&) = delete;
+      Ref& operator=(Ref&&) noexcept = delete;
+
+      T& get() noexcept { return m_object; }
+      T* operator->() noexcept { return &m_object; }
+      operator T&() noexcept { return m_object; }
+
+    private:
+      T m_object;
+    };
+
   }
 
   // utilities
@@ -384,6 +439,457 @@ namespace cairo {
     }
   };
 
+  /*
+   * region
+   */
+
+  enum class RegionOverlap : std::underlying_type_t<cairo_region_overlap_t> { // NOLINT(performance-enum-size)
+    In = CAIRO_REGION_OVERLAP_IN,
+    Out = CAIRO_REGION_OVERLAP_OUT,
+    Part = CAIRO_REGION_OVERLAP_PART,
+  };
+
+  namespace details {
+
+    inline cairo_rectangle_int_t to_cairo(const RectI& rectangle)
+    {
+      return { rectangle.x, rectangle.y, rectangle.w, rectangle.h };
+    }
+
+    inline RectI from_cairo(const cairo_rectangle_int_t& rectangle)
+    {
+      return { rectangle.x, rectangle.y, rectangle.width, rectangle.height };
+    }
+
+  }
+
+  class RegionIterator {
+  public:
+    using value_type = RectI;
+    using difference_type = int;
+    using reference = value_type;
+    using pointer = value_type;
+    using iterator_category = std::forward_iterator_tag;
+
+    reference operator*() const { cairo_rectangle_int_t rectangle; cairo_region_get_rectangle(m_region, m_index, &rectangle); return details::from_cairo(rectangle); }
+
+    RegionIterator& operator++() { ++m_index; return *this; }
+    RegionIterator operator++(int) { RegionIterator copy = *this; ++m_index; return copy; }
+
+    constexpr bool operator==(const RegionIterator& other) const noexcept { return m_region == other.m_region && m_index == other.m_index; }
+    constexpr bool operator!=(const RegionIterator& other) const noexcept { return !(*this == other); }
+
+  private:
+    friend class Region;
+    RegionIterator(const cairo_region_t* region, int index)
+    : m_region(region)
+    , m_index(index)
+    {
+    }
+
+    const cairo_region_t* m_region = nullptr;
+    int m_index = 0;
+  };
+
+  // a set of integer rectangles, e.g. the damaged pixels of a surface
+  class Region {
+  public:
+    Region()
+    : m_region(cairo_region_create())
+    {
+    }
+
+    Region(const RectI& rectangle)
+    {
+      const cairo_rectangle_int_t r = details::to_cairo(rectangle);
+      m_region.set(cairo_region_create_rectangle(&r));
+    }
+
+    Region(const RectI* rectangles, int count)
+    {
+      std::vector<cairo_rectangle_int_t> r(count);
+      std::transform(rectangles, rectangles + count, r.begin(), details::to_cairo);
+      m_region.set(cairo_region_create_rectangles(r.data(), count));
+    }
+
+    template<typename T>
+    explicit Region(const T& rectangles)
+    : Region(std::data(rectangles), static_cast<int>(std::size(rectangles)))
+    {
+    }
+
+    Status status() const { return static_cast<Status>(cairo_region_status(m_region)); }
+
+    RectI extents() const { cairo_rectangle_int_t rectangle; cairo_region_get_extents(m_region, &rectangle); return details::from_cairo(rectangle); }
+    int size() const { return cairo_region_num_rectangles(m_region); }
+    RectI rectangle(int i) const { cairo_rectangle_int_t rectangle; cairo_region_get_rectangle(m_region, i, &rectangle); return details::from_cairo(rectangle); }
+    bool empty() const { return cairo_region_is_empty(m_region) != 0; }
+    void clear() { m_region.destroy(); m_region.set(cairo_region_create()); }
+
+    RegionOverlap contains(const RectI& rectangle) const { const cairo_rectangle_int_t r = details::to_cairo(rectangle); return static_cast<RegionOverlap>(cairo_region_contains_rectangle(m_region, &r)); }
+    bool contains(int x, int y) const { return cairo_region_contains_point(m_region, x, y) != 0; }
+    bool contains(Vec2I point) const { return cairo_region_contains_point(m_region, point.x, point.y) != 0; }
+
+    void translate(int dx, int dy) { cairo_region_translate(m_region, dx, dy); }
+    void translate(Vec2I d) { cairo_region_translate(m_region, d.x, d.y); }
+
+    Status subtract(const Region& other) { return static_cast<Status>(cairo_region_subtract(m_region, other.m_region)); }
+    Status subtract(const RectI& rectangle) { const cairo_rectangle_int_t r = details::to_cairo(rectangle); return static_cast<Status>(cairo_region_subtract_rectangle(m_region, &r)); }
+    Status intersect(const Region& other) { return static_cast<Status>(cairo_region_intersect(m_region, other.m_region)); }
+    Status intersect(const RectI& rectangle) { const cairo_rectangle_int_t r = details::to_cairo(rectangle); return static_cast<Status>(cairo_region_intersect_rectangle(m_region, &r)); }
+    Status unite(const Region& other) { return static_cast<Status>(cairo_region_union(m_region, other.m_region)); }
+    Status unite(const RectI& rectangle) { const cairo_rectangle_int_t r = details::to_cairo(rectangle); return static_cast<Status>(cairo_region_union_rectangle(m_region, &r)); }
+    Status exclusive_or(const Region& other) { return static_cast<Status>(cairo_region_xor(m_region, other.m_region)); }
+    Status exclusive_or(const RectI& rectangle) { const cairo_rectangle_int_t r = details::to_cairo(rectangle); return static_cast<Status>(cairo_region_xor_rectangle(m_region, &r)); }
+
+    bool operator==(const Region& other) const { return cairo_region_equal(m_region, other.m_region) != 0; }
+    bool operator!=(const Region& other) const { return !(*this == other); }
+
+    RegionIterator begin() const { return { m_region, 0 }; }
+    RegionIterator end() const { return { m_region, size() }; }
+
+  private:
+    friend class Context;
+    details::CopyableHandle<cairo_region_t, cairo_region_copy, cairo_region_destroy> m_region;
+  };
+
+  /*
+   * point buffers
+   */
+
+  namespace details {
+
+    // the coefficients of an affine matrix, to apply it in a loop without a call for each point
+    struct Affine {
+      double xx;
+      double yx;
+      double xy;
+      double yy;
+      double x0;
+      double y0;
+    };
+
+    inline Affine affine(const Matrix& matrix)
+    {
+      const Vec2F origin = matrix.transform_point({ 0.0, 0.0 });
+      const Vec2F ex = matrix.transform_distance({ 1.0, 0.0 });
+      const Vec2F ey = matrix.transform_distance({ 0.0, 1.0 });
+      return { ex.x, ex.y, ey.x, ey.y, origin.x, origin.y };
+    }
+
+    inline double snap(double value, double offset)
+    {
+      return std::floor(value - offset + 0.5) + offset;
+    }
+
+  }
+
+  // points stored as an array of x and an array of y, so that bulk operations are vectorized by the compiler
+  class PointBufferF {
+  public:
+    PointBufferF() = default;
+
+    PointBufferF(const Vec2F* points, int num_points)
+    {
+      reserve(num_points);
+
+      for (int i = 0; i < num_points; ++i) {
+        push_back(points[i]);
+      }
+    }
+
+    template<typename T>
+    explicit PointBufferF(const T& points)
+    : PointBufferF(std::data(points), static_cast<int>(std::size(points)))
+    {
+    }
+
+    int size() const { return static_cast<int>(m_x.size()); }
+    bool empty() const { return m_x.empty(); }
+    void reserve(int num_points) { m_x.reserve(num_points); m_y.reserve(num_points); }
+    void resize(int num_points) { m_x.resize(num_points); m_y.resize(num_points); }
+    void clear() { m_x.clear(); m_y.clear(); }
+
+    void push_back(double x, double y) { m_x.push_back(x); m_y.push_back(y); }
+    void push_back(Vec2F point) { push_back(point.x, point.y); }
+
+    Vec2F operator[](int i) const { return { m_x[i], m_y[i] }; }
+    void set(int i, Vec2F point) { m_x[i] = point.x; m_y[i] = point.y; }
+
+    double* x_data() { return m_x.data(); }
+    const double* x_data() const { return m_x.data(); }
+    double* y_data() { return m_y.data(); }
+    const double* y_data() const { return m_y.data(); }
+
+    void translate(double dx, double dy)
+    {
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+
+      for (int i = 0; i < size(); ++i) {
+        xs[i] += dx;
+        ys[i] += dy;
+      }
+    }
+
+    void translate(Vec2F d) { translate(d.x, d.y); }
+
+    void scale(double sx, double sy)
+    {
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+
+      for (int i = 0; i < size(); ++i) {
+        xs[i] *= sx;
+        ys[i] *= sy;
+      }
+    }
+
+    void scale(double s) { scale(s, s); }
+
+    // e.g. with the matrix of a context, to map data to device space in one pass
+    void transform(const Matrix& matrix)
+    {
+      const details::Affine m = details::affine(matrix);
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+
+      for (int i = 0; i < size(); ++i) {
+        const double x = xs[i];
+        const double y = ys[i];
+        xs[i] = m.xx * x + m.xy * y + m.x0;
+        ys[i] = m.yx * x + m.yy * y + m.y0;
+      }
+    }
+
+    RectF bounds() const
+    {
+      if (empty()) {
+        return { 0.0, 0.0, 0.0, 0.0 };
+      }
+
+      const auto [x_min, x_max] = std::minmax_element(m_x.begin(), m_x.end());
+      const auto [y_min, y_max] = std::minmax_element(m_y.begin(), m_y.end());
+      return { *x_min, *y_min, *x_max - *x_min, *y_max - *y_min };
+    }
+
+    // the distance from each point to a point
+    void distances(Vec2F point, std::vector<double>& output) const
+    {
+      output.resize(m_x.size());
+      const double* xs = m_x.data();
+      const double* ys = m_y.data();
+      double* distances = output.data();
+
+      for (int i = 0; i < size(); ++i) {
+        const double dx = xs[i] - point.x;
+        const double dy = ys[i] - point.y;
+        distances[i] = std::sqrt(dx * dx + dy * dy);
+      }
+    }
+
+    // the index of the nearest point, or -1
+    int nearest(Vec2F point) const
+    {
+      int index = -1;
+      double best = std::numeric_limits<double>::infinity();
+
+      for (int i = 0; i < size(); ++i) {
+        const double dx = m_x[i] - point.x;
+        const double dy = m_y[i] - point.y;
+        const double distance2 = dx * dx + dy * dy;
+
+        if (distance2 < best) {
+          best = distance2;
+          index = i;
+        }
+      }
+
+      return index;
+    }
+
+    // rounds the coordinates to integers plus the offset, e.g. 0.5 for the center of pixels when stroking 1px lines in device space
+    void snap_to_pixel_grid(double offset = 0.0)
+    {
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+
+      for (int i = 0; i < size(); ++i) {
+        xs[i] = details::snap(xs[i], offset);
+        ys[i] = details::snap(ys[i], offset);
+      }
+    }
+
+  private:
+    std::vector<double> m_x;
+    std::vector<double> m_y;
+  };
+
+  // rectangles stored as arrays of each field
+  class RectBufferF {
+  public:
+    RectBufferF() = default;
+
+    RectBufferF(const RectF* rectangles, int num_rectangles)
+    {
+      reserve(num_rectangles);
+
+      for (int i = 0; i < num_rectangles; ++i) {
+        push_back(rectangles[i]);
+      }
+    }
+
+    template<typename T>
+    explicit RectBufferF(const T& rectangles)
+    : RectBufferF(std::data(rectangles), static_cast<int>(std::size(rectangles)))
+    {
+    }
+
+    int size() const { return static_cast<int>(m_x.size()); }
+    bool empty() const { return m_x.empty(); }
+    void reserve(int num_rectangles) { m_x.reserve(num_rectangles); m_y.reserve(num_rectangles); m_w.reserve(num_rectangles); m_h.reserve(num_rectangles); }
+    void clear() { m_x.clear(); m_y.clear(); m_w.clear(); m_h.clear(); }
+
+    void push_back(double x, double y, double w, double h) { m_x.push_back(x); m_y.push_back(y); m_w.push_back(w); m_h.push_back(h); }
+    void push_back(const RectF& r) { push_back(r.x, r.y, r.w, r.h); }
+
+    RectF operator[](int i) const { return { m_x[i], m_y[i], m_w[i], m_h[i] }; }
+    void set(int i, const RectF& r) { m_x[i] = r.x; m_y[i] = r.y; m_w[i] = r.w; m_h[i] = r.h; }
+
+    const double* x_data() const { return m_x.data(); }
+    const double* y_data() const { return m_y.data(); }
+    const double* w_data() const { return m_w.data(); }
+    const double* h_data() const { return m_h.data(); }
+
+    void translate(double dx, double dy)
+    {
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+
+      for (int i = 0; i < size(); ++i) {
+        xs[i] += dx;
+        ys[i] += dy;
+      }
+    }
+
+    void translate(Vec2F d) { translate(d.x, d.y); }
+
+    // the rectangles stay normalized, with a positive size, for negative factors
+    void scale(double sx, double sy)
+    {
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+      double* ws = m_w.data();
+      double* hs = m_h.data();
+
+      for (int i = 0; i < size(); ++i) {
+        const double x0 = xs[i] * sx;
+        const double x1 = (xs[i] + ws[i]) * sx;
+        const double y0 = ys[i] * sy;
+        const double y1 = (ys[i] + hs[i]) * sy;
+        xs[i] = std::min(x0, x1);
+        ws[i] = std::abs(x1 - x0);
+        ys[i] = std::min(y0, y1);
+        hs[i] = std::abs(y1 - y0);
+      }
+    }
+
+    void scale(double s) { scale(s, s); }
+
+    // each rectangle becomes the extents of its transformed corners, which is exact for a matrix without rotation
+    void transform(const Matrix& matrix)
+    {
+      const details::Affine m = details::affine(matrix);
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+      double* ws = m_w.data();
+      double* hs = m_h.data();
+
+      for (int i = 0; i < size(); ++i) {
+        const double cx = m.xx * xs[i] + m.xy * ys[i] + m.x0;
+        const double cy = m.yx * xs[i] + m.yy * ys[i] + m.y0;
+        const double wx = m.xx * ws[i];
+        const double wy = m.yx * ws[i];
+        const double hx = m.xy * hs[i];
+        const double hy = m.yy * hs[i];
+        xs[i] = cx + std::min(wx, 0.0) + std::min(hx, 0.0);
+        ys[i] = cy + std::min(wy, 0.0) + std::min(hy, 0.0);
+        ws[i] = std::abs(wx) + std::abs(hx);
+        hs[i] = std::abs(wy) + std::abs(hy);
+      }
+    }
+
+    RectF bounds() const
+    {
+      if (empty()) {
+        return { 0.0, 0.0, 0.0, 0.0 };
+      }
+
+      double x_min = m_x[0];
+      double y_min = m_y[0];
+      double x_max = m_x[0] + m_w[0];
+      double y_max = m_y[0] + m_h[0];
+
+      for (int i = 1; i < size(); ++i) {
+        x_min = std::min(x_min, m_x[i]);
+        y_min = std::min(y_min, m_y[i]);
+        x_max = std::max(x_max, m_x[i] + m_w[i]);
+        y_max = std::max(y_max, m_y[i] + m_h[i]);
+      }
+
+      return { x_min, y_min, x_max - x_min, y_max - y_min };
+    }
+
+    // the distance from each rectangle to a point, 0 inside
+    void distances(Vec2F point, std::vector<double>& output) const
+    {
+      output.resize(m_x.size());
+      double* distances = output.data();
+
+      for (int i = 0; i < size(); ++i) {
+        const double dx = std::max({ m_x[i] - point.x, 0.0, point.x - m_x[i] - m_w[i] });
+        const double dy = std::max({ m_y[i] - point.y, 0.0, point.y - m_y[i] - m_h[i] });
+        distances[i] = std::sqrt(dx * dx + dy * dy);
+      }
+    }
+
+    // the last rectangle that contains the point, or -1
+    int find(Vec2F point) const
+    {
+      for (int i = size() - 1; i >= 0; --i) {
+        if (m_x[i] <= point.x && point.x <= m_x[i] + m_w[i] && m_y[i] <= point.y && point.y <= m_y[i] + m_h[i]) {
+          return i;
+        }
+      }
+
+      return -1;
+    }
+
+    // rounds the edges to integers plus the offset, so that filled rectangles in device space cover whole pixels
+    void snap_to_pixel_grid(double offset = 0.0)
+    {
+      double* xs = m_x.data();
+      double* ys = m_y.data();
+      double* ws = m_w.data();
+      double* hs = m_h.data();
+
+      for (int i = 0; i < size(); ++i) {
+        const double x0 = details::snap(xs[i], offset);
+        const double y0 = details::snap(ys[i], offset);
+        ws[i] = details::snap(xs[i] + ws[i], offset) - x0;
+        hs[i] = details::snap(ys[i] + hs[i], offset) - y0;
+        xs[i] = x0;
+        ys[i] = y0;
+      }
+    }
+
+  private:
+    std::vector<double> m_x;
+    std::vector<double> m_y;
+    std::vector<double> m_w;
+    std::vector<double> m_h;
+  };
+
   /*
    * font
    */
@@ -504,12 +1010,23 @@ namespace cairo {
     cairo_font_face_t* raw() { return m_font; }
 
   private:
+    FontFace(cairo_font_face_t* font, [[maybe_unused]] details::BorrowReferenceType borrow)
+    : m_font(font)
+    {
+    }
+
+    void release() { m_font.release(); }
+
     friend class Context;
     friend class ScaledFont;
+    template<typename T>
+    friend class details::Ref;
 
     details::Handle<cairo_font_face_t, cairo_font_face_reference, cairo_font_face_destroy> m_font;
   };
 
+  using FontFaceRef = details::Ref<FontFace>;
+
   struct TextGlyphs {
     Status result = Status::Success;
     std::vector<glyph> glyphs;
@@ -575,6 +1092,7 @@ namespace cairo {
     }
 
     FontFace font_face() { return { cairo_scaled_font_get_font_face(m_font), details::IncreaseReference }; }
+    FontFaceRef font_face_ref() { return { cairo_scaled_font_get_font_face(m_font), details::BorrowReference }; }
     Matrix font_matrix() { Matrix m; cairo_scaled_font_get_font_matrix(m_font, m); return m; }
     Matrix ctm() { Matrix m; cairo_scaled_font_get_ctm(m_font, m); return m; }
     Matrix scale_matrix() { Matrix m; cairo_scaled_font_get_scale_matrix(m_font, m); return m; }
@@ -586,10 +1104,21 @@ namespace cairo {
     {
     }
 
+    ScaledFont(cairo_scaled_font_t* font, [[maybe_unused]] details::BorrowReferenceType borrow)
+    : m_font(font)
+    {
+    }
+
+    void release() { m_font.release(); }
+
     friend class Context;
+    template<typename T>
+    friend class details::Ref;
     details::Handle<cairo_scaled_font_t, cairo_scaled_font_reference, cairo_scaled_font_destroy> m_font;
   };
 
+  using ScaledFontRef = details::Ref<ScaledFont>;
+
   /*
    * path
    */
@@ -648,6 +1177,7 @@ namespace cairo {
 
   private:
     friend class Path;
+    friend class PathBuffer;
     PathIterator(const PathData* data)
     : m_data(data)
     {
@@ -656,46 +1186,1043 @@ namespace cairo {
     const PathData* m_data = nullptr;
   };
 
-  class Path {
-  public:
-    Status status() const { return static_cast<Status>(m_path.get()->status); };
+  namespace details {
 
-    PathIterator begin() const { return m_path.get()->data; }
-    PathIterator end() const { return m_path.get()->data + m_path.get()->num_data; }
+    struct Bounds {
+      double x_min = std::numeric_limits<double>::infinity();
+      double y_min = std::numeric_limits<double>::infinity();
+      double x_max = -std::numeric_limits<double>::infinity();
+      double y_max = -std::numeric_limits<double>::infinity();
 
-  private:
-    Path(cairo_path* p)
-    : m_path(p)
-    {
-    }
+      bool empty() const { return x_min > x_max; }
 
-    friend class Context;
-    friend class MeshPattern;
-    details::NonCopyableHandle<cairo_path, cairo_path_destroy> m_path;
-  };
+      void add(Vec2F point)
+      {
+        x_min = std::min(x_min, point.x);
+        y_min = std::min(y_min, point.y);
+        x_max = std::max(x_max, point.x);
+        y_max = std::max(y_max, point.y);
+      }
 
-  /*
-   * pattern
-   */
+      void add(const RectF& rectangle)
+      {
+        add(Vec2F{ rectangle.x, rectangle.y });
+        add(Vec2F{ rectangle.x + rectangle.w, rectangle.y + rectangle.h });
+      }
 
-  enum class PatternType : std::underlying_type_t<cairo_pattern_type_t> { // NOLINT(performance-enum-size)
-    Solid = CAIRO_PATTERN_TYPE_SOLID,
-    Surface = CAIRO_PATTERN_TYPE_SURFACE,
-    Linear = CAIRO_PATTERN_TYPE_LINEAR,
-    Radial = CAIRO_PATTERN_TYPE_RADIAL,
-    Mesh = CAIRO_PATTERN_TYPE_MESH,
-    RasterSource = CAIRO_PATTERN_TYPE_RASTER_SOURCE,
-  };
+      RectF rect() const
+      {
+        if (empty()) {
+          return { 0.0, 0.0, 0.0, 0.0 };
+        }
 
-  enum class Extend : std::underlying_type_t<cairo_extend_t> { // NOLINT(performance-enum-size)
-    None = CAIRO_EXTEND_NONE,
-    Repeat = CAIRO_EXTEND_REPEAT,
-    Reflect = CAIRO_EXTEND_REFLECT,
-    Pad = CAIRO_EXTEND_PAD,
-  };
+        return { x_min, y_min, x_max - x_min, y_max - y_min };
+      }
+    };
 
-  enum class Filter : std::underlying_type_t<cairo_filter_t> { // NOLINT(performance-enum-size)
-    Fast = CAIRO_FILTER_FAST,
+    struct PathBounds {
+      Bounds tight;
+      Bounds control;
+    };
+
+    // adds the points of a cubic Bézier curve where the derivative on one axis is zero
+    inline void add_curve_extrema(Bounds& bounds, Vec2F p0, Vec2F p1, Vec2F p2, Vec2F p3, double v0, double v1, double v2, double v3)
+    {
+      // the derivative divided by 3 is a t^2 + b t + c
+      const double a = -v0 + 3 * v1 - 3 * v2 + v3;
+      const double b = 2 * (v0 - 2 * v1 + v2);
+      const double c = v1 - v0;
+
+      auto add = [&](double t) {
+        if (t > 0.0 && t < 1.0) {
+          const double s = 1.0 - t;
+          const double w0 = s * s * s;
+          const double w1 = 3 * s * s * t;
+          const double w2 = 3 * s * t * t;
+          const double w3 = t * t * t;
+          bounds.add(Vec2F{ w0 * p0.x + w1 * p1.x + w2 * p2.x + w3 * p3.x, w0 * p0.y + w1 * p1.y + w2 * p2.y + w3 * p3.y });
+        }
+      };
+
+      if (std::abs(a) < 1e-12) {
+        if (b != 0.0) {
+          add(-c / b);
+        }
+
+        return;
+      }
+
+      const double discriminant = b * b - 4 * a * c;
+
+      if (discriminant < 0.0) {
+        return;
+      }
+
+      const double q = -0.5 * (b + std::copysign(std::sqrt(discriminant), b));
+      add(q / a);
+
+      if (q != 0.0) {
+        add(c / q);
+      }
+    }
+
+    // the tight bounds, like cairo_path_extents, and the bounds of all the points, built element by element
+    // a move_to only extends the bounds when a segment follows it
+    class PathBoundsBuilder {
+    public:
+      const PathBounds& bounds() const { return m_bounds; }
+
+      void move_to(Vec2F point)
+      {
+        m_current = m_start = point;
+        m_pending_move = true;
+      }
+
+      void line_to(Vec2F point)
+      {
+        add_pending_move();
+        m_bounds.control.add(point);
+        m_bounds.tight.add(point);
+        m_current = point;
+      }
+
+      void curve_to(Vec2F p1, Vec2F p2, Vec2F p3)
+      {
+        add_pending_move();
+        m_bounds.control.add(p1);
+        m_bounds.control.add(p2);
+        m_bounds.control.add(p3);
+
+        Bounds& tight = m_bounds.tight;
+        tight.add(p3);
+
+        // the curve is in the hull of its control points, so the extrema are only needed if a control point is outside
+        if (p1.x < tight.x_min || p1.x > tight.x_max || p2.x < tight.x_min || p2.x > tight.x_max) {
+          add_curve_extrema(tight, m_current, p1, p2, p3, m_current.x, p1.x, p2.x, p3.x);
+        }
+
+        if (p1.y < tight.y_min || p1.y > tight.y_max || p2.y < tight.y_min || p2.y > tight.y_max) {
+          add_curve_extrema(tight, m_current, p1, p2, p3, m_current.y, p1.y, p2.y, p3.y);
+        }
+
+        m_current = p3;
+      }
+
+      void close_path()
+      {
+        m_current = m_start;
+      }
+
+      void add(const PathData* element)
+      {
+        switch (element->header.type) {
+          case CAIRO_PATH_MOVE_TO:
+            move_to({ element[1].point.x, element[1].point.y });
+            break;
+          case CAIRO_PATH_LINE_TO:
+            line_to({ element[1].point.x, element[1].point.y });
+            break;
+          case CAIRO_PATH_CURVE_TO:
+            curve_to({ element[1].point.x, element[1].point.y }, { element[2].point.x, element[2].point.y }, { element[3].point.x, element[3].point.y });
+            break;
+          case CAIRO_PATH_CLOSE_PATH:
+            close_path();
+            break;
+        }
+      }
+
+    private:
+      void add_pending_move()
+      {
+        if (m_pending_move) {
+          m_bounds.control.add(m_current);
+          m_bounds.tight.add(m_current);
+          m_pending_move = false;
+        }
+      }
+
+      PathBounds m_bounds;
+      Vec2F m_current = { 0.0, 0.0 };
+      Vec2F m_start = { 0.0, 0.0 };
+      bool m_pending_move = false;
+    };
+
+    inline PathBounds compute_path_bounds(const PathData* data, int num_data)
+    {
+      PathBoundsBuilder builder;
+
+      for (int i = 0; i < num_data; i += data[i].header.length) {
+        builder.add(&data[i]);
+      }
+
+      return builder.bounds();
+    }
+
+  }
+
+  class Path {
+  public:
+    Status status() const { return static_cast<Status>(m_path.get()->status); };
+
+    PathIterator begin() const { return m_path.get()->data; }
+    PathIterator end() const { return m_path.get()->data + m_path.get()->num_data; }
+    int data_size() const { return m_path.get()->num_data; }
+
+    // like Context::path_extents, without a context, computed when the path is copied
+    RectF extents() const { return m_bounds.tight.rect(); }
+    // the extents of all the points of the segments, including the control points of the curves
+    RectF control_extents() const { return m_bounds.control.rect(); }
+
+  private:
+    Path(cairo_path* p)
+    : m_path(p)
+    , m_bounds(details::compute_path_bounds(p->data, p->num_data))
+    {
+    }
+
+    friend class Context;
+    friend class MeshPattern;
+    friend class PathBuffer;
+    details::NonCopyableHandle<cairo_path, cairo_path_destroy> m_path;
+    details::PathBounds m_bounds;
+  };
+
+  namespace details {
+
+    constexpr double Pi = 3.14159265358979323846;
+
+    // appends an elliptical arc as cubic Bézier curves, the sink must already be at the start of the arc
+    template<typename Sink>
+    void arc_to_curves(Vec2F center, Vec2F radii, double rotation, double start, double sweep, Sink& sink)
+    {
+      const int count = static_cast<int>(std::ceil(std::abs(sweep) / (Pi / 2) - 1e-9));
+
+      if (count <= 0) {
+        return;
+      }
+
+      const double step = sweep / count;
+      const double alpha = 4.0 / 3.0 * std::tan(step / 4);
+      const double cos_rotation = std::cos(rotation);
+      const double sin_rotation = std::sin(rotation);
+
+      auto map = [&](double x, double y) {
+        x *= radii.x;
+        y *= radii.y;
+        return Vec2F{ center.x + cos_rotation * x - sin_rotation * y, center.y + sin_rotation * x + cos_rotation * y };
+      };
+
+      double angle = start;
+      double cos1 = std::cos(angle);
+      double sin1 = std::sin(angle);
+
+      for (int i = 0; i < count; ++i) {
+        angle = (i + 1 == count) ? start + sweep : angle + step;
+        const double cos2 = std::cos(angle);
+        const double sin2 = std::sin(angle);
+
+        const Vec2F p1 = map(cos1 - alpha * sin1, sin1 + alpha * cos1);
+        const Vec2F p2 = map(cos2 + alpha * sin2, sin2 - alpha * cos2);
+        const Vec2F p3 = map(cos2, sin2);
+        sink.curve_to(p1.x, p1.y, p2.x, p2.y, p3.x, p3.y);
+
+        cos1 = cos2;
+        sin1 = sin2;
+      }
+    }
+
+  }
+
+  class PathBuffer {
+  public:
+    PathBuffer() = default;
+
+    explicit PathBuffer(const Path& path)
+    {
+      const cairo_path* raw = path.m_path.get();
+      m_data.assign(raw->data, raw->data + raw->num_data);
+
+      for (int i = 0; i < data_size(); i += m_data[i].header.length) {
+        const PathData* element = &m_data[i];
+
+        if (element->header.type == CAIRO_PATH_CLOSE_PATH) {
+          m_current_point = m_last_move_point;
+        } else {
+          const int last = element->header.length - 1;
+          m_current_point = { element[last].point.x, element[last].point.y };
+          m_has_current_point = true;
+
+          if (element->header.type == CAIRO_PATH_MOVE_TO) {
+            m_last_move_point = m_current_point;
+            m_last_move_index = i;
+          }
+        }
+
+        m_bounds.add(element);
+      }
+    }
+
+    PathIterator begin() const { return m_data.data(); }
+    PathIterator end() const { return m_data.data() + m_data.size(); }
+
+    const PathData* data() const { return m_data.data(); }
+    int data_size() const { return static_cast<int>(m_data.size()); }
+    bool empty() const { return m_data.empty(); }
+    void reserve(int num_data) { m_data.reserve(num_data); }
+
+    // like Context::path_extents, without a context, updated when the path changes
+    RectF extents() const { return m_bounds.bounds().tight.rect(); }
+    // the extents of all the points of the segments, including the control points of the curves
+    RectF control_extents() const { return m_bounds.bounds().control.rect(); }
+
+    PathBuffer& new_path() { m_data.clear(); m_has_current_point = false; m_last_move_index = -1; m_bounds = {}; return *this; }
+    PathBuffer& new_sub_path() { m_has_current_point = false; return *this; }
+
+    PathBuffer& move_to(double x, double y)
+    {
+      if (m_last_move_index >= 0 && m_last_move_index + 2 == data_size()) {
+        // like cairo, consecutive move_to are merged
+        m_data[m_last_move_index + 1].point = { x, y };
+      } else {
+        m_last_move_index = data_size();
+        push_header(PathDataType::MoveTo, 2);
+        push_point(x, y);
+      }
+
+      m_bounds.move_to({ x, y });
+      m_current_point = m_last_move_point = { x, y };
+      m_has_current_point = true;
+      return *this;
+    }
+
+    PathBuffer& move_to(Vec2F point) { return move_to(point.x, point.y); }
+
+    PathBuffer& line_to(double x, double y)
+    {
+      if (!m_has_current_point) {
+        return move_to(x, y);
+      }
+
+      push_header(PathDataType::LineTo, 2);
+      push_point(x, y);
+      m_bounds.line_to({ x, y });
+      m_current_point = { x, y };
+      return *this;
+    }
+
+    PathBuffer& line_to(Vec2F point) { return line_to(point.x, point.y); }
+
+    PathBuffer& curve_to(double x1, double y1, double x2, double y2, double x3, double y3)
+    {
+      if (!m_has_current_point) {
+        move_to(x1, y1);
+      }
+
+      push_header(PathDataType::CurveTo, 4);
+      push_point(x1, y1);
+      push_point(x2, y2);
+      push_point(x3, y3);
+      m_bounds.curve_to({ x1, y1 }, { x2, y2 }, { x3, y3 });
+      m_current_point = { x3, y3 };
+      return *this;
+    }
+
+    PathBuffer& curve_to(Vec2F p1, Vec2F p2, Vec2F p3) { return curve_to(p1.x, p1.y, p2.x, p2.y, p3.x, p3.y); }
+
+    PathBuffer& arc(double xc, double yc, double radius, double angle1, double angle2)
+    {
+      while (angle2 < angle1) {
+        angle2 += 2 * details::Pi;
+      }
+
+      return append_arc(xc, yc, radius, angle1, angle2);
+    }
+
+    PathBuffer& arc(Vec2F center, double radius, double angle1, double angle2) { return arc(center.x, center.y, radius, angle1, angle2); }
+
+    PathBuffer& arc_negative(double xc, double yc, double radius, double angle1, double angle2)
+    {
+      while (angle2 > angle1) {
+        angle2 -= 2 * details::Pi;
+      }
+
+      return append_arc(xc, yc, radius, angle1, angle2);
+    }
+
+    PathBuffer& arc_negative(Vec2F center, double radius, double angle1, double angle2) { return arc_negative(center.x, center.y, radius, angle1, angle2); }
+
+    PathBuffer& rel_move_to(double dx, double dy) { assert(m_has_current_point); return move_to(m_current_point.x + dx, m_current_point.y + dy); }
+    PathBuffer& rel_move_to(Vec2F d) { return rel_move_to(d.x, d.y); }
+    PathBuffer& rel_line_to(double dx, double dy) { assert(m_has_current_point); return line_to(m_current_point.x + dx, m_current_point.y + dy); }
+    PathBuffer& rel_line_to(Vec2F d) { return rel_line_to(d.x, d.y); }
+    PathBuffer& rel_curve_to(double dx1, double dy1, double dx2, double dy2, double dx3, double dy3)
+    {
+      assert(m_has_current_point);
+      const Vec2F p = m_current_point;
+      return curve_to(p.x + dx1, p.y + dy1, p.x + dx2, p.y + dy2, p.x + dx3, p.y + dy3);
+    }
+
+    PathBuffer& rel_curve_to(Vec2F d1, Vec2F d2, Vec2F d3) { return rel_curve_to(d1.x, d1.y, d2.x, d2.y, d3.x, d3.y); }
+
+    PathBuffer& rectangle(double x, double y, double w, double h)
+    {
+      move_to(x, y);
+      rel_line_to(w, 0);
+      rel_line_to(0, h);
+      rel_line_to(-w, 0);
+      close_path();
+      return *this;
+    }
+
+    PathBuffer& rectangle(const RectF& r) { return rectangle(r.x, r.y, r.w, r.h); }
+
+    PathBuffer& polyline(const Vec2F* points, int num_points)
+    {
+      if (num_points > 0) {
+        m_data.reserve(m_data.size() + 2 * static_cast<std::size_t>(num_points));
+        move_to(points[0]);
+
+        for (int i = 1; i < num_points; ++i) {
+          line_to(points[i]);
+        }
+      }
+
+      return *this;
+    }
+
+    template<typename T>
+    PathBuffer& polyline(const T& points) { return polyline(std::data(points), static_cast<int>(std::size(points))); }
+    PathBuffer& polygon(const Vec2F* points, int num_points) { polyline(points, num_points); close_path(); return *this; }
+    template<typename T>
+    PathBuffer& polygon(const T& points) { return polygon(std::data(points), static_cast<int>(std::size(points))); }
+
+    void close_path()
+    {
+      if (!m_has_current_point) {
+        return;
+      }
+
+      push_header(PathDataType::ClosePath, 1);
+      m_bounds.close_path();
+      // like cairo, a close_path is followed by a move_to to the start of the sub-path
+      move_to(m_last_move_point);
+    }
+
+    bool has_current_point() const { return m_has_current_point; }
+    Vec2F current_point() const { return m_current_point; }
+
+  private:
+    void push_header(PathDataType type, int length)
+    {
+      PathData data = {};
+      data.header.type = static_cast<cairo_path_data_type_t>(type);
+      data.header.length = length;
+      m_data.push_back(data);
+    }
+
+    void push_point(double x, double y)
+    {
+      PathData data = {};
+      data.point.x = x;
+      data.point.y = y;
+      m_data.push_back(data);
+    }
+
+    PathBuffer& append_arc(double xc, double yc, double radius, double angle1, double angle2)
+    {
+      const Vec2F start = { xc + radius * std::cos(angle1), yc + radius * std::sin(angle1) };
+
+      if (m_has_current_point) {
+        line_to(start);
+      } else {
+        move_to(start);
+      }
+
+      details::arc_to_curves({ xc, yc }, { radius, radius }, 0.0, angle1, angle2 - angle1, *this);
+      return *this;
+    }
+
+    std::vector<PathData> m_data;
+    Vec2F m_current_point = { 0.0, 0.0 };
+    Vec2F m_last_move_point = { 0.0, 0.0 };
+    bool m_has_current_point = false;
+    int m_last_move_index = -1;
+    details::PathBoundsBuilder m_bounds;
+  };
+
+  /*
+   * svg path
+   */
+
+  namespace details {
+
+    class SvgPathReader {
+    public:
+      SvgPathReader(std::string_view data)
+      : m_data(data)
+      {
+      }
+
+      bool at_end() const { return m_index >= m_data.size(); }
+
+      void skip_separators()
+      {
+        while (!at_end()) {
+          const char c = m_data[m_index];
+
+          if (c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != ',') {
+            break;
+          }
+
+          ++m_index;
+        }
+      }
+
+      bool next_is_number() const
+      {
+        if (at_end()) {
+          return false;
+        }
+
+        const char c = m_data[m_index];
+        return is_digit(c) || c == '+' || c == '-' || c == '.';
+      }
+
+      char read_command() { return m_data[m_index++]; }
+
+      bool read_number(double& value)
+      {
+        skip_separators();
+
+        std::size_t i = m_index;
+        const std::size_t n = m_data.size();
+        bool negative = false;
+
+        if (i < n && (m_data[i] == '+' || m_data[i] == '-')) {
+          negative = m_data[i] == '-';
+          ++i;
+        }
+
+        std::uint64_t mantissa = 0;
+        int exponent = 0;
+        bool has_digits = false;
+
+        for (; i < n && is_digit(m_data[i]); ++i) {
+          accumulate(mantissa, exponent, m_data[i], false);
+          has_digits = true;
+        }
+
+        if (i < n && m_data[i] == '.') {
+          for (++i; i < n && is_digit(m_data[i]); ++i) {
+            accumulate(mantissa, exponent, m_data[i], true);
+            has_digits = true;
+          }
+        }
+
+        if (!has_digits) {
+          return false;
+        }
+
+        if (i < n && (m_data[i] == 'e' || m_data[i] == 'E')) {
+          std::size_t j = i + 1;
+          bool negative_exponent = false;
+
+          if (j < n && (m_data[j] == '+' || m_data[j] == '-')) {
+            negative_exponent = m_data[j] == '-';
+            ++j;
+          }
+
+          if (j < n && is_digit(m_data[j])) {
+            int explicit_exponent = 0;
+
+            for (; j < n && is_digit(m_data[j]); ++j) {
+              explicit_exponent = std::min(explicit_exponent * 10 + (m_data[j] - '0'), 1000);
+            }
+
+            exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+            i = j;
+          }
+        }
+
+        value = static_cast<double>(mantissa);
+
+        if (exponent > 0) {
+          value *= power_of_ten(exponent);
+        } else if (exponent < 0) {
+          value /= power_of_ten(-exponent);
+        }
+
+        if (negative) {
+          value = -value;
+        }
+
+        m_index = i;
+        return true;
+      }
+
+      bool read_flag(bool& flag)
+      {
+        skip_separators();
+
+        if (at_end() || (m_data[m_index] != '0' && m_data[m_index] != '1')) {
+          return false;
+        }
+
+        flag = m_data[m_index++] == '1';
+        return true;
+      }
+
+    private:
+      static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+      static void accumulate(std::uint64_t& mantissa, int& exponent, char c, bool fractional)
+      {
+        constexpr std::uint64_t MantissaLimit = UINT64_C(100000000000000000);
+
+        if (mantissa < MantissaLimit) {
+          mantissa = mantissa * 10 + static_cast<std::uint64_t>(c - '0');
+
+          if (fractional) {
+            --exponent;
+          }
+        } else if (!fractional) {
+          ++exponent;
+        }
+      }
+
+      static double power_of_ten(int exponent)
+      {
+        constexpr double Exact[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+        if (exponent < static_cast<int>(std::size(Exact))) {
+          return Exact[exponent];
+        }
+
+        return std::pow(10.0, exponent);
+      }
+
+      std::string_view m_data;
+      std::size_t m_index = 0;
+    };
+
+    template<typename Sink>
+    void svg_arc_to(Sink& sink, Vec2F from, Vec2F radii, double rotation_degrees, bool large_arc, bool sweep, Vec2F to)
+    {
+      if (from.x == to.x && from.y == to.y) {
+        return;
+      }
+
+      double rx = std::abs(radii.x);
+      double ry = std::abs(radii.y);
+
+      if (rx == 0.0 || ry == 0.0) {
+        sink.line_to(to.x, to.y);
+        return;
+      }
+
+      const double rotation = rotation_degrees * Pi / 180.0;
+      const double cos_rotation = std::cos(rotation);
+      const double sin_rotation = std::sin(rotation);
+
+      const double dx = (from.x - to.x) / 2;
+      const double dy = (from.y - to.y) / 2;
+      const double x1 = cos_rotation * dx + sin_rotation * dy;
+      const double y1 = -sin_rotation * dx + cos_rotation * dy;
+
+      const double lambda = (x1 * x1) / (rx * rx) + (y1 * y1) / (ry * ry);
+
+      if (lambda > 1.0) {
+        rx *= std::sqrt(lambda);
+        ry *= std::sqrt(lambda);
+      }
+
+      const double numerator = rx * rx * ry * ry - rx * rx * y1 * y1 - ry * ry * x1 * x1;
+      const double denominator = rx * rx * y1 * y1 + ry * ry * x1 * x1;
+      double coefficient = std::sqrt(std::max(0.0, numerator / denominator));
+
+      if (large_arc == sweep) {
+        coefficient = -coefficient;
+      }
+
+      const double cx1 = coefficient * rx * y1 / ry;
+      const double cy1 = -coefficient * ry * x1 / rx;
+      const Vec2F center = { cos_rotation * cx1 - sin_rotation * cy1 + (from.x + to.x) / 2, sin_rotation * cx1 + cos_rotation * cy1 + (from.y + to.y) / 2 };
+
+      const double start = std::atan2((y1 - cy1) / ry, (x1 - cx1) / rx);
+      double delta = std::atan2((-y1 - cy1) / ry, (-x1 - cx1) / rx) - start;
+
+      if (!sweep && delta > 0) {
+        delta -= 2 * Pi;
+      } else if (sweep && delta < 0) {
+        delta += 2 * Pi;
+      }
+
+      arc_to_curves(center, { rx, ry }, rotation, start, delta, sink);
+    }
+
+  }
+
+  // parses SVG path data (the `d` attribute) into a sink with move_to, line_to, curve_to and close_path (PathBuffer, Context)
+  // on error, the path up to the error is kept, as required by SVG
+  template<typename Sink>
+  Status parse_svg_path(std::string_view data, Sink& sink)
+  {
+    details::SvgPathReader reader(data);
+    Vec2F current = { 0.0, 0.0 };
+    Vec2F start = { 0.0, 0.0 };
+    Vec2F control = { 0.0, 0.0 };
+    char command = 0;
+    char previous = 0;
+
+    double v[7] = {};
+
+    auto read_numbers = [&](int count) {
+      for (int i = 0; i < count; ++i) {
+        if (!reader.read_number(v[i])) {
+          return false;
+        }
+      }
+
+      return true;
+    };
+
+    reader.skip_separators();
+
+    while (!reader.at_end()) {
+      if (!reader.next_is_number()) {
+        command = reader.read_command();
+      } else if (command == 0 || command == 'Z' || command == 'z') {
+        return Status::InvalidPathData;
+      }
+
+      if (previous == 0 && command != 'M' && command != 'm') {
+        return Status::InvalidPathData;
+      }
+
+      const bool relative = command >= 'a' && command <= 'z';
+      const Vec2F origin = relative ? current : Vec2F{ 0.0, 0.0 };
+      const char upper = relative ? static_cast<char>(command - 'a' + 'A') : command;
+
+      switch (upper) {
+        case 'M':
+          if (!read_numbers(2)) {
+            return Status::InvalidPathData;
+          }
+          current = start = { origin.x + v[0], origin.y + v[1] };
+          sink.move_to(current.x, current.y);
+          // subsequent pairs are implicit line_to
+          command = relative ? 'l' : 'L';
+          break;
+
+        case 'L':
+          if (!read_numbers(2)) {
+            return Status::InvalidPathData;
+          }
+          current = { origin.x + v[0], origin.y + v[1] };
+          sink.line_to(current.x, current.y);
+          break;
+
+        case 'H':
+          if (!read_numbers(1)) {
+            return Status::InvalidPathData;
+          }
+          current.x = origin.x + v[0];
+          sink.line_to(current.x, current.y);
+          break;
+
+        case 'V':
+          if (!read_numbers(1)) {
+            return Status::InvalidPathData;
+          }
+          current.y = origin.y + v[0];
+          sink.line_to(current.x, current.y);
+          break;
+
+        case 'C':
+          if (!read_numbers(6)) {
+            return Status::InvalidPathData;
+          }
+          control = { origin.x + v[2], origin.y + v[3] };
+          current = { origin.x + v[4], origin.y + v[5] };
+          sink.curve_to(origin.x + v[0], origin.y + v[1], control.x, control.y, current.x, current.y);
+          break;
+
+        case 'S':
+          {
+            if (!read_numbers(4)) {
+              return Status::InvalidPathData;
+            }
+            const Vec2F first = (previous == 'C' || previous == 'S') ? Vec2F{ 2 * current.x - control.x, 2 * current.y - control.y } : current;
+            control = { origin.x + v[0], origin.y + v[1] };
+            current = { origin.x + v[2], origin.y + v[3] };
+            sink.curve_to(first.x, first.y, control.x, control.y, current.x, current.y);
+          }
+          break;
+
+        case 'Q':
+        case 'T':
+          {
+            if (upper == 'Q') {
+              if (!read_numbers(4)) {
+                return Status::InvalidPathData;
+              }
+              control = { origin.x + v[0], origin.y + v[1] };
+              v[0] = v[2];
+              v[1] = v[3];
+            } else {
+              if (!read_numbers(2)) {
+                return Status::InvalidPathData;
+              }
+              control = (previous == 'Q' || previous == 'T') ? Vec2F{ 2 * current.x - control.x, 2 * current.y - control.y } : current;
+            }
+
+            const Vec2F end = { origin.x + v[0], origin.y + v[1] };
+            // quadratic curves are elevated to cubic curves
+            sink.curve_to(current.x + 2.0 / 3.0 * (control.x - current.x), current.y + 2.0 / 3.0 * (control.y - current.y), end.x + 2.0 / 3.0 * (control.x - end.x), end.y + 2.0 / 3.0 * (control.y - end.y), end.x, end.y);
+            current = end;
+          }
+          break;
+
+        case 'A':
+          {
+            bool large_arc = false;
+            bool sweep = false;
+
+            if (!read_numbers(3) || !reader.read_flag(large_arc) || !reader.read_flag(sweep) || !reader.read_number(v[3]) || !reader.read_number(v[4])) {
+              return Status::InvalidPathData;
+            }
+
+            const Vec2F end = { origin.x + v[3], origin.y + v[4] };
+            details::svg_arc_to(sink, current, { v[0], v[1] }, v[2], large_arc, sweep, end);
+            current = end;
+          }
+          break;
+
+        case 'Z':
+          sink.close_path();
+          current = start;
+          break;
+
+        default:
+          return Status::InvalidPathData;
+      }
+
+      previous = upper;
+      reader.skip_separators();
+    }
+
+    return Status::Success;
+  }
+
+  // memoises parsed SVG path data, a lookup does not allocate
+  // the least recently used paths are evicted when the paths use more than the budget, a path is valid until the next call
+  class SvgPathCache {
+  public:
+    // the budget is in bytes of data and path
+    explicit SvgPathCache(std::size_t budget = 4 * 1024 * 1024)
+    : m_budget(budget)
+    {
+    }
+
+    // the path and the status of the parsing, after an error the path has the segments before it
+    const PathBuffer& path(std::string_view data, Status& status)
+    {
+      const std::size_t hash = std::hash<std::string_view>()(data);
+      auto [first, last] = m_index.equal_range(hash);
+
+      for (auto it = first; it != last; ++it) {
+        if (it->second->data == data) {
+          m_entries.splice(m_entries.begin(), m_entries, it->second);
+          status = it->second->status;
+          return it->second->path;
+        }
+      }
+
+      m_entries.emplace_front();
+      Entry& entry = m_entries.front();
+      entry.hash = hash;
+      entry.data = data;
+      entry.status = parse_svg_path(data, entry.path);
+      entry.bytes = entry.data.size() + static_cast<std::size_t>(entry.path.data_size()) * sizeof(PathData);
+      m_index.emplace(hash, m_entries.begin());
+      m_bytes += entry.bytes;
+      trim();
+
+      status = entry.status;
+      return entry.path;
+    }
+
+    const PathBuffer& path(std::string_view data)
+    {
+      Status status = Status::Success;
+      return path(data, status);
+    }
+
+    std::size_t size() const { return m_entries.size(); }
+    std::size_t bytes() const { return m_bytes; }
+
+    void clear()
+    {
+      m_entries.clear();
+      m_index.clear();
+      m_bytes = 0;
+    }
+
+    void set_budget(std::size_t budget)
+    {
+      m_budget = budget;
+      trim();
+    }
+
+    std::size_t budget() const { return m_budget; }
+
+  private:
+    struct Entry {
+      std::size_t hash = 0;
+      std::string data;
+      Status status = Status::Success;
+      PathBuffer path;
+      std::size_t bytes = 0;
+    };
+
+    using EntryList = std::list<Entry>;
+
+    // the most recent path is kept, it has just been returned
+    void trim()
+    {
+      while (m_bytes > m_budget && m_entries.size() > 1) {
+        const auto entry = std::prev(m_entries.end());
+        auto [first, last] = m_index.equal_range(entry->hash);
+        m_index.erase(std::find_if(first, last, [&](const auto& item) { return item.second == entry; }));
+        m_bytes -= entry->bytes;
+        m_entries.erase(entry);
+      }
+    }
+
+    std::size_t m_budget = 0;
+    std::size_t m_bytes = 0;
+    EntryList m_entries;
+    std::unordered_multimap<std::size_t, EntryList::iterator> m_index;
+  };
+
+  /*
+   * path flattening
+   */
+
+  namespace details {
+
+    // the largest scale factor of the linear part of the matrix
+    inline double max_scale(const Matrix& matrix)
+    {
+      const Vec2F ex = matrix.transform_distance({ 1.0, 0.0 });
+      const Vec2F ey = matrix.transform_distance({ 0.0, 1.0 });
+      const double sum = ex.x * ex.x + ex.y * ex.y + ey.x * ey.x + ey.y * ey.y;
+      const double det = ex.x * ey.y - ex.y * ey.x;
+      return std::sqrt((sum + std::sqrt(std::max(0.0, sum * sum - 4 * det * det))) / 2);
+    }
+
+    template<typename Sink>
+    void flatten_curve(Vec2F p0, Vec2F p1, Vec2F p2, Vec2F p3, double tolerance, Sink& sink)
+    {
+      // Wang's formula gives the number of segments needed for the tolerance
+      const double dd1 = std::hypot(p0.x - 2 * p1.x + p2.x, p0.y - 2 * p1.y + p2.y);
+      const double dd2 = std::hypot(p1.x - 2 * p2.x + p3.x, p1.y - 2 * p2.y + p3.y);
+      const double segments = std::ceil(std::sqrt(0.75 * std::max(dd1, dd2) / tolerance));
+      const int count = std::isfinite(segments) ? std::clamp(static_cast<int>(segments), 1, 1 << 16) : 1;
+
+      // power basis: p(t) = ((a t + b) t + c) t + p0
+      const Vec2F c = { 3 * (p1.x - p0.x), 3 * (p1.y - p0.y) };
+      const Vec2F b = { 3 * (p2.x - 2 * p1.x + p0.x), 3 * (p2.y - 2 * p1.y + p0.y) };
+      const Vec2F a = { p3.x - p0.x - c.x - b.x, p3.y - p0.y - c.y - b.y };
+      const double step = 1.0 / count;
+
+      // evaluated by blocks of independent points so that the compiler can vectorize
+      constexpr int BlockSize = 8;
+      double xs[BlockSize];
+      double ys[BlockSize];
+
+      for (int first = 1; first < count; first += BlockSize) {
+        for (int k = 0; k < BlockSize; ++k) {
+          const double t = (first + k) * step;
+          xs[k] = ((a.x * t + b.x) * t + c.x) * t + p0.x;
+          ys[k] = ((a.y * t + b.y) * t + c.y) * t + p0.y;
+        }
+
+        const int block_count = std::min(BlockSize, count - first);
+
+        for (int k = 0; k < block_count; ++k) {
+          sink.line_to(xs[k], ys[k]);
+        }
+      }
+
+      sink.line_to(p3.x, p3.y);
+    }
+
+    template<typename P>
+    bool is_flat(const P& path)
+    {
+      return std::none_of(path.begin(), path.end(), [](PathElement element) { return element.type() == PathDataType::CurveTo; });
+    }
+
+    template<typename P>
+    void flatten_path(const P& input, double tolerance, PathBuffer& output)
+    {
+      assert(tolerance > 0.0);
+      output.new_path();
+      output.reserve(input.data_size());
+
+      for (const PathElement element : input) {
+        switch (element.type()) {
+          case PathDataType::MoveTo:
+            output.move_to(element.point(1));
+            break;
+          case PathDataType::LineTo:
+            output.line_to(element.point(1));
+            break;
+          case PathDataType::CurveTo:
+            if (!output.has_current_point()) {
+              output.move_to(element.point(1));
+            }
+            flatten_curve(output.current_point(), element.point(1), element.point(2), element.point(3), tolerance, output);
+            break;
+          case PathDataType::ClosePath:
+            output.close_path();
+            break;
+        }
+      }
+    }
+
+  }
+
+  // flattens the curves of the path into line segments, with the same meaning of tolerance as Context::set_tolerance
+  inline void flatten_path(const PathBuffer& input, double tolerance, PathBuffer& output) { details::flatten_path(input, tolerance, output); }
+  inline void flatten_path(const Path& input, double tolerance, PathBuffer& output) { details::flatten_path(input, tolerance, output); }
+  // the tolerance is in device units
+  inline void flatten_path(const PathBuffer& input, double tolerance, const Matrix& user_to_device, PathBuffer& output) { details::flatten_path(input, tolerance / details::max_scale(user_to_device), output); }
+  inline void flatten_path(const Path& input, double tolerance, const Matrix& user_to_device, PathBuffer& output) { details::flatten_path(input, tolerance / details::max_scale(user_to_device), output); }
+
+  /*
+   * pattern
+   */
+
+  enum class PatternType : std::underlying_type_t<cairo_pattern_type_t> { // NOLINT(performance-enum-size)
+    Solid = CAIRO_PATTERN_TYPE_SOLID,
+    Surface = CAIRO_PATTERN_TYPE_SURFACE,
+    Linear = CAIRO_PATTERN_TYPE_LINEAR,
+    Radial = CAIRO_PATTERN_TYPE_RADIAL,
+    Mesh = CAIRO_PATTERN_TYPE_MESH,
+    RasterSource = CAIRO_PATTERN_TYPE_RASTER_SOURCE,
+  };
+
+  enum class Extend : std::underlying_type_t<cairo_extend_t> { // NOLINT(performance-enum-size)
+    None = CAIRO_EXTEND_NONE,
+    Repeat = CAIRO_EXTEND_REPEAT,
+    Reflect = CAIRO_EXTEND_REFLECT,
+    Pad = CAIRO_EXTEND_PAD,
+  };
+
+  enum class Filter : std::underlying_type_t<cairo_filter_t> { // NOLINT(performance-enum-size)
+    Fast = CAIRO_FILTER_FAST,
     Good = CAIRO_FILTER_GOOD,
     Best = CAIRO_FILTER_BEST,
     Nearest = CAIRO_FILTER_NEAREST,
@@ -703,713 +2230,6266 @@ namespace cairo {
     Gaussian = CAIRO_FILTER_GAUSSIAN,
   };
 
-  class Pattern {
+  class Pattern {
+  public:
+    Status status() { return static_cast<Status>(cairo_pattern_status(m_pattern)); }
+    PatternType type() { return static_cast<PatternType>(cairo_pattern_get_type(m_pattern)); }
+
+    void set_matrix(const Matrix& m) { cairo_pattern_set_matrix(m_pattern, m); }
+    Matrix matrix() { Matrix m; cairo_pattern_get_matrix(m_pattern, m); return m; }
+
+    void set_extend(Extend e) { cairo_pattern_set_extend(m_pattern, static_cast<cairo_extend_t>(e)); }
+    Extend extend() { return static_cast<Extend>(cairo_pattern_get_extend(m_pattern)); }
+
+    void set_filter(Filter f) { cairo_pattern_set_filter(m_pattern, static_cast<cairo_filter_t>(f)); }
+    Filter filter() { return static_cast<Filter>(cairo_pattern_get_filter(m_pattern)); }
+
+  protected:
+    Pattern(cairo_pattern_t* pat)
+    : m_pattern(pat)
+    {
+    }
+
+    Pattern(cairo_pattern_t* pat, [[maybe_unused]] details::IncreaseReferenceType incr)
+    : m_pattern(pat, details::IncreaseReference)
+    {
+    }
+
+    cairo_pattern_t* raw() { return m_pattern; }
+
+  private:
+    Pattern(cairo_pattern_t* pat, [[maybe_unused]] details::BorrowReferenceType borrow)
+    : m_pattern(pat)
+    {
+    }
+
+    void release() { m_pattern.release(); }
+
+    friend class Context;
+    friend class CommandBuffer;
+    template<typename T>
+    friend class details::Ref;
+    details::Handle<cairo_pattern_t, cairo_pattern_reference, cairo_pattern_destroy> m_pattern;
+  };
+
+  using PatternRef = details::Ref<Pattern>;
+
+  /*
+   * device
+   */
+
+  enum class DeviceType : std::underlying_type_t<cairo_device_type_t> { // NOLINT(performance-enum-size)
+    Drm = CAIRO_DEVICE_TYPE_DRM,
+    Gl = CAIRO_DEVICE_TYPE_GL,
+    Script = CAIRO_DEVICE_TYPE_SCRIPT,
+    Xcb = CAIRO_DEVICE_TYPE_XCB,
+    Xlib = CAIRO_DEVICE_TYPE_XLIB,
+    Xml = CAIRO_DEVICE_TYPE_XML,
+    Cogl = CAIRO_DEVICE_TYPE_COGL,
+    Win32 = CAIRO_DEVICE_TYPE_WIN32,
+
+    Invalid = CAIRO_DEVICE_TYPE_INVALID,
+  };
+
+  class Device {
+  public:
+    DeviceType type() { return static_cast<DeviceType>(cairo_device_get_type(m_device)); }
+    Status status() { return static_cast<Status>(cairo_device_status(m_device)); }
+
+    Status acquire() { return static_cast<Status>(cairo_device_acquire(m_device)); }
+    void release() { cairo_device_release(m_device); }
+
+    void flush() { cairo_device_flush(m_device); }
+    void finish() { cairo_device_finish(m_device); }
+
+  private:
+    Device(cairo_device_t* dev, [[maybe_unused]] details::IncreaseReferenceType incr)
+    : m_device(dev, details::IncreaseReference)
+    {
+    }
+
+    friend class Surface;
+    details::Handle<cairo_device_t, cairo_device_reference, cairo_device_destroy> m_device;
+  };
+
+  /*
+   * surface
+   */
+
+  enum class SurfaceType : std::underlying_type_t<cairo_surface_type_t> { // NOLINT(performance-enum-size)
+    Image = CAIRO_SURFACE_TYPE_IMAGE,
+    Pdf = CAIRO_SURFACE_TYPE_PDF,
+    Ps = CAIRO_SURFACE_TYPE_PS,
+    Xlib = CAIRO_SURFACE_TYPE_XLIB,
+    Xcb = CAIRO_SURFACE_TYPE_XCB,
+    Glitz = CAIRO_SURFACE_TYPE_GLITZ,
+    Quartz = CAIRO_SURFACE_TYPE_QUARTZ,
+    Win32 = CAIRO_SURFACE_TYPE_WIN32,
+    Beos = CAIRO_SURFACE_TYPE_BEOS,
+    Directfb = CAIRO_SURFACE_TYPE_DIRECTFB,
+    Svg = CAIRO_SURFACE_TYPE_SVG,
+    Os2 = CAIRO_SURFACE_TYPE_OS2,
+    Win32Printing = CAIRO_SURFACE_TYPE_WIN32_PRINTING,
+    QuartzImage = CAIRO_SURFACE_TYPE_QUARTZ_IMAGE,
+    Script = CAIRO_SURFACE_TYPE_SCRIPT,
+    Qt = CAIRO_SURFACE_TYPE_QT,
+    Recording = CAIRO_SURFACE_TYPE_RECORDING,
+    Vg = CAIRO_SURFACE_TYPE_VG,
+    Gl = CAIRO_SURFACE_TYPE_GL,
+    Drm = CAIRO_SURFACE_TYPE_DRM,
+    Tee = CAIRO_SURFACE_TYPE_TEE,
+    Xml = CAIRO_SURFACE_TYPE_XML,
+    Skia = CAIRO_SURFACE_TYPE_SKIA,
+    Subsurface = CAIRO_SURFACE_TYPE_SUBSURFACE,
+    Cogl = CAIRO_SURFACE_TYPE_COGL,
+  };
+
+  class Surface {
+  public:
+    Status status() { return static_cast<Status>(cairo_surface_status(m_surface)); }
+    unsigned reference_count() { return cairo_surface_get_reference_count(m_surface); }
+    SurfaceType type() { return static_cast<SurfaceType>(cairo_surface_get_type(m_surface)); }
+    Content content() { return static_cast<Content>(cairo_surface_get_content(m_surface)); }
+
+    Surface create_similar(Content cnt, int width, int height) { return cairo_surface_create_similar(m_surface, static_cast<cairo_content_t>(cnt), width, height); }
+    Surface create_similar(Content cnt, Vec2I size) { return cairo_surface_create_similar(m_surface, static_cast<cairo_content_t>(cnt), size.x, size.y); }
+    Surface create_similar_image(Format fmt, int width, int height) { return cairo_surface_create_similar_image(m_surface, static_cast<cairo_format_t>(fmt), width, height); }
+    Surface create_similar_image(Format fmt, Vec2I size) { return cairo_surface_create_similar_image(m_surface, static_cast<cairo_format_t>(fmt), size.x, size.y); }
+    Surface create_for_rectangle(double x, double y, double width, double height) { return cairo_surface_create_for_rectangle(m_surface, x, y, width, height); }
+    Surface create_for_rectangle(RectF rectangle) { return cairo_surface_create_for_rectangle(m_surface, rectangle.x, rectangle.y, rectangle.w, rectangle.h); }
+
+    void finish() { cairo_surface_finish(m_surface); }
+
+    Device device() { return { cairo_surface_get_device(m_surface), details::IncreaseReference };  }
+
+#if CAIRO_HAS_PNG_FUNCTIONS
+    Status write_to_png(const char* filename) { return static_cast<Status>(cairo_surface_write_to_png(m_surface, filename)); }
+    Status write_to_png(const std::filesystem::path& filename) { return static_cast<Status>(cairo_surface_write_to_png(m_surface, filename.string().c_str())); }
+
+    // write(data, length) receives the bytes of the png as they are encoded and returns a Status
+    template<typename Func>
+    Status write_to_png_stream(Func write)
+    {
+      auto write_func = [](void* closure, const unsigned char* data, unsigned int length) {
+        return static_cast<cairo_status_t>((*static_cast<Func*>(closure))(data, length));
+      };
+
+      return static_cast<Status>(cairo_surface_write_to_png_stream(m_surface, write_func, &write));
+    }
+#endif
+
+    FontOptions font_options() { FontOptions opt; cairo_surface_get_font_options(m_surface, opt.m_options); return opt; };
+
+    void flush() { cairo_surface_flush(m_surface); }
+    void mark_dirty() { cairo_surface_mark_dirty(m_surface); }
+    void mark_dirty_rectangle(int x, int y, int width, int height) { cairo_surface_mark_dirty_rectangle(m_surface, x, y, width, height); }
+    void mark_dirty_rectangle(RectI rectangle) { cairo_surface_mark_dirty_rectangle(m_surface, rectangle.x, rectangle.y, rectangle.w, rectangle.h); }
+    // marks a region in pixels of the surface, cairo adds the device offset of the surface to the dirty rectangles
+    void mark_dirty(const Region& region)
+    {
+      const Vec2F offset = device_offset();
+      const auto x_offset = static_cast<int>(std::lround(offset.x));
+      const auto y_offset = static_cast<int>(std::lround(offset.y));
+
+      for (const RectI rectangle : region) {
+        cairo_surface_mark_dirty_rectangle(m_surface, rectangle.x - x_offset, rectangle.y - y_offset, rectangle.w, rectangle.h);
+      }
+    }
+
+    void set_device_scale(double x_scale, double y_scale) { cairo_surface_set_device_scale(m_surface, x_scale, y_scale); }
+    void set_device_scale(Vec2F scale) { cairo_surface_set_device_scale(m_surface, scale.x, scale.y); }
+    Vec2F device_scale() { Vec2F scale; cairo_surface_get_device_scale(m_surface, &scale.x, &scale.y); return scale; }
+    void set_device_offset(double x_offset, double y_offset) { cairo_surface_set_device_offset(m_surface, x_offset, y_offset); }
+    void set_device_offset(Vec2F offset) { cairo_surface_set_device_offset(m_surface, offset.x, offset.y); }
+    Vec2F device_offset() { Vec2F offset; cairo_surface_get_device_offset(m_surface, &offset.x, &offset.y); return offset; }
+    void set_fallback_resolution(double x_pixels_per_inch, double y_pixels_per_inch) { cairo_surface_set_fallback_resolution(m_surface, x_pixels_per_inch, y_pixels_per_inch); }
+    void set_fallback_resolution(Vec2F pixels_per_inch) { cairo_surface_set_fallback_resolution(m_surface, pixels_per_inch.x, pixels_per_inch.y); }
+    Vec2F fallback_resolution() { Vec2F pixels_per_inch; cairo_surface_get_fallback_resolution(m_surface, &pixels_per_inch.x, &pixels_per_inch.y); return pixels_per_inch; }
+
+    void copy_page() { cairo_surface_copy_page(m_surface); }
+    void show_page() { cairo_surface_show_page(m_surface); }
+    bool has_show_text_glyphs() { return cairo_surface_has_show_text_glyphs(m_surface) != 0; }
+
+  protected:
+    Surface(cairo_surface_t* surf)
+    : m_surface(surf)
+    {
+    }
+
+    Surface(cairo_surface_t* surf, [[maybe_unused]] details::IncreaseReferenceType incr)
+    : m_surface(surf, details::IncreaseReference)
+    {
+    }
+
+    cairo_surface_t* raw() { return m_surface; }
+
+  private:
+    Surface(cairo_surface_t* surf, [[maybe_unused]] details::BorrowReferenceType borrow)
+    : m_surface(surf)
+    {
+    }
+
+    void release() { m_surface.release(); }
+
+    friend class Context;
+    friend class CommandBuffer;
+    friend class SurfacePattern;
+    template<typename T>
+    friend class details::Ref;
+    details::Handle<cairo_surface_t, cairo_surface_reference, cairo_surface_destroy> m_surface;
+  };
+
+  using SurfaceRef = details::Ref<Surface>;
+
+  /*
+   * context
+   */
+
+  struct DashArray {
+    std::vector<double> dashes;
+    double offset = 0.0;
+  };
+
+  class Context {
+  public:
+    Context(Surface& surf)
+    : m_context(cairo_create(surf.m_surface))
+    {
+    }
+
+    Status status() { return static_cast<Status>(cairo_status(m_context)); }
+    Surface target() { return { cairo_get_target(m_context), details::IncreaseReference }; }
+    SurfaceRef target_ref() { return { cairo_get_target(m_context), details::BorrowReference }; }
+
+    void save() { cairo_save(m_context); }
+    void restore() { cairo_restore(m_context); }
+
+    void push_group() { cairo_push_group(m_context); }
+    void push_group_with_content(Content c) { cairo_push_group_with_content(m_context, static_cast<cairo_content_t>(c)); }
+    Pattern pop_group() { return cairo_pop_group(m_context); }
+    void pop_group_to_source() { cairo_pop_group_to_source(m_context); }
+    Surface group_target() { return { cairo_get_group_target(m_context), details::IncreaseReference }; }
+    SurfaceRef group_target_ref() { return { cairo_get_group_target(m_context), details::BorrowReference }; }
+
+    // modify state
+
+    void set_compositing_operator(Operator op) { cairo_set_operator(m_context, static_cast<cairo_operator_t>(op)); }
+    Operator compositing_operator() { return static_cast<Operator>(cairo_get_operator(m_context)); }
+    void set_source(Pattern& pat) { cairo_set_source(m_context, pat.m_pattern); }
+    Pattern source() { return { cairo_get_source(m_context), details::IncreaseReference }; }
+    PatternRef source_ref() { return { cairo_get_source(m_context), details::BorrowReference }; }
+    void set_source(Surface& surf, double x, double y) { cairo_set_source_surface(m_context, surf.m_surface, x, y); }
+    void set_source(Surface& surf, Vec2F origin) { cairo_set_source_surface(m_context, surf.m_surface, origin.x, origin.y); }
+    void set_source_rgb(double red, double green, double blue) { cairo_set_source_rgb(m_context, red, green, blue); }
+    void set_source_rgba(double red, double green, double blue, double alpha) { cairo_set_source_rgba(m_context, red, green, blue, alpha); }
+    void set_source_color(Color col) { cairo_set_source_rgba(m_context, col.r, col.g, col.b, col.a); }
+    void set_tolerance(double tolerance) { cairo_set_tolerance(m_context, tolerance); }
+    double tolerance() { return cairo_get_tolerance(m_context); }
+
+    void set_antialias(Antialias aa) { cairo_set_antialias(m_context, static_cast<cairo_antialias_t>(aa)); }
+    Antialias antialias() { return static_cast<Antialias>(cairo_get_antialias(m_context)); }
+
+    void set_fill_rule(FillRule fr) { cairo_set_fill_rule(m_context, static_cast<cairo_fill_rule_t>(fr)); }
+    FillRule fill_rule() { return static_cast<FillRule>(cairo_get_fill_rule(m_context)); }
+    void set_line_width(double width) { cairo_set_line_width(m_context, width); }
+    double line_width() { return cairo_get_line_width(m_context); }
+    void set_line_cap(LineCap lc) { cairo_set_line_cap(m_context, static_cast<cairo_line_cap_t>(lc)); }
+    LineCap line_cap() { return static_cast<LineCap>(cairo_get_line_cap(m_context)); }
+    void set_line_join(LineJoin lj) { cairo_set_line_join(m_context, static_cast<cairo_line_join_t>(lj)); }
+    LineJoin line_join() { return static_cast<LineJoin>(cairo_get_line_join(m_context)); }
+
+    void set_dash(const double* dashes, int num_dashes, double offset) { cairo_set_dash(m_context, dashes, num_dashes, offset); };
+    template<typename T>
+    void set_dash(const T& dashes, double offset) { cairo_set_dash(m_context, std::data(dashes), static_cast<int>(std::size(dashes)), offset); }
+    int dash_count() { return cairo_get_dash_count(m_context); }
+    DashArray dash()
+    {
+      const int count = dash_count();
+      DashArray array;
+      array.dashes.resize(count);
+      cairo_get_dash(m_context, array.dashes.data(), &array.offset);
+      return array;
+    }
+
+    void set_miter_limit(double limit) { cairo_set_miter_limit(m_context, limit); }
+    double mitter_limit() { return cairo_get_miter_limit(m_context); }
+
+    Context& translate(double tx, double ty) { cairo_translate(m_context, tx, ty); return *this; };
+    Context& translate(Vec2F translation) { cairo_translate(m_context, translation.x, translation.y); return *this; };
+    Context& scale(double sx, double sy) { cairo_scale(m_context, sx, sy); return *this; }
+    Context& scale(Vec2F scale) { cairo_scale(m_context, scale.x, scale.y); return *this; }
+    Context& rotate(double angle) { cairo_rotate(m_context, angle); return *this; }
+    Context& transform(const Matrix& m) { cairo_transform(m_context, m); return *this; }
+
+    void set_matrix(const Matrix& m) { cairo_set_matrix(m_context, m); }
+    Matrix matrix() { Matrix m; cairo_get_matrix(m_context, m); return m; }
+    void identity_matrix() { cairo_identity_matrix(m_context); }
+
+    Vec2F user_to_device(double x, double y) { cairo_user_to_device(m_context, &x, &y); return { x, y }; }
+    Vec2F user_to_device(Vec2F point) { cairo_user_to_device(m_context, &point.x, &point.y); return point; }
+    Vec2F user_to_device_distance(double dx, double dy) { cairo_user_to_device_distance(m_context, &dx, &dy); return { dx, dy }; }
+    Vec2F user_to_device_distance(Vec2F distance) { cairo_user_to_device_distance(m_context, &distance.x, &distance.y); return distance; }
+    Vec2F device_to_user(double x, double y) { cairo_device_to_user(m_context, &x, &y); return { x, y }; }
+    Vec2F device_to_user(Vec2F point) { cairo_device_to_user(m_context, &point.x, &point.y); return point; }
+    Vec2F device_to_user_distance(double dx, double dy) { cairo_device_to_user_distance(m_context, &dx, &dy); return { dx, dy }; }
+    Vec2F device_to_user_distance(Vec2F distance) { cairo_device_to_user_distance(m_context, &distance.x, &distance.y); return distance; }
+
+    // the device space to the pixels of the group target, with its device scale and offset
+    Matrix device_to_pixel_matrix()
+    {
+      Surface target = group_target();
+      const Vec2F scale = target.device_scale();
+      const Vec2F offset = target.device_offset();
+      return Matrix::create(scale.x, 0.0, 0.0, scale.y, offset.x, offset.y);
+    }
+
+    // sets the matrix so that the user space is the pixels of the group target
+    void set_pixel_matrix()
+    {
+      Matrix pixel_to_device = device_to_pixel_matrix();
+      pixel_to_device.invert();
+      cairo_set_matrix(m_context, pixel_to_device);
+    }
+
+    // the pixels of the group target covered by a rectangle in user space
+    RectI target_pixels(const RectF& rectangle)
+    {
+      const Matrix device_to_pixel = device_to_pixel_matrix();
+      const std::array<Vec2F, 4> corners = {
+        device_to_pixel.transform_point(user_to_device(rectangle.x, rectangle.y)),
+        device_to_pixel.transform_point(user_to_device(rectangle.x + rectangle.w, rectangle.y)),
+        device_to_pixel.transform_point(user_to_device(rectangle.x, rectangle.y + rectangle.h)),
+        device_to_pixel.transform_point(user_to_device(rectangle.x + rectangle.w, rectangle.y + rectangle.h)),
+      };
+
+      const auto [x_min, x_max] = std::minmax({ corners[0].x, corners[1].x, corners[2].x, corners[3].x });
+      const auto [y_min, y_max] = std::minmax({ corners[0].y, corners[1].y, corners[2].y, corners[3].y });
+      const auto x = static_cast<int>(std::floor(x_min));
+      const auto y = static_cast<int>(std::floor(y_min));
+      return { x, y, static_cast<int>(std::ceil(x_max)) - x, static_cast<int>(std::ceil(y_max)) - y };
+    }
+
+    // path creation function
+
+    Context& new_path() { cairo_new_path(m_context); return *this; }
+    Context& new_sub_path() { cairo_new_sub_path(m_context); return *this; }
+    Context& move_to(double x, double y) { cairo_move_to(m_context, x, y); return *this; }
+    Context& move_to(Vec2F point) { cairo_move_to(m_context, point.x, point.y); return *this; }
+    Context& line_to(double x, double y) { cairo_line_to(m_context, x, y); return *this; }
+    Context& line_to(Vec2F point) { cairo_line_to(m_context, point.x, point.y); return *this; }
+    Context& curve_to(double x1, double y1, double x2, double y2, double x3, double y3) { cairo_curve_to(m_context, x1, y1, x2, y2, x3, y3); return *this; }
+    Context& curve_to(Vec2F p1, Vec2F p2, Vec2F p3) { cairo_curve_to(m_context, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y); return *this; }
+    Context& arc(double xc, double yc, double radius, double angle1, double angle2) { cairo_arc(m_context, xc, yc, radius, angle1, angle2); return *this; }
+    Context& arc(Vec2F center, double radius, double angle1, double angle2) { cairo_arc(m_context, center.x, center.y, radius, angle1, angle2); return *this; }
+    Context& arc_negative(double xc, double yc, double radius, double angle1, double angle2) { cairo_arc_negative(m_context, xc, yc, radius, angle1, angle2); return *this; }
+    Context& arc_negative(Vec2F center, double radius, double angle1, double angle2) { cairo_arc_negative(m_context, center.x, center.y, radius, angle1, angle2); return *this; }
+    Context& rel_move_to(double dx, double dy) { cairo_rel_move_to(m_context, dx, dy); return *this; }
+    Context& rel_move_to(Vec2F d) { cairo_rel_move_to(m_context, d.x, d.y); return *this; }
+    Context& rel_line_to(double dx, double dy) { cairo_rel_line_to(m_context, dx, dy); return *this; }
+    Context& rel_line_to(Vec2F d) { cairo_rel_line_to(m_context, d.x, d.y); return *this; }
+    Context& rel_curve_to(double dx1, double dy1, double dx2, double dy2, double dx3, double dy3) { cairo_rel_curve_to(m_context, dx1, dy1, dx2, dy2, dx3, dy3); return *this; }
+    Context& rel_curve_to(Vec2F d1, Vec2F d2, Vec2F d3) { cairo_curve_to(m_context, d1.x, d1.y, d2.x, d2.y, d3.x, d3.y); return *this; }
+    Context& rectangle(double x, double y, double w, double h) { cairo_rectangle(m_context, x, y, w, h); return *this; }
+    Context& rectangle(const RectF& r) { cairo_rectangle(m_context, r.x, r.y, r.w, r.h); return *this; }
+    Context& polyline(const Vec2F* points, int num_points)
+    {
+      if (num_points > 0) {
+        cairo_move_to(m_context, points[0].x, points[0].y);
+
+        for (int i = 1; i < num_points; ++i) {
+          cairo_line_to(m_context, points[i].x, points[i].y);
+        }
+      }
+
+      return *this;
+    }
+    template<typename T>
+    Context& polyline(const T& points) { return polyline(std::data(points), static_cast<int>(std::size(points))); }
+    Context& polygon(const Vec2F* points, int num_points) { polyline(points, num_points); cairo_close_path(m_context); return *this; }
+    template<typename T>
+    Context& polygon(const T& points) { return polygon(std::data(points), static_cast<int>(std::size(points))); }
+    Context& polyline(const PointBufferF& points)
+    {
+      if (!points.empty()) {
+        const double* xs = points.x_data();
+        const double* ys = points.y_data();
+        cairo_move_to(m_context, xs[0], ys[0]);
+
+        for (int i = 1; i < points.size(); ++i) {
+          cairo_line_to(m_context, xs[i], ys[i]);
+        }
+      }
+
+      return *this;
+    }
+    Context& polygon(const PointBufferF& points) { polyline(points); cairo_close_path(m_context); return *this; }
+    Context& rectangles(const RectF* rectangles, int num_rectangles)
+    {
+      for (int i = 0; i < num_rectangles; ++i) {
+        cairo_rectangle(m_context, rectangles[i].x, rectangles[i].y, rectangles[i].w, rectangles[i].h);
+      }
+
+      return *this;
+    }
+    template<typename T>
+    Context& rectangles(const T& rectangles) { return this->rectangles(std::data(rectangles), static_cast<int>(std::size(rectangles))); }
+    Context& rectangles(const RectBufferF& rectangles)
+    {
+      const double* xs = rectangles.x_data();
+      const double* ys = rectangles.y_data();
+      const double* ws = rectangles.w_data();
+      const double* hs = rectangles.h_data();
+
+      for (int i = 0; i < rectangles.size(); ++i) {
+        cairo_rectangle(m_context, xs[i], ys[i], ws[i], hs[i]);
+      }
+
+      return *this;
+    }
+    void close_path() { cairo_close_path(m_context); }
+
+    RectF path_extents()
+    {
+      double x1 = 0.0;
+      double y1 = 0.0;
+      double x2 = 0.0;
+      double y2 = 0.0;
+      cairo_path_extents(m_context, &x1, &y1, &x2, &y2);
+      return { x1, y1, x2 - x1, y2 -y1 };
+    }
+
+    bool has_current_point() { return cairo_has_current_point(m_context) != 0; }
+    Vec2F current_point() { Vec2F point; cairo_get_current_point(m_context, &point.x, &point.y); return point; }
+
+    Path copy_path() { return cairo_copy_path(m_context); }
+    Path copy_path_flat() { return cairo_copy_path_flat(m_context); }
+    void append_path(const Path& p) { cairo_append_path(m_context, p.m_path); }
+    void append_path(const PathBuffer& p) { append_path(p.data(), p.data_size()); }
+    void append_path(const PathData* data, int num_data) { const cairo_path_t path = { CAIRO_STATUS_SUCCESS, const_cast<PathData*>(data), num_data }; cairo_append_path(m_context, &path); } // NOLINT(cppcoreguidelines-pro-type-const-cast)
+
+    // painting
+
+    void paint() { cairo_paint(m_context); }
+    void paint_with_alpha(double alpha) { cairo_paint_with_alpha(m_context, alpha); }
+    void mask(Pattern& pat) { cairo_mask(m_context, pat.m_pattern); }
+    void mask(Surface& surf, double surface_x, double surface_y) { cairo_mask_surface(m_context, surf.m_surface, surface_x, surface_y); }
+    void mask(Surface& surf, Vec2F origin) { cairo_mask_surface(m_context, surf.m_surface, origin.x, origin.y); }
+    void stroke() { cairo_stroke(m_context); }
+    void stroke_preserve() { cairo_stroke_preserve(m_context); }
+    void fill() { cairo_fill(m_context); }
+    void fill_preserve() { cairo_fill_preserve(m_context); }
+
+    // like new_path(), rectangle() and fill(), but the pixels are written directly when the rectangle covers whole pixels
+    // of an Argb32 or Rgb24 image target, inside the clip, with a solid source and the Source operator (or Over with an opaque color)
+    void fill_rect_aligned(const RectF& r)
+    {
+      if (!fill_rect_aligned_in_image(r)) {
+        cairo_new_path(m_context);
+        cairo_rectangle(m_context, r.x, r.y, r.w, r.h);
+        cairo_fill(m_context);
+      }
+    }
+
+    void fill_rect_aligned(double x, double y, double w, double h) { fill_rect_aligned({ x, y, w, h }); }
+
+    void copy_page() { cairo_copy_page(m_context); }
+    void show_page() { cairo_show_page(m_context); }
+
+    // insideness testing
+
+    bool in_stroke(double x, double y) { return cairo_in_stroke(m_context, x, y) != 0; }
+    bool in_stroke(Vec2F point) { return cairo_in_stroke(m_context, point.x, point.y) != 0; }
+    bool in_fill(double x, double y) { return cairo_in_fill(m_context, x, y) != 0; }
+    bool in_fill(Vec2F point) { return cairo_in_fill(m_context, point.x, point.y) != 0; }
+    bool in_clip(double x, double y) { return cairo_in_clip(m_context, x, y) != 0; }
+    bool in_clip(Vec2F point) { return cairo_in_clip(m_context, point.x, point.y) != 0; }
+
+    // rectangular extents
+
+    RectF stroke_extents()
+    {
+      double x1 = 0.0;
+      double y1 = 0.0;
+      double x2 = 0.0;
+      double y2 = 0.0;
+      cairo_stroke_extents(m_context, &x1, &y1, &x2, &y2);
+      return { x1, y1, x2 - x1, y2 -y1 };
+    }
+
+    RectF fill_extents()
+    {
+      double x1 = 0.0;
+      double y1 = 0.0;
+      double x2 = 0.0;
+      double y2 = 0.0;
+      cairo_fill_extents(m_context, &x1, &y1, &x2, &y2);
+      return { x1, y1, x2 - x1, y2 -y1 };
+    }
+
+    // clipping
+
+    void reset_clip() { cairo_reset_clip(m_context); }
+    void clip() { cairo_clip(m_context); }
+
+    // intersects the clip with a region in pixels of the group target, the current path is cleared
+    void clip_region(const Region& region)
+    {
+      Matrix matrix;
+      cairo_get_matrix(m_context, matrix);
+      set_pixel_matrix();
+      cairo_new_path(m_context);
+
+      for (const RectI rectangle : region) {
+        cairo_rectangle(m_context, rectangle.x, rectangle.y, rectangle.w, rectangle.h);
+      }
+
+      cairo_clip(m_context);
+      cairo_set_matrix(m_context, matrix);
+    }
+
+    // adds the pixels of the group target that stroking or filling the current path would change to a damage region
+    void add_stroke_damage(Region& damage) { add_damage(stroke_extents(), damage); }
+    void add_fill_damage(Region& damage) { add_damage(fill_extents(), damage); }
+    void clip_preserve() { cairo_clip_preserve(m_context); }
+    RectF clip_extents()
+    {
+      double x1 = 0.0;
+      double y1 = 0.0;
+      double x2 = 0.0;
+      double y2 = 0.0;
+      cairo_clip_extents(m_context, &x1, &y1, &x2, &y2);
+      return { x1, y1, x2 - x1, y2 -y1 };
+    }
+
+    std::vector<RectF> clip_rectangle_list()
+    {
+      std::unique_ptr<cairo_rectangle_list_t, decltype(&cairo_rectangle_list_destroy)> ptr(cairo_copy_clip_rectangle_list(m_context), cairo_rectangle_list_destroy);
+
+      if (ptr->status != CAIRO_STATUS_SUCCESS) {
+        return {};
+      }
+
+      std::vector<RectF> list;
+
+      for (int i = 0; i < ptr->num_rectangles; ++i) {
+        auto r = ptr->rectangles[i];
+        list.push_back({ r.x, r.y, r.width, r.height });
+      }
+
+      return list;
+    }
+
+    // logical structure tagging functions
+
+    void tag_begin(const char* tag_name, const char* attributes) { cairo_tag_begin(m_context, tag_name, attributes); }
+    void tag_end(const char* tag_name) { cairo_tag_end(m_context, tag_name); }
+
+    // text
+
+    void select_font_face(const char* family, FontSlant slant, FontWeight weight) { cairo_select_font_face(m_context, family, static_cast<cairo_font_slant_t>(slant), static_cast<cairo_font_weight_t>(weight)); }
+    void set_font_size(double size) { cairo_set_font_size(m_context, size); }
+    void set_font_matrix(const Matrix& m) { cairo_set_font_matrix(m_context, m); }
+    Matrix font_matrix() { Matrix m; cairo_get_font_matrix(m_context, m); return m; }
+    void set_font_options(const FontOptions& opt) { cairo_set_font_options(m_context, opt.m_options); }
+    FontOptions font_options() { FontOptions opt; cairo_get_font_options(m_context, opt.m_options); return opt; }
+    void set_font_face(FontFace& font) { cairo_set_font_face(m_context, font.m_font); }
+    FontFace font_face() { return { cairo_get_font_face(m_context), details::IncreaseReference }; }
+    FontFaceRef font_face_ref() { return { cairo_get_font_face(m_context), details::BorrowReference }; }
+    void set_scaled_font(ScaledFont& font) { cairo_set_scaled_font(m_context, font.m_font); }
+    ScaledFont scaled_font() { return { cairo_get_scaled_font(m_context), details::IncreaseReference }; }
+    ScaledFontRef scaled_font_ref() { return { cairo_get_scaled_font(m_context), details::BorrowReference }; }
+
+    void show_text(const char* utf8) { cairo_show_text(m_context, utf8); }
+    void show_glyphs(const glyph* glyphs, int num_glyphs) { cairo_show_glyphs(m_context, glyphs, num_glyphs); }
+    template<typename T>
+    void show_glyphs(const T& glyphs) { cairo_show_glyphs(m_context, std::data(glyphs), static_cast<int>(std::size(glyphs))); }
+    void show_text_glyphs(const char* utf8, int utf8_len, const glyph* glyphs, int num_glyphs, const text_cluster* clusters, int num_clusters, TextClusterFlags cluster_flags = TextClusterFlags::None) { cairo_show_text_glyphs(m_context, utf8, utf8_len, glyphs, num_glyphs, clusters, num_clusters, static_cast<cairo_text_cluster_flags_t>(cluster_flags)); }
+    template<typename T, typename U>
+    void show_text_glyphs(std::string_view utf8, const T& glyphs, const U& clusters, TextClusterFlags cluster_flags = TextClusterFlags::None) { cairo_show_text_glyphs(m_context, std::data(utf8), static_cast<int>(std::size(utf8)), std::data(glyphs), static_cast<int>(std::size(glyphs)), std::data(clusters), static_cast<int>(std::size(clusters)), cluster_flags); }
+    void text_path(const char* utf8) { cairo_text_path(m_context, utf8); }
+    void glyph_path(const glyph* glyphs, int num_glyphs) { cairo_glyph_path(m_context, glyphs, num_glyphs); }
+    template<typename T>
+    void glyph_path(const T& glyphs) { cairo_glyph_path(m_context, std::data(glyphs), static_cast<int>(std::size(glyphs))); }
+
+    TextExtents text_extents(const char* utf8) { TextExtents extents; cairo_text_extents(m_context, utf8, &extents); return extents; }
+    TextExtents glyph_extents(const glyph* glyphs, int num_glyphs) { TextExtents extents; cairo_glyph_extents(m_context, glyphs, num_glyphs, &extents); return extents; }
+    template<typename T>
+    TextExtents glyph_extents(const T& glyphs) { TextExtents extents; cairo_glyph_extents(m_context, std::data(glyphs), static_cast<int>(std::size(glyphs)), &extents); return extents; }
+    FontExtents font_extents() { FontExtents extents; cairo_font_extents(m_context, &extents); return extents; }
+
+  private:
+    void add_damage(const RectF& extents, Region& damage)
+    {
+      if (extents.w > 0.0 && extents.h > 0.0) {
+        damage.unite(target_pixels(extents));
+      }
+    }
+
+    bool fill_rect_aligned_in_image(const RectF& r)
+    {
+      cairo_surface_t* target = cairo_get_group_target(m_context);
+
+      if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE) {
+        return false;
+      }
+
+      const cairo_format_t format = cairo_image_surface_get_format(target);
+
+      if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+        return false;
+      }
+
+      cairo_matrix_t matrix;
+      cairo_get_matrix(m_context, &matrix);
+
+      if (matrix.xy != 0.0 || matrix.yx != 0.0) {
+        return false;
+      }
+
+      // the color, premultiplied and rounded like pixman
+      cairo_pattern_t* source = cairo_get_source(m_context);
+      Color color;
+
+      if (cairo_pattern_get_rgba(source, &color.r, &color.g, &color.b, &color.a) != CAIRO_STATUS_SUCCESS) {
+        return false;
+      }
+
+      const cairo_operator_t op = cairo_get_operator(m_context);
+      const bool opaque = color.a >= 1.0;
+
+      if (!(op == CAIRO_OPERATOR_SOURCE || (op == CAIRO_OPERATOR_OVER && opaque)) || (format == CAIRO_FORMAT_RGB24 && !opaque)) {
+        return false;
+      }
+
+      auto channel = [](double value) { return static_cast<std::uint32_t>(value * 65535.0 + 0.5) >> 8; };
+      const std::uint32_t pixel = channel(color.a) << 24 | channel(color.r * color.a) << 16 | channel(color.g * color.a) << 8 | channel(color.b * color.a);
+
+      // from user space to the pixels of the target
+      double scale_x = 1.0;
+      double scale_y = 1.0;
+      double offset_x = 0.0;
+      double offset_y = 0.0;
+      cairo_surface_get_device_scale(target, &scale_x, &scale_y);
+      cairo_surface_get_device_offset(target, &offset_x, &offset_y);
+
+      auto to_pixel = [&](double x, double y) {
+        return Vec2F{ (matrix.xx * x + matrix.x0) * scale_x + offset_x, (matrix.yy * y + matrix.y0) * scale_y + offset_y };
+      };
+
+      auto to_pixel_rect = [&](double x, double y, double w, double h, RectI& pixels) {
+        const Vec2F p0 = to_pixel(x, y);
+        const Vec2F p1 = to_pixel(x + w, y + h);
+        const double x0 = std::round(std::min(p0.x, p1.x));
+        const double y0 = std::round(std::min(p0.y, p1.y));
+        const double x1 = std::round(std::max(p0.x, p1.x));
+        const double y1 = std::round(std::max(p0.y, p1.y));
+        pixels = { static_cast<int>(x0), static_cast<int>(y0), static_cast<int>(x1 - x0), static_cast<int>(y1 - y0) };
+        constexpr double Epsilon = 1e-6;
+        return std::abs(std::min(p0.x, p1.x) - x0) < Epsilon && std::abs(std::min(p0.y, p1.y) - y0) < Epsilon && std::abs(std::max(p0.x, p1.x) - x1) < Epsilon && std::abs(std::max(p0.y, p1.y) - y1) < Epsilon;
+      };
+
+      RectI pixels = {};
+
+      if (!to_pixel_rect(r.x, r.y, r.w, r.h, pixels)) {
+        return false;
+      }
+
+      // the clip must contain the rectangle, the clip of an image target is always a list of rectangles when it is made of rectangles
+      std::unique_ptr<cairo_rectangle_list_t, decltype(&cairo_rectangle_list_destroy)> clip(cairo_copy_clip_rectangle_list(m_context), cairo_rectangle_list_destroy);
+
+      if (clip->status != CAIRO_STATUS_SUCCESS) {
+        return false;
+      }
+
+      const bool inside = std::any_of(clip->rectangles, clip->rectangles + clip->num_rectangles, [&](const cairo_rectangle_t& rectangle) {
+        RectI clip_pixels = {};
+        to_pixel_rect(rectangle.x, rectangle.y, rectangle.width, rectangle.height, clip_pixels);
+        return clip_pixels.x <= pixels.x && clip_pixels.y <= pixels.y && pixels.x + pixels.w <= clip_pixels.x + clip_pixels.w && pixels.y + pixels.h <= clip_pixels.y + clip_pixels.h;
+      });
+
+      if (!inside && pixels.w > 0 && pixels.h > 0) {
+        return false;
+      }
+
+      cairo_new_path(m_context);
+
+      if (pixels.w <= 0 || pixels.h <= 0) {
+        return true;
+      }
+
+      cairo_surface_flush(target);
+      unsigned char* data = cairo_image_surface_get_data(target);
+      const int stride = cairo_image_surface_get_stride(target);
+
+      for (int y = pixels.y; y < pixels.y + pixels.h; ++y) {
+        auto* row = reinterpret_cast<std::uint32_t*>(data + static_cast<std::ptrdiff_t>(y) * stride); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        std::fill_n(row + pixels.x, pixels.w, pixel);
+      }
+
+      // cairo adds the device offset of the surface to the dirty rectangle
+      cairo_surface_mark_dirty_rectangle(target, pixels.x - static_cast<int>(std::lround(offset_x)), pixels.y - static_cast<int>(std::lround(offset_y)), pixels.w, pixels.h);
+      return true;
+    }
+
+    details::Handle<cairo_t, cairo_reference, cairo_destroy> m_context;
+  };
+
+  class CachedContext;
+
+  class Subcontext {
+  public:
+    Subcontext(Context& ctx)
+    : m_context(&ctx)
+    {
+      m_context->save();
+    }
+
+    inline Subcontext(CachedContext& ctx);
+
+    Subcontext(const Subcontext&) = delete;
+    Subcontext(Subcontext&&) noexcept = delete;
+
+    ~Subcontext()
+    {
+      if (m_cached_context != nullptr) {
+        restore_cached_context();
+      } else {
+        m_context->restore();
+      }
+    }
+
+    Subcontext& operator=(const Subcontext&) = delete;
+    Subcontext& operator=(Subcontext&&) noexcept = delete;
+
+  private:
+    inline void restore_cached_context();
+
+    Context* m_context = nullptr;
+    CachedContext* m_cached_context = nullptr;
+  };
+
+  // like Subcontext, for a single attribute of the state, without a copy of the whole state
+
+  class MatrixScope {
+  public:
+    MatrixScope(Context& ctx)
+    : m_context(&ctx)
+    , m_matrix(ctx.matrix())
+    {
+    }
+
+    MatrixScope(const MatrixScope&) = delete;
+    MatrixScope(MatrixScope&&) noexcept = delete;
+
+    ~MatrixScope()
+    {
+      m_context->set_matrix(m_matrix);
+    }
+
+    MatrixScope& operator=(const MatrixScope&) = delete;
+    MatrixScope& operator=(MatrixScope&&) noexcept = delete;
+
+  private:
+    Context* m_context = nullptr;
+    Matrix m_matrix;
+  };
+
+  class SourceScope {
+  public:
+    SourceScope(Context& ctx)
+    : m_context(&ctx)
+    , m_source(ctx.source())
+    {
+    }
+
+    SourceScope(const SourceScope&) = delete;
+    SourceScope(SourceScope&&) noexcept = delete;
+
+    ~SourceScope()
+    {
+      m_context->set_source(m_source);
+    }
+
+    SourceScope& operator=(const SourceScope&) = delete;
+    SourceScope& operator=(SourceScope&&) noexcept = delete;
+
+  private:
+    Context* m_context = nullptr;
+    Pattern m_source;
+  };
+
+  class LineWidthScope {
+  public:
+    LineWidthScope(Context& ctx)
+    : m_context(&ctx)
+    , m_line_width(ctx.line_width())
+    {
+    }
+
+    LineWidthScope(const LineWidthScope&) = delete;
+    LineWidthScope(LineWidthScope&&) noexcept = delete;
+
+    ~LineWidthScope()
+    {
+      m_context->set_line_width(m_line_width);
+    }
+
+    LineWidthScope& operator=(const LineWidthScope&) = delete;
+    LineWidthScope& operator=(LineWidthScope&&) noexcept = delete;
+
+  private:
+    Context* m_context = nullptr;
+    double m_line_width = 2.0;
+  };
+
+  class OperatorScope {
+  public:
+    OperatorScope(Context& ctx)
+    : m_context(&ctx)
+    , m_operator(ctx.compositing_operator())
+    {
+    }
+
+    OperatorScope(const OperatorScope&) = delete;
+    OperatorScope(OperatorScope&&) noexcept = delete;
+
+    ~OperatorScope()
+    {
+      m_context->set_compositing_operator(m_operator);
+    }
+
+    OperatorScope& operator=(const OperatorScope&) = delete;
+    OperatorScope& operator=(OperatorScope&&) noexcept = delete;
+
+  private:
+    Context* m_context = nullptr;
+    Operator m_operator = Operator::Over;
+  };
+
+  // a facade of a context that skips the calls that set an attribute to the value it already has
+  // the context must only be modified through the facade, or invalidate() must be called after
+  class CachedContext {
+  public:
+    CachedContext(Context& ctx)
+    : m_context(&ctx)
+    {
+      invalidate();
+    }
+
+    // the context for the paths and the drawing, invalidate() must be called after changing an attribute in it
+    Context& context() { return *m_context; }
+
+    void save()
+    {
+      m_context->save();
+      m_stack.push_back(m_state);
+    }
+
+    void restore()
+    {
+      assert(!m_stack.empty());
+      m_context->restore();
+      m_state = std::move(m_stack.back());
+      m_stack.pop_back();
+    }
+
+    void set_source_rgb(double red, double green, double blue) { set_source_color({ red, green, blue, 1.0 }); }
+    void set_source_rgba(double red, double green, double blue, double alpha) { set_source_color({ red, green, blue, alpha }); }
+
+    void set_source_color(Color col)
+    {
+      if (m_state.has_color && m_state.color.r == col.r && m_state.color.g == col.g && m_state.color.b == col.b && m_state.color.a == col.a) {
+        ++m_elided;
+        return;
+      }
+
+      m_context->set_source_color(col);
+      m_state.color = col;
+      m_state.has_color = true;
+    }
+
+    void set_source(Pattern& pat)
+    {
+      m_context->set_source(pat);
+      m_state.has_color = false;
+    }
+
+    void set_line_width(double width) { update(m_state.line_width, width, &Context::set_line_width); }
+    void set_line_cap(LineCap lc) { update(m_state.line_cap, lc, &Context::set_line_cap); }
+    void set_line_join(LineJoin lj) { update(m_state.line_join, lj, &Context::set_line_join); }
+    void set_compositing_operator(Operator op) { update(m_state.compositing_operator, op, &Context::set_compositing_operator); }
+    void set_antialias(Antialias aa) { update(m_state.antialias, aa, &Context::set_antialias); }
+    void set_tolerance(double tolerance) { update(m_state.tolerance, tolerance, &Context::set_tolerance); }
+
+    void set_font_size(double size)
+    {
+      if (m_state.has_font_size && m_state.font_size == size) {
+        ++m_elided;
+        return;
+      }
+
+      m_context->set_font_size(size);
+      m_state.font_size = size;
+      m_state.has_font_size = true;
+    }
+
+    void set_font_matrix(const Matrix& m)
+    {
+      m_context->set_font_matrix(m);
+      m_state.has_font_size = false;
+    }
+
+    void select_font_face(const char* family, FontSlant slant, FontWeight weight)
+    {
+      if (m_state.has_font_face && m_state.font_family == family && m_state.font_slant == slant && m_state.font_weight == weight) {
+        ++m_elided;
+        return;
+      }
+
+      m_context->select_font_face(family, slant, weight);
+      m_state.font_family = family;
+      m_state.font_slant = slant;
+      m_state.font_weight = weight;
+      m_state.has_font_face = true;
+    }
+
+    void set_font_face(FontFace& font)
+    {
+      m_context->set_font_face(font);
+      m_state.has_font_face = false;
+    }
+
+    void set_scaled_font(ScaledFont& font)
+    {
+      m_context->set_scaled_font(font);
+      m_state.has_font_size = false;
+      m_state.has_font_face = false;
+    }
+
+    // reads the state of the context again, after a modification that did not go through the facade
+    void invalidate()
+    {
+      m_state = State();
+      m_state.line_width = m_context->line_width();
+      m_state.line_cap = m_context->line_cap();
+      m_state.line_join = m_context->line_join();
+      m_state.compositing_operator = m_context->compositing_operator();
+      m_state.antialias = m_context->antialias();
+      m_state.tolerance = m_context->tolerance();
+    }
+
+    // the number of calls that were not forwarded to the context
+    std::size_t elided() const { return m_elided; }
+    void reset_elided() { m_elided = 0; }
+
+  private:
+    template<typename T>
+    void update(T& current, T value, void (Context::*setter)(T))
+    {
+      if (current == value) {
+        ++m_elided;
+        return;
+      }
+
+      (m_context->*setter)(value);
+      current = value;
+    }
+
+    struct State {
+      Color color;
+      bool has_color = false;
+      double line_width = 2.0;
+      LineCap line_cap = LineCap::Butt;
+      LineJoin line_join = LineJoin::Miter;
+      Operator compositing_operator = Operator::Over;
+      Antialias antialias = Antialias::Default;
+      double tolerance = 0.1;
+      double font_size = 10.0;
+      bool has_font_size = false;
+      std::string font_family;
+      FontSlant font_slant = FontSlant::Normal;
+      FontWeight font_weight = FontWeight::Normal;
+      bool has_font_face = false;
+    };
+
+    Context* m_context = nullptr;
+    State m_state;
+    std::vector<State> m_stack;
+    std::size_t m_elided = 0;
+  };
+
+  inline Subcontext::Subcontext(CachedContext& ctx)
+  : m_context(&ctx.context())
+  , m_cached_context(&ctx)
+  {
+    m_cached_context->save();
+  }
+
+  inline void Subcontext::restore_cached_context()
+  {
+    m_cached_context->restore();
+  }
+
+  /*
+   * patterns
+   */
+
+  class SolidPattern : public Pattern {
+  public:
+    static SolidPattern create_rgb(double red, double green, double blue) { return cairo_pattern_create_rgb(red, green, blue); }
+    static SolidPattern create_rgba(double red, double green, double blue, double alpha) { return cairo_pattern_create_rgba(red, green, blue, alpha); }
+    static SolidPattern create_color(Color col) { return cairo_pattern_create_rgba(col.r, col.g, col.b, col.a); }
+
+    Color color() { Color col; cairo_pattern_get_rgba(raw(), &col.r, &col.g, &col.b, &col.a); return col; }
+
+
+  private:
+    SolidPattern(cairo_pattern_t* pat)
+    : Pattern(pat)
+    {
+    }
+  };
+
+  class SurfacePattern : public Pattern {
+  public:
+    static SurfacePattern create(Surface& surf) { return cairo_pattern_create_for_surface(surf.m_surface); }
+
+    Surface surface() { cairo_surface_t* surface = nullptr; cairo_pattern_get_surface(raw(), &surface); return { surface, details::IncreaseReference }; }
+    SurfaceRef surface_ref() { cairo_surface_t* surface = nullptr; cairo_pattern_get_surface(raw(), &surface); return { surface, details::BorrowReference }; }
+
+  private:
+    SurfacePattern(cairo_pattern_t* pat)
+    : Pattern(pat)
+    {
+    }
+  };
+
+  class GradientPattern : public Pattern {
+  public:
+
+    void add_color_stop_rgb(double offset, double red, double green, double blue) { cairo_pattern_add_color_stop_rgb(raw(), offset, red, green, blue); }
+    void add_color_stop_rgba(double offset, double red, double green, double blue, double alpha) { cairo_pattern_add_color_stop_rgba(raw(), offset, red, green, blue, alpha); }
+    void add_color_stop_color(double offset, Color col) { cairo_pattern_add_color_stop_rgba(raw(), offset, col.r, col.g, col.b, col.a); }
+
+    std::pair<double, Color> color_stop(int index)
+    {
+      double offset = 0.0;
+      Color col;
+      [[maybe_unused]] auto result = cairo_pattern_get_color_stop_rgba(raw(), index, &offset, &col.r, &col.g, &col.b, &col.a);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return { offset, col };
+    }
+
+    int color_stop_count()
+    {
+      int count = 0;
+      [[maybe_unused]] auto result = cairo_pattern_get_color_stop_count(raw(), &count);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return count;
+    }
+
+  protected:
+    GradientPattern(cairo_pattern_t* pat)
+    : Pattern(pat)
+    {
+    }
+  };
+
+  class LinearGradientPattern : public GradientPattern {
+  public:
+    static LinearGradientPattern create(double x0, double y0, double x1, double y1) { return cairo_pattern_create_linear(x0, y0, x1, y1); }
+    static LinearGradientPattern create(Vec2F p0, Vec2F p1) { return cairo_pattern_create_linear(p0.x, p0.y, p1.x, p1.y); }
+
+    std::pair<Vec2F, Vec2F> linear_points()
+    {
+      Vec2F p0;
+      Vec2F p1;
+      [[maybe_unused]] auto result = cairo_pattern_get_linear_points(raw(), &p0.x, &p0.y, &p1.x, &p1.y);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return { p0, p1 };
+    }
+
+  private:
+    LinearGradientPattern(cairo_pattern_t* pat)
+    : GradientPattern(pat)
+    {
+    }
+  };
+
+  class RadialGradientPattern : public GradientPattern {
+  public:
+    static RadialGradientPattern create(double cx0, double cy0, double radius0, double cx1, double cy1, double radius1) { return cairo_pattern_create_radial(cx0, cy0, radius0, cx1, cy1, radius1); }
+    static RadialGradientPattern create(Vec2F center0, double radius0, Vec2F center1, double radius1) { return cairo_pattern_create_radial(center0.x, center0.y, radius0, center1.x, center1.y, radius1); }
+
+    std::tuple<Vec2F, double, Vec2F, double> radial_circles()
+    {
+      Vec2F center0;
+      double radius0 = 0.0;
+      Vec2F center1;
+      double radius1 = 0.0;
+      [[maybe_unused]] auto result = cairo_pattern_get_radial_circles(raw(), &center0.x, &center0.y, &radius0, &center1.x, &center1.y, &radius1);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return { center0, radius0, center1, radius1 };
+    }
+
+  private:
+    RadialGradientPattern(cairo_pattern_t* pat)
+    : GradientPattern(pat)
+    {
+    }
+  };
+
+  class MeshPattern : public Pattern {
+  public:
+    static MeshPattern create() { return cairo_pattern_create_mesh(); }
+
+    void begin_patch() { cairo_mesh_pattern_begin_patch(raw()); }
+    void end_patch() { cairo_mesh_pattern_end_patch(raw()); }
+    void move_to(double x, double y) { cairo_mesh_pattern_move_to(raw(), x, y); }
+    void move_to(Vec2F point) { cairo_mesh_pattern_move_to(raw(), point.x, point.y); }
+    void line_to(double x, double y) { cairo_mesh_pattern_line_to(raw(), x, y); }
+    void line_to(Vec2F point) { cairo_mesh_pattern_line_to(raw(), point.x, point.y); }
+    void curve_to(double x1, double y1, double x2, double y2, double x3, double y3) { cairo_mesh_pattern_curve_to(raw(), x1, y1, x2, y2, x3, y3); }
+    void curve_to(Vec2F p1, Vec2F p2, Vec2F p3) { cairo_mesh_pattern_curve_to(raw(), p1.x, p1.y, p2.x, p2.y, p3.x, p3.y); }
+
+    void set_control_point(unsigned point_num, double x, double y) { cairo_mesh_pattern_set_control_point(raw(), point_num, x, y); }
+    void set_control_point(unsigned point_num, Vec2F point) { cairo_mesh_pattern_set_control_point(raw(), point_num, point.x, point.y); }
+    void set_corner_color_rgb(unsigned corner_num, double red, double green, double blue) { cairo_mesh_pattern_set_corner_color_rgb(raw(), corner_num, red, green, blue); }
+    void set_corner_color_rgba(unsigned corner_num, double red, double green, double blue, double alpha) { cairo_mesh_pattern_set_corner_color_rgba(raw(), corner_num, red, green, blue, alpha); }
+    void set_corner_color(unsigned corner_num, Color col) { cairo_mesh_pattern_set_corner_color_rgba(raw(), corner_num, col.r, col.g, col.b, col.a); }
+
+    unsigned patch_count()
+    {
+      unsigned count = 0;
+      [[maybe_unused]] auto result = cairo_mesh_pattern_get_patch_count(raw(), &count);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return count;
+    }
+
+    Path path(unsigned patch_num) { return cairo_mesh_pattern_get_path(raw(), patch_num); }
+
+    Color corner_color(unsigned patch_num, unsigned corner_num)
+    {
+      Color col;
+      [[maybe_unused]] auto result = cairo_mesh_pattern_get_corner_color_rgba(raw(), patch_num, corner_num, &col.r, &col.g, &col.b, &col.a);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return col;
+    }
+
+    Vec2F control_point(unsigned patch_num, unsigned point_num)
+    {
+      Vec2F point;
+      [[maybe_unused]] auto result = cairo_mesh_pattern_get_control_point(raw(), patch_num, point_num, &point.x, &point.y);
+      assert(result == CAIRO_STATUS_SUCCESS);
+      return point;
+    }
+
+  private:
+    MeshPattern(cairo_pattern_t* pat)
+    : Pattern(pat)
+    {
+    }
+  };
+
+  /*
+   * surfaces
+   */
+
+  inline int format_stride_for_width(Format fmt, int width) { return cairo_format_stride_for_width(static_cast<cairo_format_t>(fmt), width); }
+
+  class ImageSurface : public Surface {
+  public:
+    static ImageSurface create(Format fmt, int width, int height) { return cairo_image_surface_create(static_cast<cairo_format_t>(fmt), width, height); }
+    static ImageSurface create(Format fmt, Vec2I size) { return cairo_image_surface_create(static_cast<cairo_format_t>(fmt), size.x, size.y); }
+    static ImageSurface create_for_data(unsigned char* data, Format fmt, int width, int height, int stride) { return cairo_image_surface_create_for_data(data, static_cast<cairo_format_t>(fmt), width, height, stride); }
+    static ImageSurface create_for_data(unsigned char* data, Format fmt, Vec2I size, int stride) { return cairo_image_surface_create_for_data(data, static_cast<cairo_format_t>(fmt), size.x, size.y, stride); }
+
+#if CAIRO_HAS_PNG_FUNCTIONS
+    static ImageSurface create_from_png(const char* filename) { return cairo_image_surface_create_from_png(filename);  }
+    static ImageSurface create_from_png(const std::filesystem::path& filename) { return cairo_image_surface_create_from_png(filename.string().c_str());  }
+#endif
+
+    unsigned char* data() { return cairo_image_surface_get_data(raw()); }
+    Format format() { return static_cast<Format>(cairo_image_surface_get_format(raw())); }
+    int width() { return cairo_image_surface_get_width(raw()); }
+    int height() { return cairo_image_surface_get_height(raw()); }
+    int stride() { return cairo_image_surface_get_stride(raw()); }
+
+
+  private:
+    ImageSurface(cairo_surface_t* surf)
+    : Surface(surf)
+    {
+    }
+  };
+
+  class RecordingSurface : public Surface {
+  public:
+    static RecordingSurface create(Content cnt, RectF extents) { const cairo_rectangle_t rectangle = { extents.x, extents.y, extents.w, extents.h }; return cairo_recording_surface_create(static_cast<cairo_content_t>(cnt), &rectangle); }
+    static RecordingSurface create(Content cnt) { return cairo_recording_surface_create(static_cast<cairo_content_t>(cnt), nullptr); }
+
+    RectF ink_extents() { RectF extents; cairo_recording_surface_ink_extents(raw(), &extents.x, &extents.y, &extents.w, &extents.h); return extents; }
+    std::pair<bool, RectF> extents() { cairo_rectangle_t extents; auto ret = cairo_recording_surface_get_extents(raw(), &extents); return { ret != 0, { extents.x, extents.y, extents.width, extents.height }}; }
+
+  private:
+    RecordingSurface(cairo_surface_t* surf)
+    : Surface(surf)
+    {
+    }
+  };
+
+#if CAIRO_HAS_PDF_SURFACE
+
+  enum class PdfVersion : std::underlying_type_t<cairo_pdf_version_t> { // NOLINT(performance-enum-size)
+    V_1_4,
+    V_1_5,
+  };
+
+  inline std::string_view to_string(PdfVersion version) { return cairo_pdf_version_to_string(static_cast<cairo_pdf_version_t>(version)); }
+
+  enum class PdfOutlineFlags : std::underlying_type_t<cairo_pdf_outline_flags_t> { // NOLINT(performance-enum-size)
+    Open = CAIRO_PDF_OUTLINE_FLAG_OPEN,
+    Bold = CAIRO_PDF_OUTLINE_FLAG_BOLD,
+    Italic = CAIRO_PDF_OUTLINE_FLAG_ITALIC,
+  };
+
+  inline constexpr int PdfOutlineRoot = CAIRO_PDF_OUTLINE_ROOT;
+
+  enum class PdfMetadata : std::underlying_type_t<cairo_pdf_metadata_t> { // NOLINT(performance-enum-size)
+    Title = CAIRO_PDF_METADATA_TITLE,
+    Author = CAIRO_PDF_METADATA_AUTHOR,
+    Subject = CAIRO_PDF_METADATA_SUBJECT,
+    Keywords = CAIRO_PDF_METADATA_KEYWORDS,
+    Creator = CAIRO_PDF_METADATA_CREATOR,
+    Date = CAIRO_PDF_METADATA_CREATE_DATE,
+    ModDate = CAIRO_PDF_METADATA_MOD_DATE,
+  };
+
+  class PdfSurface : public Surface {
+  public:
+    static PdfSurface create(const char* filename, double width_in_points, double height_in_points) { return cairo_pdf_surface_create(filename, width_in_points, height_in_points); }
+    static PdfSurface create(const std::filesystem::path& filename, double width_in_points, double height_in_points) { return cairo_pdf_surface_create(filename.string().c_str(), width_in_points, height_in_points); }
+
+    void restrict_to_version(PdfVersion version) { cairo_pdf_surface_restrict_to_version(raw(), static_cast<cairo_pdf_version_t>(version)); }
+
+    void set_size(double width_in_points, double height_in_points) {cairo_pdf_surface_set_size(raw(), width_in_points, height_in_points); }
+    void set_size(Vec2F size_in_points) {cairo_pdf_surface_set_size(raw(), size_in_points.x, size_in_points.y); }
+
+    void add_outline(int parent_id, const char* utf8, const char* link_attribs, PdfOutlineFlags flags) { cairo_pdf_surface_add_outline(raw(), parent_id, utf8, link_attribs, static_cast<cairo_pdf_outline_flags_t>(flags)); }
+
+    void set_metadata(PdfMetadata metadata, const char* utf8) { cairo_pdf_surface_set_metadata(raw(), static_cast<cairo_pdf_metadata_t>(metadata), utf8); }
+    void set_page_label(const char* utf8) { cairo_pdf_surface_set_page_label(raw(), utf8); }
+    void set_thumbnail_size(int width, int height) { cairo_pdf_surface_set_thumbnail_size(raw(), width, height); }
+    void set_thumbnail_size(Vec2I size) { cairo_pdf_surface_set_thumbnail_size(raw(), size.x, size.y); }
+
+    static std::vector<PdfVersion> versions()
+    {
+      const cairo_pdf_version_t* raw_versions = nullptr;
+      int raw_num_versions = 0;
+      cairo_pdf_get_versions(&raw_versions, &raw_num_versions);
+
+      std::vector<PdfVersion> versions;
+      versions.reserve(raw_num_versions);
+
+      for (int i = 0; i < raw_num_versions; ++i) {
+        versions.push_back(static_cast<PdfVersion>(raw_versions[i]));
+      }
+
+      return versions;
+    }
+
+  private:
+    PdfSurface(cairo_surface_t* surf)
+    : Surface(surf)
+    {
+    }
+  };
+
+#endif
+
+  namespace details {
+
+    // the user to device transformation, like user_to_device(), without the device scale and offset of the target
+    inline Matrix user_to_device_matrix(Context& ctx)
+    {
+      const Vec2F origin = ctx.user_to_device(0.0, 0.0);
+      const Vec2F ex = ctx.user_to_device(1.0, 0.0);
+      const Vec2F ey = ctx.user_to_device(0.0, 1.0);
+      return Matrix::create(ex.x - origin.x, ex.y - origin.y, ey.x - origin.x, ey.y - origin.y, origin.x, origin.y);
+    }
+
+    // the user space to the pixels of the target, including its device scale and offset
+    inline Matrix user_to_pixel_matrix(Context& ctx)
+    {
+      return user_to_device_matrix(ctx) * ctx.device_to_pixel_matrix();
+    }
+
+    inline double squared_distance_to_segment(Vec2F p, Vec2F a, Vec2F b)
+    {
+      const double dx = b.x - a.x;
+      const double dy = b.y - a.y;
+      const double length2 = dx * dx + dy * dy;
+      double t = 0.0;
+
+      if (length2 > 0.0) {
+        t = std::clamp(((p.x - a.x) * dx + (p.y - a.y) * dy) / length2, 0.0, 1.0);
+      }
+
+      const double ex = a.x + t * dx - p.x;
+      const double ey = a.y + t * dy - p.y;
+      return ex * ex + ey * ey;
+    }
+
+    inline bool intersects(const RectF& lhs, const RectF& rhs)
+    {
+      return lhs.x <= rhs.x + rhs.w && rhs.x <= lhs.x + lhs.w && lhs.y <= rhs.y + rhs.h && rhs.y <= lhs.y + lhs.h;
+    }
+
+  }
+
+  inline RectF polyline_extents(const Vec2F* points, int num_points)
+  {
+    details::Bounds bounds;
+
+    for (int i = 0; i < num_points; ++i) {
+      bounds.add(points[i]);
+    }
+
+    return bounds.rect();
+  }
+
+  template<typename T>
+  RectF polyline_extents(const T& points) { return polyline_extents(std::data(points), static_cast<int>(std::size(points))); }
+
+  /*
+   * polyline simplification
+   */
+
+  enum class PolylineSimplification : std::uint8_t {
+    None,
+    DouglasPeucker,
+    Visvalingam,
+  };
+
+  // reduces the number of points of a polyline before stroking, without visible change:
+  // first, only the first, lowest, highest and last points of each pixel column of the target are kept,
+  // then the polyline is simplified with the tolerance of the context (in pixels)
+  class PolylineReducer {
+  public:
+    const std::vector<Vec2F>& reduce(Context& ctx, const Vec2F* points, int num_points, PolylineSimplification simplification = PolylineSimplification::DouglasPeucker)
+    {
+      return reduce(details::user_to_pixel_matrix(ctx), ctx.tolerance(), points, num_points, simplification);
+    }
+
+    template<typename T>
+    const std::vector<Vec2F>& reduce(Context& ctx, const T& points, PolylineSimplification simplification = PolylineSimplification::DouglasPeucker)
+    {
+      return reduce(ctx, std::data(points), static_cast<int>(std::size(points)), simplification);
+    }
+
+    const std::vector<Vec2F>& reduce(const Matrix& user_to_device, double tolerance, const Vec2F* points, int num_points, PolylineSimplification simplification = PolylineSimplification::DouglasPeucker)
+    {
+      m_result.clear();
+
+      if (num_points <= 0) {
+        return m_result;
+      }
+
+      m_device.resize(num_points);
+
+      for (int i = 0; i < num_points; ++i) {
+        m_device[i] = user_to_device.transform_point(points[i]);
+      }
+
+      decimate_columns();
+
+      switch (simplification) {
+        case PolylineSimplification::None:
+          break;
+        case PolylineSimplification::DouglasPeucker:
+          simplify_douglas_peucker(tolerance);
+          break;
+        case PolylineSimplification::Visvalingam:
+          simplify_visvalingam(tolerance);
+          break;
+      }
+
+      m_result.reserve(m_indices.size());
+
+      for (const int index : m_indices) {
+        m_result.push_back(points[index]);
+      }
+
+      return m_result;
+    }
+
+  private:
+    void decimate_columns()
+    {
+      m_indices.clear();
+      const int count = static_cast<int>(m_device.size());
+      int first = 0;
+
+      while (first < count) {
+        const double column = std::floor(m_device[first].x);
+        int last = first;
+        int lowest = first;
+        int highest = first;
+
+        while (last + 1 < count && std::floor(m_device[last + 1].x) == column) {
+          ++last;
+
+          if (m_device[last].y < m_device[lowest].y) {
+            lowest = last;
+          }
+
+          if (m_device[last].y > m_device[highest].y) {
+            highest = last;
+          }
+        }
+
+        std::array<int, 4> run = { first, std::min(lowest, highest), std::max(lowest, highest), last };
+
+        for (const int index : run) {
+          if (m_indices.empty() || m_indices.back() != index) {
+            m_indices.push_back(index);
+          }
+        }
+
+        first = last + 1;
+      }
+    }
+
+    void simplify_douglas_peucker(double tolerance)
+    {
+      const int count = static_cast<int>(m_indices.size());
+
+      if (count <= 2) {
+        return;
+      }
+
+      const double tolerance2 = tolerance * tolerance;
+      m_keep.assign(count, 0);
+      m_keep.front() = m_keep.back() = 1;
+
+      m_ranges.clear();
+      m_ranges.emplace_back(0, count - 1);
+
+      while (!m_ranges.empty()) {
+        auto [first, last] = m_ranges.back();
+        m_ranges.pop_back();
+
+        const Vec2F a = m_device[m_indices[first]];
+        const Vec2F b = m_device[m_indices[last]];
+        double max_distance2 = 0.0;
+        int farthest = -1;
+
+        for (int i = first + 1; i < last; ++i) {
+          const double distance2 = details::squared_distance_to_segment(m_device[m_indices[i]], a, b);
+
+          if (distance2 > max_distance2) {
+            max_distance2 = distance2;
+            farthest = i;
+          }
+        }
+
+        if (farthest != -1 && max_distance2 > tolerance2) {
+          m_keep[farthest] = 1;
+          m_ranges.emplace_back(first, farthest);
+          m_ranges.emplace_back(farthest, last);
+        }
+      }
+
+      compact();
+    }
+
+    // the effective area of a point is compared to the square of the tolerance
+    void simplify_visvalingam(double tolerance)
+    {
+      const int count = static_cast<int>(m_indices.size());
+
+      if (count <= 2) {
+        return;
+      }
+
+      const double threshold = tolerance * tolerance;
+      m_keep.assign(count, 1);
+      m_previous.resize(count);
+      m_next.resize(count);
+      m_effective_areas.assign(count, 0.0);
+      m_areas.clear();
+
+      for (int i = 0; i < count; ++i) {
+        m_previous[i] = i - 1;
+        m_next[i] = i + 1;
+      }
+
+      auto area = [this](int i) {
+        const Vec2F a = m_device[m_indices[m_previous[i]]];
+        const Vec2F b = m_device[m_indices[i]];
+        const Vec2F c = m_device[m_indices[m_next[i]]];
+        return std::abs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y)) / 2;
+      };
+
+      auto compare = [](const std::pair<double, int>& lhs, const std::pair<double, int>& rhs) { return lhs.first > rhs.first; };
+
+      for (int i = 1; i < count - 1; ++i) {
+        m_effective_areas[i] = area(i);
+        m_areas.emplace_back(m_effective_areas[i], i);
+      }
+
+      std::make_heap(m_areas.begin(), m_areas.end(), compare);
+
+      while (!m_areas.empty()) {
+        std::pop_heap(m_areas.begin(), m_areas.end(), compare);
+        auto [current_area, i] = m_areas.back();
+        m_areas.pop_back();
+
+        if (m_keep[i] == 0 || current_area != m_effective_areas[i]) {
+          // removed or outdated entry
+          continue;
+        }
+
+        if (current_area >= threshold) {
+          break;
+        }
+
+        m_keep[i] = 0;
+        const int previous = m_previous[i];
+        const int next = m_next[i];
+        m_next[previous] = next;
+        m_previous[next] = previous;
+
+        for (const int neighbor : { previous, next }) {
+          if (neighbor > 0 && neighbor < count - 1) {
+            m_effective_areas[neighbor] = std::max(area(neighbor), current_area);
+            m_areas.emplace_back(m_effective_areas[neighbor], neighbor);
+            std::push_heap(m_areas.begin(), m_areas.end(), compare);
+          }
+        }
+      }
+
+      compact();
+    }
+
+    void compact()
+    {
+      std::size_t kept = 0;
+
+      for (std::size_t i = 0; i < m_indices.size(); ++i) {
+        if (m_keep[i] != 0) {
+          m_indices[kept++] = m_indices[i];
+        }
+      }
+
+      m_indices.resize(kept);
+    }
+
+    std::vector<Vec2F> m_device;
+    std::vector<int> m_indices;
+    std::vector<std::uint8_t> m_keep;
+    std::vector<std::pair<int, int>> m_ranges;
+    std::vector<int> m_previous;
+    std::vector<int> m_next;
+    std::vector<double> m_effective_areas;
+    std::vector<std::pair<double, int>> m_areas;
+    std::vector<Vec2F> m_result;
+  };
+
+  /*
+   * culling
+   */
+
+  // removes geometry outside the visible part of a context before it is submitted to cairo
+  // everything is in user space, the viewport is the clip extents enlarged by the extent of the stroke
+  // splitting polylines restarts dashes, so dashed strokes should be culled with care
+  class ViewportCuller {
+  public:
+    ViewportCuller(Context& ctx)
+    : ViewportCuller(ctx.clip_extents(), stroke_margin(ctx))
+    {
+    }
+
+    ViewportCuller(const RectF& viewport, double margin = 0.0)
+    : m_viewport({ viewport.x - margin, viewport.y - margin, viewport.w + 2 * margin, viewport.h + 2 * margin })
+    {
+    }
+
+    const RectF& viewport() const { return m_viewport; }
+
+    bool visible(const RectF& bounds) const { return details::intersects(m_viewport, bounds); }
+    bool visible(const Vec2F* points, int num_points) const { return num_points > 0 && visible(polyline_extents(points, num_points)); }
+    template<typename T>
+    bool visible(const T& points) const { return visible(std::data(points), static_cast<int>(std::size(points))); }
+
+    // appends the runs of visible segments of the polyline to the sink (PathBuffer, Context)
+    template<typename Sink>
+    void polyline(const Vec2F* points, int num_points, Sink& sink) const
+    {
+      if (num_points == 1) {
+        if (visible(points, 1)) {
+          sink.move_to(points[0].x, points[0].y);
+        }
+
+        return;
+      }
+
+      bool in_run = false;
+
+      for (int i = 1; i < num_points; ++i) {
+        const Vec2F a = points[i - 1];
+        const Vec2F b = points[i];
+        const RectF segment = { std::min(a.x, b.x), std::min(a.y, b.y), std::abs(b.x - a.x), std::abs(b.y - a.y) };
+
+        if (!visible(segment)) {
+          in_run = false;
+          continue;
+        }
+
+        if (!in_run) {
+          sink.move_to(a.x, a.y);
+          in_run = true;
+        }
+
+        sink.line_to(b.x, b.y);
+      }
+    }
+
+    template<typename T, typename Sink>
+    void polyline(const T& points, Sink& sink) const { polyline(std::data(points), static_cast<int>(std::size(points)), sink); }
+
+    // appends the polygon clipped to the viewport to the sink (PathBuffer, Context)
+    template<typename Sink>
+    void polygon(const Vec2F* points, int num_points, Sink& sink)
+    {
+      if (num_points == 0) {
+        return;
+      }
+
+      const RectF bounds = polyline_extents(points, num_points);
+
+      if (!visible(bounds)) {
+        return;
+      }
+
+      if (contains(bounds)) {
+        sink.move_to(points[0].x, points[0].y);
+
+        for (int i = 1; i < num_points; ++i) {
+          sink.line_to(points[i].x, points[i].y);
+        }
+
+        sink.close_path();
+        return;
+      }
+
+      // Sutherland-Hodgman
+      m_input.assign(points, points + num_points);
+      const double x_min = m_viewport.x;
+      const double y_min = m_viewport.y;
+      const double x_max = m_viewport.x + m_viewport.w;
+      const double y_max = m_viewport.y + m_viewport.h;
+
+      clip_edge([x_min](Vec2F p) { return p.x - x_min; });
+      clip_edge([x_max](Vec2F p) { return x_max - p.x; });
+      clip_edge([y_min](Vec2F p) { return p.y - y_min; });
+      clip_edge([y_max](Vec2F p) { return y_max - p.y; });
+
+      if (m_input.size() < 3) {
+        return;
+      }
+
+      sink.move_to(m_input[0].x, m_input[0].y);
+
+      for (std::size_t i = 1; i < m_input.size(); ++i) {
+        sink.line_to(m_input[i].x, m_input[i].y);
+      }
+
+      sink.close_path();
+    }
+
+    template<typename T, typename Sink>
+    void polygon(const T& points, Sink& sink) { polygon(std::data(points), static_cast<int>(std::size(points)), sink); }
+
+    // copies the sub-paths whose control points are in the viewport
+    void path(const Path& input, PathBuffer& output) const { copy_visible_sub_paths(input, output); }
+    void path(const PathBuffer& input, PathBuffer& output) const { copy_visible_sub_paths(input, output); }
+
+    bool visible(const Path& path) const { return path.data_size() > 0 && visible(path.control_extents()); }
+    bool visible(const PathBuffer& path) const { return !path.empty() && visible(path.control_extents()); }
+
+  private:
+    static double stroke_margin(Context& ctx)
+    {
+      double factor = 1.0;
+
+      if (ctx.line_join() == LineJoin::Miter) {
+        factor = std::max(factor, ctx.mitter_limit());
+      }
+
+      if (ctx.line_cap() == LineCap::Square) {
+        factor = std::max(factor, std::sqrt(2.0));
+      }
+
+      return ctx.line_width() / 2 * factor;
+    }
+
+    bool contains(const RectF& bounds) const
+    {
+      return m_viewport.x <= bounds.x && bounds.x + bounds.w <= m_viewport.x + m_viewport.w && m_viewport.y <= bounds.y && bounds.y + bounds.h <= m_viewport.y + m_viewport.h;
+    }
+
+    template<typename Distance>
+    void clip_edge(Distance distance)
+    {
+      m_output.clear();
+      const std::size_t count = m_input.size();
+
+      for (std::size_t i = 0; i < count; ++i) {
+        const Vec2F current = m_input[i];
+        const Vec2F previous = m_input[(i + count - 1) % count];
+        const double current_distance = distance(current);
+        const double previous_distance = distance(previous);
+
+        if ((current_distance >= 0.0) != (previous_distance >= 0.0)) {
+          const double t = previous_distance / (previous_distance - current_distance);
+          m_output.push_back({ previous.x + t * (current.x - previous.x), previous.y + t * (current.y - previous.y) });
+        }
+
+        if (current_distance >= 0.0) {
+          m_output.push_back(current);
+        }
+      }
+
+      std::swap(m_input, m_output);
+    }
+
+    template<typename P>
+    void copy_visible_sub_paths(const P& input, PathBuffer& output) const
+    {
+      // the cached extents of the whole path avoid the test of each sub-path in the common cases
+      const RectF extents = input.control_extents();
+
+      if (input.data_size() == 0 || !visible(extents)) {
+        return;
+      }
+
+      const bool inside = contains(extents);
+      auto first = input.begin();
+      const auto last = input.end();
+
+      while (first != last) {
+        auto sub_path_last = first;
+        details::Bounds bounds;
+
+        do {
+          const PathElement element = *sub_path_last;
+
+          for (int i = 1; !inside && i < element.length(); ++i) {
+            bounds.add(element.point(i));
+          }
+
+          ++sub_path_last;
+        } while (sub_path_last != last && (*sub_path_last).type() != PathDataType::MoveTo);
+
+        if (inside || (!bounds.empty() && visible(bounds.rect()))) {
+          for (; first != sub_path_last; ++first) {
+            const PathElement element = *first;
+
+            switch (element.type()) {
+              case PathDataType::MoveTo:
+                output.move_to(element.point(1));
+                break;
+              case PathDataType::LineTo:
+                output.line_to(element.point(1));
+                break;
+              case PathDataType::CurveTo:
+                output.curve_to(element.point(1), element.point(2), element.point(3));
+                break;
+              case PathDataType::ClosePath:
+                output.close_path();
+                break;
+            }
+          }
+        }
+
+        first = sub_path_last;
+      }
+    }
+
+    RectF m_viewport;
+    std::vector<Vec2F> m_input;
+    std::vector<Vec2F> m_output;
+  };
+
+  // bounds of the items of a layer, computed once, to cull the whole layer or its items without reading the geometry
+  class CullingLayer {
+  public:
+    int add(const RectF& bounds)
+    {
+      m_bounds.add(bounds);
+      m_items.push_back(bounds);
+      return static_cast<int>(m_items.size()) - 1;
+    }
+
+    int add(const Vec2F* points, int num_points) { return add(polyline_extents(points, num_points)); }
+    template<typename T>
+    int add(const T& points) { return add(std::data(points), static_cast<int>(std::size(points))); }
+    int add(const Path& path) { return add(path.extents()); }
+    int add(const PathBuffer& path) { return add(path.extents()); }
+
+    RectF bounds() const { return m_bounds.rect(); }
+    int size() const { return static_cast<int>(m_items.size()); }
+    const RectF& item_bounds(int index) const { return m_items[index]; }
+    void clear() { m_bounds = {}; m_items.clear(); }
+
+    // calls func with the index of each item that may be visible
+    template<typename Func>
+    void for_each_visible(const ViewportCuller& culler, Func func) const
+    {
+      if (m_items.empty() || !culler.visible(m_bounds.rect())) {
+        return;
+      }
+
+      for (int i = 0; i < size(); ++i) {
+        if (culler.visible(m_items[i])) {
+          func(i);
+        }
+      }
+    }
+
+  private:
+    details::Bounds m_bounds;
+    std::vector<RectF> m_items;
+  };
+
+  /*
+   * hit testing
+   */
+
+  namespace details {
+
+    // uniform grid of item bounds, items that cover too many cells are always candidates
+    class GridIndex {
+    public:
+      GridIndex(double cell_size)
+      : m_cell_size(cell_size)
+      {
+        assert(cell_size > 0.0);
+      }
+
+      // an item with too many cells, or with bounds that are not finite, is in all the cells
+      void insert(int id, const RectF& bounds)
+      {
+        if (!small(bounds)) {
+          m_large.push_back(id);
+          return;
+        }
+
+        const CellRange range = cell_range(bounds);
+
+        if (m_cells.empty()) {
+          m_occupied = range;
+        } else {
+          m_occupied = { std::min(m_occupied.x_first, range.x_first), std::max(m_occupied.x_last, range.x_last), std::min(m_occupied.y_first, range.y_first), std::max(m_occupied.y_last, range.y_last) };
+        }
+
+        for_each_cell(range, [this, id](std::int64_t key) { m_cells[key].push_back(id); });
+      }
+
+      void remove(int id, const RectF& bounds)
+      {
+        auto erase = [id](std::vector<int>& ids) {
+          if (auto it = std::find(ids.begin(), ids.end(), id); it != ids.end()) {
+            *it = ids.back();
+            ids.pop_back();
+          }
+        };
+
+        if (!small(bounds)) {
+          erase(m_large);
+          return;
+        }
+
+        for_each_cell(cell_range(bounds), [this, &erase](std::int64_t key) {
+          if (auto it = m_cells.find(key); it != m_cells.end()) {
+            erase(it->second);
+          }
+        });
+      }
+
+      void clear()
+      {
+        m_cells.clear();
+        m_large.clear();
+        m_stamps.clear();
+      }
+
+      // calls func once for each item whose cells touch the area, the area is clamped to the cells that have items
+      template<typename Func>
+      void query(const RectF& area, Func func)
+      {
+        if (++m_stamp == 0) {
+          std::fill(m_stamps.begin(), m_stamps.end(), 0);
+          m_stamp = 1;
+        }
+
+        auto visit = [&](int id) {
+          if (static_cast<std::size_t>(id) >= m_stamps.size()) {
+            m_stamps.resize(id + 1, 0);
+          }
+
+          if (m_stamps[id] != m_stamp) {
+            m_stamps[id] = m_stamp;
+            func(id);
+          }
+        };
+
+        // a NaN area touches nothing
+        if (std::isnan(area.x) || std::isnan(area.y) || std::isnan(area.x + area.w) || std::isnan(area.y + area.h)) {
+          return;
+        }
+
+        for (const int id : m_large) {
+          visit(id);
+        }
+
+        if (m_cells.empty()) {
+          return;
+        }
+
+        // clamped before the conversion, so that huge or infinite areas are not converted to integers
+        auto clamp = [](double value, std::int64_t min, std::int64_t max) {
+          return static_cast<std::int64_t>(std::clamp(value, static_cast<double>(min), static_cast<double>(max)));
+        };
+
+        const double x_first = std::floor(area.x / m_cell_size);
+        const double x_last = std::floor((area.x + area.w) / m_cell_size);
+        const double y_first = std::floor(area.y / m_cell_size);
+        const double y_last = std::floor((area.y + area.h) / m_cell_size);
+
+        if (x_last < static_cast<double>(m_occupied.x_first) || x_first > static_cast<double>(m_occupied.x_last) || y_last < static_cast<double>(m_occupied.y_first) || y_first > static_cast<double>(m_occupied.y_last)) {
+          return;
+        }
+
+        const CellRange range = {
+          clamp(x_first, m_occupied.x_first, m_occupied.x_last),
+          clamp(x_last, m_occupied.x_first, m_occupied.x_last),
+          clamp(y_first, m_occupied.y_first, m_occupied.y_last),
+          clamp(y_last, m_occupied.y_first, m_occupied.y_last),
+        };
+
+        const auto cell_count = static_cast<std::size_t>(range.x_last - range.x_first + 1) * static_cast<std::size_t>(range.y_last - range.y_first + 1);
+
+        if (cell_count > m_cells.size()) {
+          // fewer occupied cells than cells in the area
+          for (const auto& [key, ids] : m_cells) {
+            const auto x = static_cast<std::int32_t>(static_cast<std::uint64_t>(key) >> 32U);
+            const auto y = static_cast<std::int32_t>(static_cast<std::uint32_t>(key));
+
+            if (range.x_first <= x && x <= range.x_last && range.y_first <= y && y <= range.y_last) {
+              for (const int id : ids) {
+                visit(id);
+              }
+            }
+          }
+
+          return;
+        }
+
+        for_each_cell(range, [&](std::int64_t key) {
+          if (auto it = m_cells.find(key); it != m_cells.end()) {
+            for (const int id : it->second) {
+              visit(id);
+            }
+          }
+        });
+      }
+
+    private:
+      static constexpr double MaxCellsPerItem = 64.0;
+
+      struct CellRange {
+        std::int64_t x_first;
+        std::int64_t x_last;
+        std::int64_t y_first;
+        std::int64_t y_last;
+      };
+
+      // the bounds are finite and cover few cells, so that their cells can be converted to integers
+      bool small(const RectF& bounds) const
+      {
+        const double columns = std::floor((bounds.x + bounds.w) / m_cell_size) - std::floor(bounds.x / m_cell_size) + 1;
+        const double rows = std::floor((bounds.y + bounds.h) / m_cell_size) - std::floor(bounds.y / m_cell_size) + 1;
+        // the cells must fit in the 32 bits of each coordinate of the keys
+        constexpr double Limit = static_cast<double>(std::numeric_limits<std::int32_t>::max() / 2);
+        return columns * rows <= MaxCellsPerItem && std::abs(bounds.x / m_cell_size) < Limit && std::abs(bounds.y / m_cell_size) < Limit;
+      }
+
+      CellRange cell_range(const RectF& bounds) const
+      {
+        return {
+          static_cast<std::int64_t>(std::floor(bounds.x / m_cell_size)),
+          static_cast<std::int64_t>(std::floor((bounds.x + bounds.w) / m_cell_size)),
+          static_cast<std::int64_t>(std::floor(bounds.y / m_cell_size)),
+          static_cast<std::int64_t>(std::floor((bounds.y + bounds.h) / m_cell_size)),
+        };
+      }
+
+      template<typename Func>
+      void for_each_cell(const CellRange& range, Func func) const
+      {
+        for (std::int64_t y = range.y_first; y <= range.y_last; ++y) {
+          for (std::int64_t x = range.x_first; x <= range.x_last; ++x) {
+            func(static_cast<std::int64_t>((static_cast<std::uint64_t>(x) << 32U) ^ static_cast<std::uint32_t>(y)));
+          }
+        }
+      }
+
+      double m_cell_size;
+      std::unordered_map<std::int64_t, std::vector<int>> m_cells;
+      CellRange m_occupied = { 0, 0, 0, 0 };
+      std::vector<int> m_large;
+      std::vector<unsigned> m_stamps;
+      unsigned m_stamp = 0;
+    };
+
+  }
+
+  namespace details {
+
+    template<typename Func>
+    void for_each_flat_segment(const PathBuffer& flat_path, Func func)
+    {
+      Vec2F start = { 0.0, 0.0 };
+      Vec2F current = { 0.0, 0.0 };
+
+      for (const PathElement element : flat_path) {
+        switch (element.type()) {
+          case PathDataType::MoveTo:
+            current = start = element.point(1);
+            break;
+          case PathDataType::LineTo:
+            func(current, element.point(1), false);
+            current = element.point(1);
+            break;
+          case PathDataType::CurveTo:
+            assert(false);
+            break;
+          case PathDataType::ClosePath:
+            func(current, start, true);
+            current = start;
+            break;
+        }
+      }
+    }
+
+    inline bool in_fill(const PathBuffer& flat_path, FillRule fill_rule, Vec2F point)
+    {
+      int winding = 0;
+      Vec2F start = { 0.0, 0.0 };
+      Vec2F current = { 0.0, 0.0 };
+
+      auto edge = [&](Vec2F a, Vec2F b) {
+        const double cross = (b.x - a.x) * (point.y - a.y) - (point.x - a.x) * (b.y - a.y);
+
+        if (a.y <= point.y) {
+          if (b.y > point.y && cross > 0) {
+            ++winding;
+          }
+        } else if (b.y <= point.y && cross < 0) {
+          --winding;
+        }
+      };
+
+      // sub-paths are implicitly closed when filled
+      for (const PathElement element : flat_path) {
+        switch (element.type()) {
+          case PathDataType::MoveTo:
+            edge(current, start);
+            current = start = element.point(1);
+            break;
+          case PathDataType::LineTo:
+            edge(current, element.point(1));
+            current = element.point(1);
+            break;
+          case PathDataType::CurveTo:
+            assert(false);
+            break;
+          case PathDataType::ClosePath:
+            edge(current, start);
+            current = start;
+            break;
+        }
+      }
+
+      edge(current, start);
+      return fill_rule == FillRule::Winding ? winding != 0 : (winding % 2) != 0;
+    }
+
+    // with round joins and caps, the stroke is the set of points close enough to the path
+    inline bool in_round_stroke(const PathBuffer& flat_path, double line_width, Vec2F point)
+    {
+      const double max_distance2 = line_width * line_width / 4;
+      bool inside = false;
+
+      for_each_flat_segment(flat_path, [&](Vec2F a, Vec2F b, [[maybe_unused]] bool closing) {
+        inside = inside || squared_distance_to_segment(point, a, b) <= max_distance2;
+      });
+
+      return inside;
+    }
+
+  }
+
+  // spatial index of shapes for picking, only the shapes whose bounds contain the point are tested exactly
+  // shapes are flattened with the tolerance and tested without cairo, strokes are tested with round joins and caps
+  class ShapeIndex {
+  public:
+    ShapeIndex(double cell_size = 64.0, double tolerance = 0.1)
+    : m_grid(cell_size)
+    , m_tolerance(tolerance)
+    {
+    }
+
+    int add_fill(PathBuffer path, FillRule fill_rule = FillRule::Winding) { return add({ std::move(path), {}, fill_rule, 0.0, true }); }
+    int add_stroke(PathBuffer path, double line_width) { return add({ std::move(path), {}, FillRule::Winding, line_width, false }); }
+    int add_fill_and_stroke(PathBuffer path, double line_width, FillRule fill_rule = FillRule::Winding) { return add({ std::move(path), {}, fill_rule, line_width, true }); }
+
+    void remove(int id)
+    {
+      assert(0 <= id && id < static_cast<int>(m_shapes.size()));
+      Shape& shape = m_shapes[id];
+
+      if (shape.path.empty()) {
+        return;
+      }
+
+      m_grid.remove(id, shape.bounds);
+      shape.path.new_path();
+      --m_count;
+    }
+
+    void clear()
+    {
+      m_grid.clear();
+      m_shapes.clear();
+      m_count = 0;
+    }
+
+    int size() const { return m_count; }
+    const RectF& extents(int id) const { return m_shapes[id].bounds; }
+
+    // the most recently added shape that contains the point, or -1
+    int pick(Vec2F point)
+    {
+      int result = -1;
+
+      m_grid.query({ point.x, point.y, 0.0, 0.0 }, [&](int id) {
+        if (id > result && contains(m_shapes[id], point)) {
+          result = id;
+        }
+      });
+
+      return result;
+    }
+
+    int pick(double x, double y) { return pick({ x, y }); }
+
+    // all the shapes that contain the point, in the order they were added
+    void query(Vec2F point, std::vector<int>& result)
+    {
+      result.clear();
+
+      m_grid.query({ point.x, point.y, 0.0, 0.0 }, [&](int id) {
+        if (contains(m_shapes[id], point)) {
+          result.push_back(id);
+        }
+      });
+
+      std::sort(result.begin(), result.end());
+    }
+
+    // all the shapes whose extents intersect the area, in the order they were added
+    void query(const RectF& area, std::vector<int>& result)
+    {
+      result.clear();
+
+      m_grid.query(area, [&](int id) {
+        if (details::intersects(m_shapes[id].bounds, area)) {
+          result.push_back(id);
+        }
+      });
+
+      std::sort(result.begin(), result.end());
+    }
+
+  private:
+    struct Shape {
+      PathBuffer path;
+      RectF bounds;
+      FillRule fill_rule;
+      double line_width;
+      bool filled;
+    };
+
+    int add(Shape shape)
+    {
+      assert(!shape.path.empty());
+
+      if (!details::is_flat(shape.path)) {
+        PathBuffer flat_path;
+        flatten_path(shape.path, m_tolerance, flat_path);
+        shape.path = std::move(flat_path);
+      }
+
+      const double margin = shape.line_width / 2;
+      const RectF control = shape.path.control_extents();
+      shape.bounds = { control.x - margin, control.y - margin, control.w + 2 * margin, control.h + 2 * margin };
+
+      const int id = static_cast<int>(m_shapes.size());
+      m_grid.insert(id, shape.bounds);
+      m_shapes.push_back(std::move(shape));
+      ++m_count;
+      return id;
+    }
+
+    bool contains(const Shape& shape, Vec2F point)
+    {
+      if (shape.path.empty() || !details::intersects(shape.bounds, { point.x, point.y, 0.0, 0.0 })) {
+        return false;
+      }
+
+      if (shape.filled && details::in_fill(shape.path, shape.fill_rule, point)) {
+        return true;
+      }
+
+      return shape.line_width > 0.0 && details::in_round_stroke(shape.path, shape.line_width, point);
+    }
+
+    details::GridIndex m_grid;
+    double m_tolerance;
+    std::vector<Shape> m_shapes;
+    int m_count = 0;
+  };
+
+  /*
+   * picking
+   */
+
+  // offscreen surface where shapes are drawn with their id as color, without antialiasing
+  // ids have 24 bits, 0 is the background
+  class PickBuffer {
+  public:
+    static constexpr std::uint32_t MaxId = 0xFFFFFF;
+
+    PickBuffer(int width, int height)
+    : m_surface(ImageSurface::create(Format::Rgb24, width, height))
+    , m_context(m_surface)
+    {
+      m_context.set_antialias(Antialias::None);
+      m_context.set_compositing_operator(Operator::Source);
+
+      FontOptions options;
+      options.set_antialias(Antialias::None);
+      m_context.set_font_options(options);
+
+      clear();
+    }
+
+    PickBuffer(Vec2I size)
+    : PickBuffer(size.x, size.y)
+    {
+    }
+
+    ImageSurface& surface() { return m_surface; }
+    Context& context() { return m_context; }
+
+    // the source of the context for the following shapes
+    void set_id(std::uint32_t id)
+    {
+      assert(id <= MaxId);
+      m_context.set_source_rgb(((id >> 16U) & 0xFFU) / 255.0, ((id >> 8U) & 0xFFU) / 255.0, (id & 0xFFU) / 255.0);
+    }
+
+    void clear()
+    {
+      Subcontext sub(m_context);
+      m_context.set_source_rgb(0.0, 0.0, 0.0);
+      m_context.paint();
+      m_dirty.clear();
+    }
+
+    // the id at a device pixel, or 0
+    std::uint32_t pick(int x, int y)
+    {
+      if (x < 0 || y < 0 || x >= m_surface.width() || y >= m_surface.height()) {
+        return 0;
+      }
+
+      m_surface.flush();
+      std::uint32_t pixel = 0;
+      std::memcpy(&pixel, m_surface.data() + static_cast<std::ptrdiff_t>(y) * m_surface.stride() + static_cast<std::ptrdiff_t>(x) * 4, sizeof(pixel));
+      return pixel & MaxId;
+    }
+
+    std::uint32_t pick(Vec2I point) { return pick(point.x, point.y); }
+    std::uint32_t pick(Vec2F point) { return pick(static_cast<int>(std::floor(point.x)), static_cast<int>(std::floor(point.y))); }
+
+    // marks an area (in pixels of the surface) that must be redrawn by the next update
+    void invalidate(const RectI& area) { m_dirty.unite(area); }
+    void invalidate(const Region& area) { m_dirty.unite(area); }
+    bool dirty() const { return !m_dirty.empty(); }
+
+    // clears the invalidated areas and calls draw with the context clipped to them
+    template<typename Func>
+    void update(Func draw)
+    {
+      if (m_dirty.empty()) {
+        return;
+      }
+
+      Subcontext sub(m_context);
+      m_context.clip_region(m_dirty);
+      m_context.set_source_rgb(0.0, 0.0, 0.0);
+      m_context.paint();
+      m_dirty.clear();
+
+      draw(m_context);
+    }
+
+  private:
+    ImageSurface m_surface;
+    Context m_context;
+    Region m_dirty;
+  };
+
+  /*
+   * path measure
+   */
+
+  namespace details {
+    class Stroker;
+  }
+
+  // cumulative length table of a path, for queries at a distance along the path in O(log n)
+  // sub-paths are measured one after the other
+  class PathMeasure {
+  public:
+    PathMeasure() = default;
+
+    explicit PathMeasure(Context& ctx)
+    : PathMeasure(ctx.copy_path_flat())
+    {
+    }
+
+    // curves are flattened with the tolerance
+    explicit PathMeasure(const Path& path, double tolerance = 0.1)
+    {
+      build_flat(path, tolerance);
+    }
+
+    explicit PathMeasure(const PathBuffer& path, double tolerance = 0.1)
+    {
+      build_flat(path, tolerance);
+    }
+
+    double length() const { return m_length; }
+    bool empty() const { return m_segments.empty(); }
+
+    Vec2F point_at(double distance) const
+    {
+      if (m_segments.empty()) {
+        return { 0.0, 0.0 };
+      }
+
+      return point_on(find(distance), distance);
+    }
+
+    // unit tangent
+    Vec2F tangent_at(double distance) const
+    {
+      if (m_segments.empty()) {
+        return { 1.0, 0.0 };
+      }
+
+      const Segment& segment = find(distance);
+      return { (segment.b.x - segment.a.x) / segment.length, (segment.b.y - segment.a.y) / segment.length };
+    }
+
+    // appends the part of the path between the two distances
+    void segment(double distance0, double distance1, PathBuffer& output) const
+    {
+      distance0 = std::max(distance0, 0.0);
+      distance1 = std::min(distance1, m_length);
+
+      if (m_segments.empty() || distance0 > distance1) {
+        return;
+      }
+
+      auto it = m_segments.begin() + static_cast<std::ptrdiff_t>(find_index(distance0));
+      output.move_to(point_at(distance0));
+
+      for (int contour = it->contour; it != m_segments.end() && it->start < distance1; ++it) {
+        if (it->contour != contour) {
+          output.move_to(it->a);
+          contour = it->contour;
+        }
+
+        if (it->start + it->length <= distance1) {
+          output.line_to(it->b);
+        } else {
+          output.line_to(point_at(distance1));
+        }
+      }
+    }
+
+    PathBuffer segment(double distance0, double distance1) const
+    {
+      PathBuffer output;
+      segment(distance0, distance1, output);
+      return output;
+    }
+
+    // appends the dashes of the path as sub-paths, that can then be stroked without dashes
+    // like in cairo, the dash pattern restarts at each sub-path, and a degenerate sub-path is a dot if its first dash is on
+    void dash(const DashArray& dash, PathBuffer& output) const { PathOutput path_output = { &output }; dash_visible(dash, nullptr, path_output); }
+
+    // only the dashes on the segments that intersect the viewport, in user space and enlarged by the extent of the stroke
+    // the state of the dash pattern at the start of each visible part is computed from the period, not by walking the path
+    void dash(const DashArray& dash, const RectF& viewport, PathBuffer& output) const { PathOutput path_output = { &output }; dash_visible(dash, &viewport, path_output); }
+
+  private:
+    friend class details::Stroker;
+
+    // the output of the dashes, move_to also gets the direction of the path at the start of the dash
+    struct PathOutput {
+      PathBuffer* path;
+
+      void move_to(Vec2F point, [[maybe_unused]] Vec2F direction) { path->move_to(point); }
+      void line_to(Vec2F point) { path->line_to(point); }
+      void close_path() { path->close_path(); }
+    };
+
+    struct Segment {
+      Vec2F a;
+      Vec2F b;
+      double start;
+      double length;
+      int contour;
+    };
+
+    struct Contour {
+      std::size_t first;
+      std::size_t last;
+      double start;
+      double length;
+      bool closed;
+      // a sub-path without length but with a line_to or a close_path, drawn as a dot
+      bool degenerate;
+      Vec2F point;
+    };
+
+    template<typename P>
+    void build_flat(const P& path, double tolerance)
+    {
+      if (details::is_flat(path)) {
+        build(path);
+      } else {
+        PathBuffer flat_path;
+        flatten_path(path, tolerance, flat_path);
+        build(flat_path);
+      }
+    }
+
+    template<typename P>
+    void build(const P& path)
+    {
+      Vec2F current = { 0.0, 0.0 };
+      Vec2F contour_start = { 0.0, 0.0 };
+      int contour = -1;
+
+      auto add = [&](Vec2F end) {
+        const double length = std::hypot(end.x - current.x, end.y - current.y);
+
+        if (length > 0.0) {
+          m_segments.push_back({ current, end, m_length, length, contour });
+          m_length += length;
+          m_contours.back().last = m_segments.size();
+          m_contours.back().length = m_length - m_contours.back().start;
+        }
+
+        current = end;
+      };
+
+      for (const PathElement element : path) {
+        switch (element.type()) {
+          case PathDataType::MoveTo:
+            current = contour_start = element.point(1);
+            ++contour;
+            m_contours.push_back({ m_segments.size(), m_segments.size(), m_length, 0.0, false, false, current });
+            break;
+          case PathDataType::LineTo:
+            add(element.point(1));
+            m_contours.back().degenerate = m_contours.back().first == m_contours.back().last;
+            break;
+          case PathDataType::CurveTo:
+            assert(false);
+            break;
+          case PathDataType::ClosePath:
+            add(contour_start);
+            m_contours.back().closed = true;
+            m_contours.back().degenerate = m_contours.back().first == m_contours.back().last;
+            break;
+        }
+      }
+    }
+
+    template<typename Output>
+    void dash_visible(const DashArray& dash, const RectF* viewport, Output& output) const
+    {
+      // an odd number of dashes is repeated, like in cairo
+      std::vector<double> dashes = dash.dashes;
+
+      if (dashes.size() % 2 == 1) {
+        dashes.insert(dashes.end(), dash.dashes.begin(), dash.dashes.end());
+      }
+
+      const double period = std::accumulate(dashes.begin(), dashes.end(), 0.0);
+
+      // the dash at a distance from the start of a sub-path, and the length that remains in it
+      auto locate = [&](double distance, std::size_t& index, double& remaining) {
+        double position = std::fmod(dash.offset + distance, period);
+
+        if (position < 0.0) {
+          position += period;
+        }
+
+        index = 0;
+
+        while (position > 0.0 && position >= dashes[index]) {
+          position -= dashes[index];
+          index = (index + 1) % dashes.size();
+        }
+
+        remaining = dashes[index] - position;
+      };
+
+      for (const Contour& contour : m_contours) {
+        if (contour.first == contour.last) {
+          if (!contour.degenerate || (viewport != nullptr && !details::intersects(*viewport, RectF{ contour.point.x, contour.point.y, 0.0, 0.0 }))) {
+            continue;
+          }
+
+          std::size_t index = 0;
+          double remaining = 0.0;
+
+          if (period > 0.0) {
+            locate(0.0, index, remaining);
+          }
+
+          if (index % 2 == 0) {
+            output.move_to(contour.point, Vec2F{ 1.0, 0.0 });
+            output.line_to(contour.point);
+          }
+
+          continue;
+        }
+
+        // the first dash of a closed sub-path is kept to be joined with the last one
+        bool has_first = false;
+        double first_end = 0.0;
+        double last_end = -1.0;
+
+        auto emit = [&](double start, double end) {
+          if (contour.closed && start == 0.0 && !has_first) {
+            has_first = true;
+            first_end = end;
+            return;
+          }
+
+          append_range(contour, start, end, true, output);
+          last_end = end;
+        };
+
+        for_each_visible_range(contour, viewport, [&](double start, double end) {
+          if (period <= 0.0) {
+            emit(start, end);
+            return;
+          }
+
+          std::size_t index = 0;
+          double remaining = 0.0;
+          locate(start, index, remaining);
+          double distance = start;
+
+          for (;;) {
+            if (index % 2 == 0) {
+              emit(distance, std::min(distance + remaining, end));
+            }
+
+            if (distance + remaining >= end) {
+              break;
+            }
+
+            distance += remaining;
+            index = (index + 1) % dashes.size();
+            remaining = dashes[index];
+          }
+        });
+
+        if (has_first) {
+          if (first_end == contour.length) {
+            append_range(contour, 0.0, contour.length, true, output);
+            output.close_path();
+          } else {
+            append_range(contour, 0.0, first_end, last_end != contour.length, output);
+          }
+        }
+      }
+    }
+
+    // calls func with the ranges of consecutive segments of the contour that intersect the viewport
+    template<typename Func>
+    void for_each_visible_range(const Contour& contour, const RectF* viewport, Func func) const
+    {
+      if (viewport == nullptr) {
+        func(0.0, contour.length);
+        return;
+      }
+
+      bool in_range = false;
+      double range_start = 0.0;
+      double range_end = 0.0;
+
+      for (std::size_t i = contour.first; i < contour.last; ++i) {
+        const Segment& segment = m_segments[i];
+        details::Bounds bounds;
+        bounds.add(segment.a);
+        bounds.add(segment.b);
+
+        if (details::intersects(*viewport, bounds.rect())) {
+          if (!in_range) {
+            range_start = segment.start - contour.start;
+            in_range = true;
+          }
+
+          range_end = i + 1 < contour.last ? m_segments[i + 1].start - contour.start : contour.length;
+        } else if (in_range) {
+          func(range_start, range_end);
+          in_range = false;
+        }
+      }
+
+      if (in_range) {
+        func(range_start, range_end);
+      }
+    }
+
+    // appends the part of the contour between the two distances from the start of the contour
+    template<typename Output>
+    void append_range(const Contour& contour, double distance0, double distance1, bool move, Output& output) const
+    {
+      const auto begin = m_segments.begin() + static_cast<std::ptrdiff_t>(contour.first);
+      const auto end = m_segments.begin() + static_cast<std::ptrdiff_t>(contour.last);
+      distance0 += contour.start;
+      distance1 += contour.start;
+
+      auto it = std::upper_bound(begin, end, distance0, [](double value, const Segment& segment) { return value < segment.start; });
+
+      if (it != begin) {
+        --it;
+      }
+
+      if (move) {
+        output.move_to(point_on(*it, distance0), Vec2F{ (it->b.x - it->a.x) / it->length, (it->b.y - it->a.y) / it->length });
+      }
+
+      for (; it != end; ++it) {
+        const double segment_end = it + 1 != end ? (it + 1)->start : contour.start + contour.length;
+
+        if (segment_end > distance1) {
+          output.line_to(point_on(*it, distance1));
+          break;
+        }
+
+        output.line_to(it->b);
+
+        if (segment_end == distance1) {
+          break;
+        }
+      }
+    }
+
+    static Vec2F point_on(const Segment& segment, double distance)
+    {
+      const double t = std::clamp((distance - segment.start) / segment.length, 0.0, 1.0);
+      return { segment.a.x + t * (segment.b.x - segment.a.x), segment.a.y + t * (segment.b.y - segment.a.y) };
+    }
+
+    std::size_t find_index(double distance) const
+    {
+      auto it = std::upper_bound(m_segments.begin(), m_segments.end(), distance, [](double value, const Segment& segment) { return value < segment.start; });
+
+      if (it != m_segments.begin()) {
+        --it;
+      }
+
+      return static_cast<std::size_t>(it - m_segments.begin());
+    }
+
+    const Segment& find(double distance) const { return m_segments[find_index(distance)]; }
+
+    std::vector<Segment> m_segments;
+    std::vector<Contour> m_contours;
+    double m_length = 0.0;
+  };
+
+  /*
+   * stroke outline
+   */
+
+  struct StrokeStyle {
+    double line_width = 2.0;
+    LineCap line_cap = LineCap::Butt;
+    LineJoin line_join = LineJoin::Miter;
+    double miter_limit = 10.0;
+    DashArray dash;
+
+    bool operator==(const StrokeStyle& other) const
+    {
+      return line_width == other.line_width && line_cap == other.line_cap && line_join == other.line_join && miter_limit == other.miter_limit && dash.dashes == other.dash.dashes && dash.offset == other.dash.offset;
+    }
+
+    bool operator!=(const StrokeStyle& other) const { return !(*this == other); }
+  };
+
+  inline StrokeStyle stroke_style(Context& ctx) { return { ctx.line_width(), ctx.line_cap(), ctx.line_join(), ctx.mitter_limit(), ctx.dash() }; }
+
+  namespace details {
+
+    // computes the outline of a stroke as a union of positively oriented polygons (segments, joins, caps)
+    // so that filling the outline with the winding rule covers the same area as the stroke
+    class Stroker {
+    public:
+      Stroker(const StrokeStyle& style, double tolerance, PathBuffer& output)
+      : m_half_width(style.line_width / 2)
+      , m_line_cap(style.line_cap)
+      , m_line_join(style.line_join)
+      , m_miter_limit(style.miter_limit)
+      , m_output(&output)
+      {
+        const double ratio = std::clamp(1.0 - tolerance / m_half_width, -1.0, 1.0);
+        m_arc_step = std::max(2 * std::acos(ratio), Pi / 64);
+
+        const double period = std::accumulate(style.dash.dashes.begin(), style.dash.dashes.end(), 0.0);
+
+        if (period > 0.0) {
+          m_dash = style.dash;
+        }
+      }
+
+      void stroke(const PathBuffer& flat_path)
+      {
+        if (m_half_width <= 0.0) {
+          return;
+        }
+
+        if (!m_dash.dashes.empty()) {
+          // the dashes are split by PathMeasure, and each dash is stroked as a piece
+          const PathMeasure measure(flat_path);
+          measure.dash_visible(m_dash, nullptr, *this);
+          flush_piece();
+          return;
+        }
+
+        m_contour.clear();
+
+        for (const PathElement element : flat_path) {
+          switch (element.type()) {
+            case PathDataType::MoveTo:
+              contour(false);
+              m_contour.push_back(element.point(1));
+              break;
+            case PathDataType::LineTo:
+              m_contour.push_back(element.point(1));
+              break;
+            case PathDataType::CurveTo:
+              assert(false);
+              break;
+            case PathDataType::ClosePath:
+              contour(true);
+              break;
+          }
+        }
+
+        contour(false);
+      }
+
+    private:
+      friend class cairo::PathMeasure;
+
+      static Vec2F normalize(Vec2F v)
+      {
+        const double length = std::hypot(v.x, v.y);
+        return { v.x / length, v.y / length };
+      }
+
+      static Vec2F left(Vec2F d) { return { -d.y, d.x }; }
+
+      void contour(bool closed)
+      {
+        // like cairo, a lone move_to draws nothing, but a sub-path without length and with a close_path has caps
+        if (m_contour.empty() || (m_contour.size() < 2 && !closed)) {
+          m_contour.clear();
+          return;
+        }
+
+        // remove consecutive duplicates, but keep degenerate contours for their caps
+        auto last = std::unique(m_contour.begin(), m_contour.end(), [](Vec2F lhs, Vec2F rhs) { return lhs.x == rhs.x && lhs.y == rhs.y; });
+        m_contour.erase(last, m_contour.end());
+
+        if (closed && m_contour.size() > 1 && m_contour.front().x == m_contour.back().x && m_contour.front().y == m_contour.back().y) {
+          m_contour.pop_back();
+        }
+
+        if (m_contour.size() == 1) {
+          dot(m_contour.front(), { 1.0, 0.0 });
+        } else {
+          polyline(m_contour.data(), static_cast<int>(m_contour.size()), closed);
+        }
+
+        m_contour.clear();
+      }
+
+      // the output of PathMeasure::dash_visible: a dash starts at a move_to, and a sub-path without gap is closed
+      void move_to(Vec2F point, Vec2F direction)
+      {
+        flush_piece();
+        m_piece.push_back(point);
+        m_piece_direction = direction;
+      }
+
+      void line_to(Vec2F point) { m_piece.push_back(point); }
+
+      void close_path()
+      {
+        m_contour.swap(m_piece);
+        m_piece.clear();
+        contour(true);
+      }
+
+      void flush_piece()
+      {
+        if (!m_piece.empty()) {
+          piece(m_piece_direction);
+          m_piece.clear();
+        }
+      }
+
+      void piece(Vec2F direction)
+      {
+        auto last = std::unique(m_piece.begin(), m_piece.end(), [](Vec2F lhs, Vec2F rhs) { return lhs.x == rhs.x && lhs.y == rhs.y; });
+        m_piece.erase(last, m_piece.end());
+
+        if (m_piece.size() == 1) {
+          dot(m_piece.front(), direction);
+        } else {
+          polyline(m_piece.data(), static_cast<int>(m_piece.size()), false);
+        }
+      }
+
+      void polyline(const Vec2F* points, int count, bool closed)
+      {
+        const int segment_count = closed ? count : count - 1;
+
+        for (int i = 0; i < segment_count; ++i) {
+          const Vec2F a = points[i];
+          const Vec2F b = points[(i + 1) % count];
+          const Vec2F n = left(normalize({ b.x - a.x, b.y - a.y }));
+          quad({ a.x + n.x * m_half_width, a.y + n.y * m_half_width }, { b.x + n.x * m_half_width, b.y + n.y * m_half_width }, { b.x - n.x * m_half_width, b.y - n.y * m_half_width }, { a.x - n.x * m_half_width, a.y - n.y * m_half_width });
+        }
+
+        const int first_join = closed ? 0 : 1;
+        const int last_join = closed ? count : count - 1;
+
+        for (int i = first_join; i < last_join; ++i) {
+          const Vec2F previous = points[(i + count - 1) % count];
+          const Vec2F current = points[i];
+          const Vec2F next = points[(i + 1) % count];
+          join(current, normalize({ current.x - previous.x, current.y - previous.y }), normalize({ next.x - current.x, next.y - current.y }));
+        }
+
+        if (!closed) {
+          cap(points[0], normalize({ points[0].x - points[1].x, points[0].y - points[1].y }));
+          cap(points[count - 1], normalize({ points[count - 1].x - points[count - 2].x, points[count - 1].y - points[count - 2].y }));
+        }
+      }
+
+      void join(Vec2F p, Vec2F d_in, Vec2F d_out)
+      {
+        const double cross = d_in.x * d_out.y - d_in.y * d_out.x;
+        const double dot = d_in.x * d_out.x + d_in.y * d_out.y;
+
+        if (cross == 0.0 && dot > 0.0) {
+          return;
+        }
+
+        // normals on the outer side of the turn
+        Vec2F u1 = left(d_in);
+        Vec2F u2 = left(d_out);
+
+        if (cross > 0.0) {
+          u1 = { -u1.x, -u1.y };
+          u2 = { -u2.x, -u2.y };
+        }
+
+        const Vec2F a = { p.x + u1.x * m_half_width, p.y + u1.y * m_half_width };
+        const Vec2F b = { p.x + u2.x * m_half_width, p.y + u2.y * m_half_width };
+
+        switch (m_line_join) {
+          case LineJoin::Round:
+            pie(p, u1, u2, d_in);
+            break;
+          case LineJoin::Miter:
+            if (m_miter_limit * m_miter_limit * (1 + dot) >= 2) {
+              const double factor = m_half_width / (1 + dot);
+              quad(p, a, { p.x + (u1.x + u2.x) * factor, p.y + (u1.y + u2.y) * factor }, b);
+              break;
+            }
+            [[fallthrough]];
+          case LineJoin::Bevel:
+            m_polygon = { p, a, b };
+            polygon();
+            break;
+        }
+      }
+
+      // d is the outward direction
+      void cap(Vec2F p, Vec2F d)
+      {
+        const Vec2F n = left(d);
+
+        switch (m_line_cap) {
+          case LineCap::Butt:
+            break;
+          case LineCap::Round:
+            pie(p, n, { -n.x, -n.y }, d);
+            break;
+          case LineCap::Square:
+            {
+              const Vec2F a = { p.x + n.x * m_half_width, p.y + n.y * m_half_width };
+              const Vec2F b = { p.x - n.x * m_half_width, p.y - n.y * m_half_width };
+              const Vec2F e = { d.x * m_half_width, d.y * m_half_width };
+              quad(a, { a.x + e.x, a.y + e.y }, { b.x + e.x, b.y + e.y }, b);
+            }
+            break;
+        }
+      }
+
+      void dot(Vec2F p, Vec2F d)
+      {
+        cap(p, d);
+        cap(p, { -d.x, -d.y });
+      }
+
+      // circular sector from u1 to u2 (unit vectors) that contains the direction through
+      void pie(Vec2F center, Vec2F u1, Vec2F u2, Vec2F through)
+      {
+        const double start = std::atan2(u1.y, u1.x);
+        double sweep = std::atan2(u2.y, u2.x) - start;
+
+        if (sweep > Pi) {
+          sweep -= 2 * Pi;
+        } else if (sweep < -Pi) {
+          sweep += 2 * Pi;
+        }
+
+        const double middle = start + sweep / 2;
+
+        if (std::cos(middle) * through.x + std::sin(middle) * through.y < 0.0) {
+          sweep -= std::copysign(2 * Pi, sweep);
+        }
+
+        const int count = std::max(1, static_cast<int>(std::ceil(std::abs(sweep) / m_arc_step)));
+        m_polygon.clear();
+        m_polygon.push_back(center);
+
+        for (int i = 0; i <= count; ++i) {
+          const double angle = start + sweep * i / count;
+          m_polygon.push_back({ center.x + m_half_width * std::cos(angle), center.y + m_half_width * std::sin(angle) });
+        }
+
+        polygon();
+      }
+
+      void quad(Vec2F a, Vec2F b, Vec2F c, Vec2F d)
+      {
+        m_polygon = { a, b, c, d };
+        polygon();
+      }
+
+      void polygon()
+      {
+        const std::size_t count = m_polygon.size();
+        double area = 0.0;
+
+        for (std::size_t i = 0; i < count; ++i) {
+          const Vec2F a = m_polygon[i];
+          const Vec2F b = m_polygon[(i + 1) % count];
+          area += a.x * b.y - b.x * a.y;
+        }
+
+        if (area == 0.0) {
+          return;
+        }
+
+        if (area < 0.0) {
+          std::reverse(m_polygon.begin(), m_polygon.end());
+        }
+
+        m_output->polygon(m_polygon);
+      }
+
+      double m_half_width;
+      LineCap m_line_cap;
+      LineJoin m_line_join;
+      double m_miter_limit;
+      double m_arc_step = 0.0;
+      PathBuffer* m_output;
+      DashArray m_dash;
+      std::vector<Vec2F> m_contour;
+      std::vector<Vec2F> m_piece;
+      Vec2F m_piece_direction = { 1.0, 0.0 };
+      std::vector<Vec2F> m_polygon;
+    };
+
+  }
+
+  // computes a path that, filled with the winding rule, covers the same area as the stroke of the path with the style
+  // the tolerance is in user units
+  inline void stroke_to_path(const PathBuffer& path, const StrokeStyle& style, double tolerance, PathBuffer& outline)
+  {
+    outline.new_path();
+    details::Stroker stroker(style, tolerance, outline);
+
+    if (details::is_flat(path)) {
+      stroker.stroke(path);
+    } else {
+      PathBuffer flat_path;
+      flatten_path(path, tolerance, flat_path);
+      stroker.stroke(flat_path);
+    }
+  }
+
+  // outlines of the strokes of static paths, computed once and then filled instead of stroked
+  class StrokeCache {
+  public:
+    // the outline of the path for an id, computed again if the style changes or if a smaller tolerance is needed
+    const PathBuffer& outline(std::uint64_t id, const PathBuffer& path, const StrokeStyle& style, double tolerance)
+    {
+      Entry& entry = m_entries[id];
+
+      if (entry.outline.empty() || entry.style != style || entry.tolerance > tolerance) {
+        entry.style = style;
+        entry.tolerance = tolerance;
+        stroke_to_path(path, style, tolerance, entry.outline);
+      }
+
+      return entry.outline;
+    }
+
+    // like Context::stroke for the path, with the stroke parameters and the tolerance of the context
+    // the current path of the context is replaced
+    void stroke(Context& ctx, std::uint64_t id, const PathBuffer& path)
+    {
+      const double tolerance = ctx.tolerance() / details::max_scale(details::user_to_pixel_matrix(ctx));
+      const PathBuffer& cached = outline(id, path, stroke_style(ctx), tolerance);
+
+      const FillRule fill_rule = ctx.fill_rule();
+      ctx.set_fill_rule(FillRule::Winding);
+      ctx.new_path();
+      ctx.append_path(cached);
+      ctx.fill();
+      ctx.set_fill_rule(fill_rule);
+    }
+
+    void invalidate(std::uint64_t id) { m_entries.erase(id); }
+    void clear() { m_entries.clear(); }
+    std::size_t size() const { return m_entries.size(); }
+
+  private:
+    struct Entry {
+      StrokeStyle style;
+      double tolerance = 0.0;
+      PathBuffer outline;
+    };
+
+    std::unordered_map<std::uint64_t, Entry> m_entries;
+  };
+
+  /*
+   * dash cache
+   */
+
+  // dashes of static paths, computed once with PathMeasure and then stroked without dashes
+  class DashCache {
+  public:
+    // the dashes of the path for an id, computed again if the dash array changes or if a smaller tolerance is needed
+    const PathBuffer& dashes(std::uint64_t id, const PathBuffer& path, const DashArray& dash, double tolerance)
+    {
+      Entry& entry = m_entries[id];
+
+      if (!entry.computed || entry.dash.dashes != dash.dashes || entry.dash.offset != dash.offset || entry.tolerance > tolerance) {
+        entry.computed = true;
+        entry.dash = dash;
+        entry.tolerance = tolerance;
+        entry.dashes.new_path();
+        PathMeasure(path, tolerance).dash(dash, entry.dashes);
+      }
+
+      return entry.dashes;
+    }
+
+    // like Context::stroke for the path, with the dash array and the tolerance of the context
+    // the current path of the context is replaced
+    void stroke(Context& ctx, std::uint64_t id, const PathBuffer& path)
+    {
+      const DashArray dash = ctx.dash();
+      ctx.new_path();
+
+      if (dash.dashes.empty()) {
+        ctx.append_path(path);
+        ctx.stroke();
+        return;
+      }
+
+      const double tolerance = ctx.tolerance() / details::max_scale(details::user_to_pixel_matrix(ctx));
+      const PathBuffer& cached = dashes(id, path, dash, tolerance);
+
+      ctx.set_dash(nullptr, 0, 0.0);
+      ctx.append_path(cached);
+      ctx.stroke();
+      ctx.set_dash(dash.dashes, dash.offset);
+    }
+
+    void invalidate(std::uint64_t id) { m_entries.erase(id); }
+    void clear() { m_entries.clear(); }
+    std::size_t size() const { return m_entries.size(); }
+
+  private:
+    struct Entry {
+      bool computed = false;
+      DashArray dash;
+      double tolerance = 0.0;
+      PathBuffer dashes;
+    };
+
+    std::unordered_map<std::uint64_t, Entry> m_entries;
+  };
+
+  /*
+   * context pool
+   */
+
+  // image surfaces with their context, reused from one request to the next
+  // cairo cannot change the target of a context, so a context is pooled with its surface, and it is reset
+  // by a restore to a state saved just after its creation, and the surface to its default device transformation
+  // an entry is not reused if the saves and restores of the user were not balanced, or if the surface is still referenced
+  class ContextPool {
+  private:
+    // the tolerance of the saved state, to check that a restore goes back to it
+    static constexpr double SavedTolerance = 0.987654321;
+
+    struct Entry {
+      Entry(Format format, int width, int height)
+      : surface(ImageSurface::create(format, width, height))
+      , context(surface)
+      , format(format)
+      , width(width)
+      , height(height)
+      , tolerance(context.tolerance())
+      , fallback_resolution(surface.fallback_resolution())
+      {
+        save();
+        references = surface.reference_count();
+      }
+
+      void save()
+      {
+        context.set_tolerance(SavedTolerance);
+        context.save();
+        context.set_tolerance(tolerance);
+      }
+
+      ImageSurface surface;
+      Context context;
+      Format format;
+      int width;
+      int height;
+      double tolerance;
+      Vec2F fallback_resolution;
+      unsigned references = 0;
+    };
+
+  public:
+    // a surface and its context, given back to the pool at destruction
+    class Lease {
+    public:
+      Lease(const Lease&) = delete;
+      Lease(Lease&&) noexcept = default;
+
+      ~Lease()
+      {
+        if (m_entry) {
+          m_pool->release(std::move(m_entry));
+        }
+      }
+
+      Lease& operator=(const Lease&) = delete;
+      Lease& operator=(Lease&&) noexcept = delete;
+
+      ImageSurface& surface() { return m_entry->surface; }
+      Context& context() { return m_entry->context; }
+
+    private:
+      friend class ContextPool;
+
+      Lease(ContextPool* pool, std::unique_ptr<Entry> entry)
+      : m_pool(pool)
+      , m_entry(std::move(entry))
+      {
+      }
+
+      ContextPool* m_pool = nullptr;
+      std::unique_ptr<Entry> m_entry;
+    };
+
+    explicit ContextPool(std::size_t max_idle = 8)
+    : m_max_idle(max_idle)
+    {
+    }
+
+    // the pool of the current thread, a lease must be destroyed in the thread that acquired it
+    static ContextPool& local()
+    {
+      thread_local ContextPool pool;
+      return pool;
+    }
+
+    // a surface with transparent (or black) pixels and a context in its default state
+    Lease acquire(Format format, int width, int height)
+    {
+      auto it = std::find_if(m_idle.begin(), m_idle.end(), [&](const std::unique_ptr<Entry>& entry) {
+        return entry->format == format && entry->width == width && entry->height == height;
+      });
+
+      if (it == m_idle.end()) {
+        ++m_created;
+        return { this, std::make_unique<Entry>(format, width, height) };
+      }
+
+      std::unique_ptr<Entry> entry = std::move(*it);
+      m_idle.erase(it);
+      ++m_reused;
+
+      ImageSurface& surface = entry->surface;
+      surface.flush();
+      std::memset(surface.data(), 0, static_cast<std::size_t>(surface.stride()) * static_cast<std::size_t>(height));
+      surface.mark_dirty();
+      return { this, std::move(entry) };
+    }
+
+    Lease acquire(Format format, Vec2I size) { return acquire(format, size.x, size.y); }
+
+    std::size_t idle() const { return m_idle.size(); }
+    std::size_t created() const { return m_created; }
+    std::size_t reused() const { return m_reused; }
+    void clear() { m_idle.clear(); }
+
+  private:
+    void release(std::unique_ptr<Entry> entry)
+    {
+      Context& ctx = entry->context;
+      ctx.restore();
+
+      // a context in error (e.g. after an unbalanced restore or group) is not reused
+      // after an unbalanced save, the restore goes back to a state of the user
+      if (ctx.status() != Status::Success || ctx.tolerance() != SavedTolerance || m_max_idle == 0) {
+        return;
+      }
+
+      // the path is not part of the saved state
+      ctx.new_path();
+      entry->save();
+
+      // a surface referenced outside of the pool (e.g. by a pattern) must not be cleared by the next lease
+      if (entry->surface.reference_count() != entry->references) {
+        return;
+      }
+
+      ImageSurface& surface = entry->surface;
+      surface.set_device_scale(1.0, 1.0);
+      surface.set_device_offset(0.0, 0.0);
+      surface.set_fallback_resolution(entry->fallback_resolution);
+
+      if (m_idle.size() == m_max_idle) {
+        m_idle.erase(m_idle.begin());
+      }
+
+      m_idle.push_back(std::move(entry));
+    }
+
+    std::size_t m_max_idle;
+    std::vector<std::unique_ptr<Entry>> m_idle;
+    std::size_t m_created = 0;
+    std::size_t m_reused = 0;
+  };
+
+  /*
+   * command buffer
+   */
+
+  enum class Command : std::uint8_t {
+    Save,
+    Restore,
+    PushGroup,
+    PushGroupWithContent,
+    PopGroupToSource,
+
+    SetOperator,
+    SetSourceColor,
+    SetSource,
+    SetSourceSurface,
+    SetTolerance,
+    SetAntialias,
+    SetFillRule,
+    SetLineWidth,
+    SetLineCap,
+    SetLineJoin,
+    SetMiterLimit,
+    SetDash,
+
+    Translate,
+    Scale,
+    Rotate,
+    Transform,
+    SetMatrix,
+    IdentityMatrix,
+
+    NewPath,
+    NewSubPath,
+    ClosePath,
+    MoveTo,
+    LineTo,
+    CurveTo,
+    Arc,
+    ArcNegative,
+    RelMoveTo,
+    RelLineTo,
+    RelCurveTo,
+    Rectangle,
+    AppendPath,
+
+    Paint,
+    PaintWithAlpha,
+    Mask,
+    Stroke,
+    StrokePreserve,
+    Fill,
+    FillPreserve,
+    ResetClip,
+    Clip,
+    ClipPreserve,
+
+    SelectFontFace,
+    SetFontSize,
+    ShowText,
+    ShowGlyphs,
+  };
+
+  namespace details {
+
+    struct CommandHeader {
+      Command command;
+      std::uint32_t size;
+    };
+
+    constexpr std::size_t CommandAlignment = 8;
+
+    constexpr std::size_t align_command(std::size_t size)
+    {
+      return (size + CommandAlignment - 1) / CommandAlignment * CommandAlignment;
+    }
+
+    // reads the arguments of a command in the order they were written
+    class CommandReader {
+    public:
+      explicit CommandReader(const std::byte* payload)
+      : m_begin(payload)
+      , m_current(payload)
+      {
+      }
+
+      template<typename T>
+      T read()
+      {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, m_current, sizeof(T));
+        m_current += sizeof(T);
+        return value;
+      }
+
+      // arrays are aligned in the payload, and the payload is aligned in the buffer
+      template<typename T>
+      const T* read_array(std::size_t count)
+      {
+        m_current = m_begin + align_command(static_cast<std::size_t>(m_current - m_begin));
+        const T* array = reinterpret_cast<const T*>(m_current); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        m_current += count * sizeof(T);
+        return array;
+      }
+
+    private:
+      const std::byte* m_begin;
+      const std::byte* m_current;
+    };
+
+  }
+
+  // a recorded command, the arguments are read with details::CommandReader
+  // a default constructed view refers to no command and has no payload
+  class CommandView {
+  public:
+    CommandView() = default;
+
+    Command command() const { return m_command; }
+    const std::byte* payload() const { return m_payload; }
+    std::size_t size() const { return m_size; }
+
+    details::CommandReader reader() const { return details::CommandReader(m_payload); }
+
+  private:
+    CommandView(Command command, const std::byte* payload, std::size_t size)
+    : m_command(command)
+    , m_payload(payload)
+    , m_size(size)
+    {
+    }
+
+    friend class CommandIterator;
+    Command m_command = Command::Save;
+    const std::byte* m_payload = nullptr;
+    std::size_t m_size = 0;
+  };
+
+  class CommandIterator {
+  public:
+    using value_type = CommandView;
+    using difference_type = std::ptrdiff_t;
+    using reference = value_type;
+    using pointer = value_type;
+    using iterator_category = std::forward_iterator_tag;
+
+    reference operator*() const
+    {
+      details::CommandHeader header = {};
+      std::memcpy(&header, m_data, sizeof(header));
+      return { header.command, m_data + sizeof(header), header.size };
+    }
+
+    CommandIterator& operator++()
+    {
+      details::CommandHeader header = {};
+      std::memcpy(&header, m_data, sizeof(header));
+      m_data += sizeof(header) + header.size;
+      return *this;
+    }
+
+    CommandIterator operator++(int) { CommandIterator copy = *this; ++*this; return copy; }
+
+    constexpr bool operator==(const CommandIterator& other) const noexcept { return m_data == other.m_data; }
+    constexpr bool operator!=(const CommandIterator& other) const noexcept { return m_data != other.m_data; }
+
+  private:
+    friend class CommandBuffer;
+    CommandIterator(const std::byte* data)
+    : m_data(data)
+    {
+    }
+
+    const std::byte* m_data = nullptr;
+  };
+
+  // a compact stream of the operations of a context, that can be recorded in any thread without cairo
+  // and replayed later in a context; clear() keeps the memory, so recording does not allocate after a warm-up
+  // patterns and surfaces are kept in side tables, with a reference
+  class CommandBuffer {
+  public:
+    CommandIterator begin() const { return m_data.data(); }
+    CommandIterator end() const { return m_data.data() + m_data.size(); }
+
+    std::size_t size() const { return m_count; }
+    std::size_t size_bytes() const { return m_data.size(); }
+    bool empty() const { return m_count == 0; }
+    void reserve(std::size_t bytes) { m_data.reserve(bytes); }
+
+    // a recording surface is a source of the buffer, directly or in a surface pattern
+    // cairo modifies a recording surface when it replays it, so the buffer must not be replayed in several threads at once
+    bool uses_recording_surface() const
+    {
+      const bool in_surfaces = std::any_of(m_surfaces.begin(), m_surfaces.end(), [](Surface& surface) {
+        return surface.type() == SurfaceType::Recording;
+      });
+
+      return in_surfaces || std::any_of(m_patterns.begin(), m_patterns.end(), [](Pattern& pattern) {
+        cairo_surface_t* surface = nullptr;
+        return cairo_pattern_get_surface(pattern.m_pattern, &surface) == CAIRO_STATUS_SUCCESS && cairo_surface_get_type(surface) == CAIRO_SURFACE_TYPE_RECORDING;
+      });
+    }
+
+    void clear()
+    {
+      m_data.clear();
+      m_patterns.clear();
+      m_surfaces.clear();
+      m_count = 0;
+    }
+
+    void save() { record(Command::Save); }
+    void restore() { record(Command::Restore); }
+    void push_group() { record(Command::PushGroup); }
+    void push_group_with_content(Content c) { record(Command::PushGroupWithContent, c); }
+    void pop_group_to_source() { record(Command::PopGroupToSource); }
+
+    void set_compositing_operator(Operator op) { record(Command::SetOperator, op); }
+    void set_source(Pattern& pat) { record(Command::SetSource, add_pattern(pat)); }
+    void set_source(Surface& surf, double x, double y) { record(Command::SetSourceSurface, x, y, add_surface(surf)); }
+    void set_source(Surface& surf, Vec2F origin) { set_source(surf, origin.x, origin.y); }
+    void set_source_rgb(double red, double green, double blue) { record(Command::SetSourceColor, Color{ red, green, blue, 1.0 }); }
+    void set_source_rgba(double red, double green, double blue, double alpha) { record(Command::SetSourceColor, Color{ red, green, blue, alpha }); }
+    void set_source_color(Color col) { record(Command::SetSourceColor, col); }
+    void set_tolerance(double tolerance) { record(Command::SetTolerance, tolerance); }
+    void set_antialias(Antialias aa) { record(Command::SetAntialias, aa); }
+    void set_fill_rule(FillRule fr) { record(Command::SetFillRule, fr); }
+    void set_line_width(double width) { record(Command::SetLineWidth, width); }
+    void set_line_cap(LineCap lc) { record(Command::SetLineCap, lc); }
+    void set_line_join(LineJoin lj) { record(Command::SetLineJoin, lj); }
+    void set_miter_limit(double limit) { record(Command::SetMiterLimit, limit); }
+
+    void set_dash(const double* dashes, int num_dashes, double offset)
+    {
+      begin_command(Command::SetDash);
+      write(offset);
+      write(static_cast<std::uint32_t>(num_dashes));
+      write_array(dashes, num_dashes);
+      end_command();
+    }
+
+    template<typename T>
+    void set_dash(const T& dashes, double offset) { set_dash(std::data(dashes), static_cast<int>(std::size(dashes)), offset); }
+
+    CommandBuffer& translate(double tx, double ty) { record(Command::Translate, tx, ty); return *this; }
+    CommandBuffer& translate(Vec2F translation) { return translate(translation.x, translation.y); }
+    CommandBuffer& scale(double sx, double sy) { record(Command::Scale, sx, sy); return *this; }
+    CommandBuffer& scale(Vec2F scale) { return this->scale(scale.x, scale.y); }
+    CommandBuffer& rotate(double angle) { record(Command::Rotate, angle); return *this; }
+    CommandBuffer& transform(const Matrix& m) { record(Command::Transform, m); return *this; }
+    void set_matrix(const Matrix& m) { record(Command::SetMatrix, m); }
+    void identity_matrix() { record(Command::IdentityMatrix); }
+
+    CommandBuffer& new_path() { record(Command::NewPath); return *this; }
+    CommandBuffer& new_sub_path() { record(Command::NewSubPath); return *this; }
+    CommandBuffer& close_path() { record(Command::ClosePath); return *this; }
+    CommandBuffer& move_to(double x, double y) { record(Command::MoveTo, x, y); return *this; }
+    CommandBuffer& move_to(Vec2F point) { return move_to(point.x, point.y); }
+    CommandBuffer& line_to(double x, double y) { record(Command::LineTo, x, y); return *this; }
+    CommandBuffer& line_to(Vec2F point) { return line_to(point.x, point.y); }
+    CommandBuffer& curve_to(double x1, double y1, double x2, double y2, double x3, double y3) { record(Command::CurveTo, x1, y1, x2, y2, x3, y3); return *this; }
+    CommandBuffer& curve_to(Vec2F p1, Vec2F p2, Vec2F p3) { return curve_to(p1.x, p1.y, p2.x, p2.y, p3.x, p3.y); }
+    CommandBuffer& arc(double xc, double yc, double radius, double angle1, double angle2) { record(Command::Arc, xc, yc, radius, angle1, angle2); return *this; }
+    CommandBuffer& arc(Vec2F center, double radius, double angle1, double angle2) { return arc(center.x, center.y, radius, angle1, angle2); }
+    CommandBuffer& arc_negative(double xc, double yc, double radius, double angle1, double angle2) { record(Command::ArcNegative, xc, yc, radius, angle1, angle2); return *this; }
+    CommandBuffer& arc_negative(Vec2F center, double radius, double angle1, double angle2) { return arc_negative(center.x, center.y, radius, angle1, angle2); }
+    CommandBuffer& rel_move_to(double dx, double dy) { record(Command::RelMoveTo, dx, dy); return *this; }
+    CommandBuffer& rel_move_to(Vec2F d) { return rel_move_to(d.x, d.y); }
+    CommandBuffer& rel_line_to(double dx, double dy) { record(Command::RelLineTo, dx, dy); return *this; }
+    CommandBuffer& rel_line_to(Vec2F d) { return rel_line_to(d.x, d.y); }
+    CommandBuffer& rel_curve_to(double dx1, double dy1, double dx2, double dy2, double dx3, double dy3) { record(Command::RelCurveTo, dx1, dy1, dx2, dy2, dx3, dy3); return *this; }
+    CommandBuffer& rel_curve_to(Vec2F d1, Vec2F d2, Vec2F d3) { return rel_curve_to(d1.x, d1.y, d2.x, d2.y, d3.x, d3.y); }
+    CommandBuffer& rectangle(double x, double y, double w, double h) { record(Command::Rectangle, x, y, w, h); return *this; }
+    CommandBuffer& rectangle(const RectF& r) { return rectangle(r.x, r.y, r.w, r.h); }
+
+    CommandBuffer& append_path(const PathBuffer& path)
+    {
+      begin_command(Command::AppendPath);
+      write(static_cast<std::uint32_t>(path.data_size()));
+      write_array(path.data(), path.data_size());
+      end_command();
+      return *this;
+    }
+
+    void paint() { record(Command::Paint); }
+    void paint_with_alpha(double alpha) { record(Command::PaintWithAlpha, alpha); }
+    void mask(Pattern& pat) { record(Command::Mask, add_pattern(pat)); }
+    void stroke() { record(Command::Stroke); }
+    void stroke_preserve() { record(Command::StrokePreserve); }
+    void fill() { record(Command::Fill); }
+    void fill_preserve() { record(Command::FillPreserve); }
+    void reset_clip() { record(Command::ResetClip); }
+    void clip() { record(Command::Clip); }
+    void clip_preserve() { record(Command::ClipPreserve); }
+
+    void select_font_face(std::string_view family, FontSlant slant, FontWeight weight)
+    {
+      begin_command(Command::SelectFontFace);
+      write(slant);
+      write(weight);
+      write_string(family);
+      end_command();
+    }
+
+    void set_font_size(double size) { record(Command::SetFontSize, size); }
+
+    void show_text(std::string_view utf8)
+    {
+      begin_command(Command::ShowText);
+      write_string(utf8);
+      end_command();
+    }
+
+    void show_glyphs(const glyph* glyphs, int num_glyphs)
+    {
+      begin_command(Command::ShowGlyphs);
+      write(static_cast<std::uint32_t>(num_glyphs));
+      write_array(glyphs, num_glyphs);
+      end_command();
+    }
+
+    template<typename T>
+    void show_glyphs(const T& glyphs) { show_glyphs(std::data(glyphs), static_cast<int>(std::size(glyphs))); }
+
+    // copies a command of another buffer (or of this one), with its patterns and surfaces
+    void append(const CommandBuffer& other, const CommandView& command)
+    {
+      details::CommandReader reader = command.reader();
+
+      switch (command.command()) {
+        case Command::SetSource:
+          set_source(other.m_patterns[reader.read<std::uint32_t>()]);
+          return;
+        case Command::Mask:
+          mask(other.m_patterns[reader.read<std::uint32_t>()]);
+          return;
+        case Command::SetSourceSurface: {
+          const auto x = reader.read<double>();
+          const auto y = reader.read<double>();
+          set_source(other.m_surfaces[reader.read<std::uint32_t>()], x, y);
+          return;
+        }
+        default:
+          break;
+      }
+
+      begin_command(command.command());
+      const std::size_t start = m_data.size();
+      m_data.resize(start + command.size());
+      std::memcpy(m_data.data() + start, command.payload(), command.size());
+      end_command();
+    }
+
+    // true if the commands of this buffer have the same effect, patterns and surfaces are compared by identity
+    bool same_command(const CommandView& lhs, const CommandView& rhs) const
+    {
+      if (lhs.command() != rhs.command() || lhs.size() != rhs.size()) {
+        return false;
+      }
+
+      details::CommandReader lhs_reader = lhs.reader();
+      details::CommandReader rhs_reader = rhs.reader();
+
+      switch (lhs.command()) {
+        case Command::SetSource:
+        case Command::Mask:
+          return m_patterns[lhs_reader.read<std::uint32_t>()].m_pattern.get() == m_patterns[rhs_reader.read<std::uint32_t>()].m_pattern.get();
+        case Command::SetSourceSurface:
+          return lhs_reader.read<double>() == rhs_reader.read<double>() && lhs_reader.read<double>() == rhs_reader.read<double>()
+              && m_surfaces[lhs_reader.read<std::uint32_t>()].m_surface.get() == m_surfaces[rhs_reader.read<std::uint32_t>()].m_surface.get();
+        default:
+          return std::memcmp(lhs.payload(), rhs.payload(), lhs.size()) == 0;
+      }
+    }
+
+    void append(const CommandBuffer& other)
+    {
+      for (const CommandView command : other) {
+        append(other, command);
+      }
+    }
+
+    // the buffer can be replayed in several contexts at the same time, it is only read
+    void replay(Context& ctx) const
+    {
+      for (const CommandView command : *this) {
+        replay(ctx, command);
+      }
+    }
+
+    void replay(Context& ctx, const CommandView& command) const
+    {
+      details::CommandReader reader = command.reader();
+
+      switch (command.command()) {
+        case Command::Save:
+          ctx.save();
+          break;
+        case Command::Restore:
+          ctx.restore();
+          break;
+        case Command::PushGroup:
+          ctx.push_group();
+          break;
+        case Command::PushGroupWithContent:
+          ctx.push_group_with_content(reader.read<Content>());
+          break;
+        case Command::PopGroupToSource:
+          ctx.pop_group_to_source();
+          break;
+        case Command::SetOperator:
+          ctx.set_compositing_operator(reader.read<Operator>());
+          break;
+        case Command::SetSourceColor:
+          ctx.set_source_color(reader.read<Color>());
+          break;
+        case Command::SetSource:
+          ctx.set_source(m_patterns[reader.read<std::uint32_t>()]);
+          break;
+        case Command::SetSourceSurface: {
+          const auto x = reader.read<double>();
+          const auto y = reader.read<double>();
+          ctx.set_source(m_surfaces[reader.read<std::uint32_t>()], x, y);
+          break;
+        }
+        case Command::SetTolerance:
+          ctx.set_tolerance(reader.read<double>());
+          break;
+        case Command::SetAntialias:
+          ctx.set_antialias(reader.read<Antialias>());
+          break;
+        case Command::SetFillRule:
+          ctx.set_fill_rule(reader.read<FillRule>());
+          break;
+        case Command::SetLineWidth:
+          ctx.set_line_width(reader.read<double>());
+          break;
+        case Command::SetLineCap:
+          ctx.set_line_cap(reader.read<LineCap>());
+          break;
+        case Command::SetLineJoin:
+          ctx.set_line_join(reader.read<LineJoin>());
+          break;
+        case Command::SetMiterLimit:
+          ctx.set_miter_limit(reader.read<double>());
+          break;
+        case Command::SetDash: {
+          const auto offset = reader.read<double>();
+          const auto count = reader.read<std::uint32_t>();
+          ctx.set_dash(reader.read_array<double>(count), static_cast<int>(count), offset);
+          break;
+        }
+        case Command::Translate: {
+          const auto tx = reader.read<double>();
+          ctx.translate(tx, reader.read<double>());
+          break;
+        }
+        case Command::Scale: {
+          const auto sx = reader.read<double>();
+          ctx.scale(sx, reader.read<double>());
+          break;
+        }
+        case Command::Rotate:
+          ctx.rotate(reader.read<double>());
+          break;
+        case Command::Transform:
+          ctx.transform(reader.read<Matrix>());
+          break;
+        case Command::SetMatrix:
+          ctx.set_matrix(reader.read<Matrix>());
+          break;
+        case Command::IdentityMatrix:
+          ctx.identity_matrix();
+          break;
+        case Command::NewPath:
+          ctx.new_path();
+          break;
+        case Command::NewSubPath:
+          ctx.new_sub_path();
+          break;
+        case Command::ClosePath:
+          ctx.close_path();
+          break;
+        case Command::MoveTo:
+          ctx.move_to(reader.read<Vec2F>());
+          break;
+        case Command::LineTo:
+          ctx.line_to(reader.read<Vec2F>());
+          break;
+        case Command::CurveTo: {
+          const auto p1 = reader.read<Vec2F>();
+          const auto p2 = reader.read<Vec2F>();
+          ctx.curve_to(p1, p2, reader.read<Vec2F>());
+          break;
+        }
+        case Command::Arc:
+        case Command::ArcNegative: {
+          const auto center = reader.read<Vec2F>();
+          const auto radius = reader.read<double>();
+          const auto angle1 = reader.read<double>();
+          const auto angle2 = reader.read<double>();
+
+          if (command.command() == Command::Arc) {
+            ctx.arc(center, radius, angle1, angle2);
+          } else {
+            ctx.arc_negative(center, radius, angle1, angle2);
+          }
+
+          break;
+        }
+        case Command::RelMoveTo:
+          ctx.rel_move_to(reader.read<Vec2F>());
+          break;
+        case Command::RelLineTo:
+          ctx.rel_line_to(reader.read<Vec2F>());
+          break;
+        case Command::RelCurveTo: {
+          const auto d1 = reader.read<Vec2F>();
+          const auto d2 = reader.read<Vec2F>();
+          const auto d3 = reader.read<Vec2F>();
+          ctx.rel_curve_to(d1.x, d1.y, d2.x, d2.y, d3.x, d3.y);
+          break;
+        }
+        case Command::Rectangle:
+          ctx.rectangle(reader.read<RectF>());
+          break;
+        case Command::AppendPath: {
+          const auto count = reader.read<std::uint32_t>();
+          ctx.append_path(reader.read_array<PathData>(count), static_cast<int>(count));
+          break;
+        }
+        case Command::Paint:
+          ctx.paint();
+          break;
+        case Command::PaintWithAlpha:
+          ctx.paint_with_alpha(reader.read<double>());
+          break;
+        case Command::Mask:
+          ctx.mask(m_patterns[reader.read<std::uint32_t>()]);
+          break;
+        case Command::Stroke:
+          ctx.stroke();
+          break;
+        case Command::StrokePreserve:
+          ctx.stroke_preserve();
+          break;
+        case Command::Fill:
+          ctx.fill();
+          break;
+        case Command::FillPreserve:
+          ctx.fill_preserve();
+          break;
+        case Command::ResetClip:
+          ctx.reset_clip();
+          break;
+        case Command::Clip:
+          ctx.clip();
+          break;
+        case Command::ClipPreserve:
+          ctx.clip_preserve();
+          break;
+        case Command::SelectFontFace: {
+          const auto slant = reader.read<FontSlant>();
+          const auto weight = reader.read<FontWeight>();
+          const auto length = reader.read<std::uint32_t>();
+          ctx.select_font_face(reader.read_array<char>(length), slant, weight);
+          break;
+        }
+        case Command::SetFontSize:
+          ctx.set_font_size(reader.read<double>());
+          break;
+        case Command::ShowText: {
+          const auto length = reader.read<std::uint32_t>();
+          ctx.show_text(reader.read_array<char>(length));
+          break;
+        }
+        case Command::ShowGlyphs: {
+          const auto count = reader.read<std::uint32_t>();
+          ctx.show_glyphs(reader.read_array<glyph>(count), static_cast<int>(count));
+          break;
+        }
+      }
+    }
+
+  private:
+    template<typename... Args>
+    void record(Command command, const Args&... args)
+    {
+      begin_command(command);
+      (write(args), ...);
+      end_command();
+    }
+
+    void begin_command(Command command)
+    {
+      // the padding of the header is zeroed, so that equal commands have equal bytes
+      m_command_start = m_data.size();
+      m_data.resize(m_command_start + sizeof(details::CommandHeader));
+      std::memcpy(m_data.data() + m_command_start + offsetof(details::CommandHeader, command), &command, sizeof(command));
+    }
+
+    void end_command()
+    {
+      m_data.resize(m_command_start + details::align_command(m_data.size() - m_command_start));
+      const auto size = static_cast<std::uint32_t>(m_data.size() - m_command_start - sizeof(details::CommandHeader));
+      std::memcpy(m_data.data() + m_command_start + offsetof(details::CommandHeader, size), &size, sizeof(size));
+      ++m_count;
+    }
+
+    template<typename T>
+    void write(const T& value)
+    {
+      static_assert(std::is_trivially_copyable_v<T>);
+      const std::size_t start = m_data.size();
+      m_data.resize(start + sizeof(T));
+      std::memcpy(m_data.data() + start, &value, sizeof(T));
+    }
+
+    template<typename T>
+    void write_array(const T* values, int count)
+    {
+      static_assert(std::is_trivially_copyable_v<T>);
+      const std::size_t start = m_command_start + details::align_command(m_data.size() - m_command_start);
+      const std::size_t size = static_cast<std::size_t>(count) * sizeof(T);
+      m_data.resize(start + size);
+
+      if (size > 0) {
+        std::memcpy(m_data.data() + start, values, size);
+      }
+    }
+
+    // with a terminating null character, so that it can be given to cairo directly
+    void write_string(std::string_view string)
+    {
+      write(static_cast<std::uint32_t>(string.size() + 1));
+      const std::size_t start = m_command_start + details::align_command(m_data.size() - m_command_start);
+      m_data.resize(start + string.size() + 1);
+      std::memcpy(m_data.data() + start, string.data(), string.size());
+      m_data[start + string.size()] = std::byte{ 0 };
+    }
+
+    std::uint32_t add_pattern(Pattern& pat)
+    {
+      m_patterns.push_back(pat);
+      return static_cast<std::uint32_t>(m_patterns.size() - 1);
+    }
+
+    std::uint32_t add_surface(Surface& surf)
+    {
+      m_surfaces.push_back(surf);
+      return static_cast<std::uint32_t>(m_surfaces.size() - 1);
+    }
+
+    std::vector<std::byte> m_data;
+    std::size_t m_command_start = 0;
+    std::size_t m_count = 0;
+    // the objects are given to the contexts, they are never modified
+    mutable std::vector<Pattern> m_patterns;
+    mutable std::vector<Surface> m_surfaces;
+  };
+
+  /*
+   * command buffer optimization
+   */
+
+  namespace details {
+
+    // the parts of the state of a context that are set by a single command
+    enum class StateSlot : std::uint8_t {
+      Operator,
+      Source,
+      Tolerance,
+      Antialias,
+      FillRule,
+      LineWidth,
+      LineCap,
+      LineJoin,
+      MiterLimit,
+      Dash,
+      FontFace,
+      FontSize,
+      None,
+    };
+
+    constexpr std::size_t StateSlotCount = static_cast<std::size_t>(StateSlot::None);
+
+    using StateSlots = std::array<CommandView, StateSlotCount>;
+
+    constexpr std::size_t slot_index(StateSlot slot)
+    {
+      return static_cast<std::size_t>(slot);
+    }
+
+    inline StateSlot state_slot(Command command)
+    {
+      switch (command) {
+        case Command::SetOperator:
+          return StateSlot::Operator;
+        case Command::SetSourceColor:
+        case Command::SetSource:
+        case Command::SetSourceSurface:
+          return StateSlot::Source;
+        case Command::SetTolerance:
+          return StateSlot::Tolerance;
+        case Command::SetAntialias:
+          return StateSlot::Antialias;
+        case Command::SetFillRule:
+          return StateSlot::FillRule;
+        case Command::SetLineWidth:
+          return StateSlot::LineWidth;
+        case Command::SetLineCap:
+          return StateSlot::LineCap;
+        case Command::SetLineJoin:
+          return StateSlot::LineJoin;
+        case Command::SetMiterLimit:
+          return StateSlot::MiterLimit;
+        case Command::SetDash:
+          return StateSlot::Dash;
+        case Command::SelectFontFace:
+          return StateSlot::FontFace;
+        case Command::SetFontSize:
+          return StateSlot::FontSize;
+        default:
+          return StateSlot::None;
+      }
+    }
+
+    inline bool is_path_command(Command command)
+    {
+      return Command::NewPath <= command && command <= Command::AppendPath;
+    }
+
+    inline bool is_transform_command(Command command)
+    {
+      return Command::Translate <= command && command <= Command::IdentityMatrix;
+    }
+
+    // operators that do not change the destination outside of the shape
+    inline bool is_bounded_operator(Operator op)
+    {
+      return op != Operator::In && op != Operator::Out && op != Operator::DestIn && op != Operator::DestAtop;
+    }
+
+    inline bool same_matrix(const Matrix& lhs, const Matrix& rhs)
+    {
+      const Affine a = affine(lhs);
+      const Affine b = affine(rhs);
+      return a.xx == b.xx && a.yx == b.yx && a.xy == b.xy && a.yy == b.yy && a.x0 == b.x0 && a.y0 == b.y0;
+    }
+
+    inline Bounds unbounded()
+    {
+      constexpr double Infinity = std::numeric_limits<double>::infinity();
+      return { -Infinity, -Infinity, Infinity, Infinity };
+    }
+
+    inline Bounds intersection(const Bounds& lhs, const Bounds& rhs)
+    {
+      return { std::max(lhs.x_min, rhs.x_min), std::max(lhs.y_min, rhs.y_min), std::min(lhs.x_max, rhs.x_max), std::min(lhs.y_max, rhs.y_max) };
+    }
+
+    // pixel bounds that are less than a pixel apart may share antialiased pixels
+    inline bool may_overlap(const Bounds& lhs, const Bounds& rhs)
+    {
+      return lhs.x_min <= rhs.x_max + 1.0 && rhs.x_min <= lhs.x_max + 1.0 && lhs.y_min <= rhs.y_max + 1.0 && rhs.y_min <= lhs.y_max + 1.0;
+    }
+
+    // follows the state of a context through the commands of a buffer, without cairo
+    // the matrix, the clip and the path bounds are in pixels of the target of the context the buffer is replayed in
+    // what the buffer does not set is unknown: the state slots without payload, the path until the first new_path or draw
+    class CommandSimulator {
+    public:
+      struct State {
+        StateSlots slots = {};
+        Matrix matrix = Matrix::create_identity();
+        bool matrix_known = true;
+        Bounds clip = unbounded();
+      };
+
+      CommandSimulator(const Matrix& matrix, const Matrix& device, const Bounds& clip)
+      : m_device(device)
+      {
+        m_state.matrix = matrix;
+        m_state.clip = clip;
+      }
+
+      const State& state() const { return m_state; }
+      const CommandView& slot(StateSlot slot) const { return m_state.slots[slot_index(slot)]; }
+      bool path_empty() const { return m_path_empty; }
+
+      // the known operator of the context is bounded
+      bool bounded_operator() const
+      {
+        const CommandView& op = slot(StateSlot::Operator);
+        return op.payload() != nullptr && is_bounded_operator(op.reader().read<Operator>());
+      }
+
+      // the bounds of the pixels that a drawing command may change, false if they are unknown
+      bool draw_bounds(const CommandView& command, Bounds& bounds) const
+      {
+        switch (command.command()) {
+          case Command::Fill:
+          case Command::FillPreserve:
+            if (!m_path_known) {
+              return false;
+            }
+
+            bounds = m_path;
+            break;
+          case Command::Stroke:
+          case Command::StrokePreserve: {
+            Vec2F margin = { 0.0, 0.0 };
+
+            if (!m_path_known || !stroke_margin(margin)) {
+              return false;
+            }
+
+            bounds = m_path;
+
+            if (!bounds.empty()) {
+              bounds = { bounds.x_min - margin.x, bounds.y_min - margin.y, bounds.x_max + margin.x, bounds.y_max + margin.y };
+            }
+
+            break;
+          }
+          case Command::Paint:
+          case Command::PaintWithAlpha:
+          case Command::Mask:
+            bounds = unbounded();
+            break;
+          default:
+            return false;
+        }
+
+        if (!bounds.empty()) {
+          // the antialiasing covers the pixels around the bounds, where the coverage of the clip also applies
+          bounds = { bounds.x_min - 1.0, bounds.y_min - 1.0, bounds.x_max + 1.0, bounds.y_max + 1.0 };
+        }
+
+        bounds = intersection(bounds, m_state.clip);
+        return true;
+      }
+
+      void apply(const CommandView& command)
+      {
+        if (const StateSlot slot = state_slot(command.command()); slot != StateSlot::None) {
+          m_state.slots[slot_index(slot)] = command;
+          return;
+        }
+
+        if (is_path_command(command.command())) {
+          apply_path(command);
+          return;
+        }
+
+        details::CommandReader reader = command.reader();
+
+        switch (command.command()) {
+          case Command::Save:
+          case Command::PushGroup:
+          case Command::PushGroupWithContent:
+            m_stack.push_back(m_state);
+            break;
+          case Command::Restore:
+          case Command::PopGroupToSource:
+            if (m_stack.empty()) {
+              // restores a state of the context from before the buffer
+              m_state = State{};
+              m_state.matrix_known = false;
+            } else {
+              m_state = m_stack.back();
+              m_stack.pop_back();
+            }
+
+            if (command.command() == Command::PopGroupToSource) {
+              m_state.slots[slot_index(StateSlot::Source)] = CommandView();
+            }
+
+            break;
+          case Command::Translate: {
+            const auto tx = reader.read<double>();
+            m_state.matrix.translate(tx, reader.read<double>());
+            break;
+          }
+          case Command::Scale: {
+            const auto sx = reader.read<double>();
+            m_state.matrix.scale(sx, reader.read<double>());
+            break;
+          }
+          case Command::Rotate:
+            m_state.matrix.rotate(reader.read<double>());
+            break;
+          case Command::Transform:
+            m_state.matrix = reader.read<Matrix>() * m_state.matrix;
+            break;
+          case Command::SetMatrix:
+            m_state.matrix = reader.read<Matrix>() * m_device;
+            m_state.matrix_known = true;
+            break;
+          case Command::IdentityMatrix:
+            m_state.matrix = m_device;
+            m_state.matrix_known = true;
+            break;
+          case Command::ResetClip:
+            m_state.clip = unbounded();
+            break;
+          case Command::Clip:
+          case Command::ClipPreserve:
+            if (m_path_known) {
+              m_state.clip = intersection(m_state.clip, m_path);
+            }
+
+            if (command.command() == Command::Clip) {
+              reset_path();
+            }
+
+            break;
+          case Command::Fill:
+          case Command::Stroke:
+            reset_path();
+            break;
+          case Command::ShowText:
+          case Command::ShowGlyphs:
+            // the text moves the current point
+            m_current_known = false;
+            break;
+          default:
+            break;
+        }
+
+        if (is_transform_command(command.command())) {
+          // a pattern is fixed to the user space of set_source, only a color is the same source after a transformation
+          CommandView& source = m_state.slots[slot_index(StateSlot::Source)];
+
+          if (source.payload() != nullptr && source.command() != Command::SetSourceColor) {
+            source = CommandView();
+          }
+        }
+      }
+
+      // the path is known to be empty, as after new_path()
+      void reset_path()
+      {
+        m_path = Bounds{};
+        m_path_known = true;
+        m_path_empty = true;
+        m_has_current = false;
+        m_current_known = true;
+      }
+
+    private:
+      bool stroke_margin(Vec2F& margin) const
+      {
+        const CommandView& width = slot(StateSlot::LineWidth);
+        const CommandView& join = slot(StateSlot::LineJoin);
+        const CommandView& limit = slot(StateSlot::MiterLimit);
+        const CommandView& cap = slot(StateSlot::LineCap);
+
+        if (width.payload() == nullptr) {
+          return false;
+        }
+
+        double factor = 1.0;
+
+        if (join.payload() == nullptr || join.reader().read<LineJoin>() == LineJoin::Miter) {
+          if (limit.payload() == nullptr) {
+            return false;
+          }
+
+          factor = std::max(factor, limit.reader().read<double>());
+        }
+
+        if (cap.payload() == nullptr || cap.reader().read<LineCap>() == LineCap::Square) {
+          factor = std::max(factor, std::sqrt(2.0));
+        }
+
+        // the extents of a disk of this radius in user space
+        const double radius = width.reader().read<double>() / 2 * factor;
+        const Affine m = affine(m_state.matrix);
+        margin = { radius * std::hypot(m.xx, m.xy), radius * std::hypot(m.yx, m.yy) };
+        return true;
+      }
+
+      Vec2F device_point(double x, double y) const { return m_state.matrix.transform_point({ x, y }); }
+
+      void move_to(Vec2F point)
+      {
+        m_path.add(point);
+        m_current = m_start = point;
+        m_has_current = true;
+        m_current_known = true;
+      }
+
+      // the start of a line, a curve or an arc from the current point
+      void segment_to(Vec2F point)
+      {
+        if (!m_current_known) {
+          m_path_known = false;
+        }
+
+        if (!m_has_current) {
+          m_start = point;
+        }
+
+        m_path.add(point);
+        m_current = point;
+        m_has_current = true;
+        m_current_known = true;
+      }
+
+      void arc(Vec2F center, double radius, double angle1, double angle2)
+      {
+        segment_to(device_point(center.x + radius * std::cos(angle1), center.y + radius * std::sin(angle1)));
+        m_path.add(device_point(center.x - radius, center.y - radius));
+        m_path.add(device_point(center.x + radius, center.y - radius));
+        m_path.add(device_point(center.x - radius, center.y + radius));
+        m_path.add(device_point(center.x + radius, center.y + radius));
+        m_current = device_point(center.x + radius * std::cos(angle2), center.y + radius * std::sin(angle2));
+      }
+
+      void apply_path(const CommandView& command)
+      {
+        if (command.command() == Command::NewPath) {
+          reset_path();
+          return;
+        }
+
+        if (command.command() == Command::NewSubPath) {
+          m_has_current = false;
+          m_current_known = true;
+          return;
+        }
+
+        m_path_empty = false;
+
+        if (!m_state.matrix_known) {
+          m_path_known = false;
+          m_current_known = false;
+          return;
+        }
+
+        details::CommandReader reader = command.reader();
+
+        switch (command.command()) {
+          case Command::ClosePath:
+            m_current = m_start;
+            break;
+          case Command::MoveTo: {
+            const auto p = reader.read<Vec2F>();
+            move_to(device_point(p.x, p.y));
+            break;
+          }
+          case Command::LineTo: {
+            const auto p = reader.read<Vec2F>();
+            segment_to(device_point(p.x, p.y));
+            break;
+          }
+          case Command::CurveTo: {
+            const auto p1 = reader.read<Vec2F>();
+            const auto p2 = reader.read<Vec2F>();
+            const auto p3 = reader.read<Vec2F>();
+            segment_to(device_point(p1.x, p1.y));
+            m_path.add(device_point(p2.x, p2.y));
+            m_current = device_point(p3.x, p3.y);
+            m_path.add(m_current);
+            break;
+          }
+          case Command::Arc:
+          case Command::ArcNegative: {
+            const auto center = reader.read<Vec2F>();
+            const auto radius = reader.read<double>();
+            const auto angle1 = reader.read<double>();
+            arc(center, radius, angle1, reader.read<double>());
+            break;
+          }
+          case Command::RelMoveTo:
+          case Command::RelLineTo:
+          case Command::RelCurveTo: {
+            if (!m_current_known || !m_has_current) {
+              m_path_known = false;
+              m_current_known = false;
+              break;
+            }
+
+            const int num_points = command.command() == Command::RelCurveTo ? 3 : 1;
+
+            for (int i = 0; i < num_points; ++i) {
+              const Vec2F d = m_state.matrix.transform_distance(reader.read<Vec2F>());
+              const Vec2F point = { m_current.x + d.x, m_current.y + d.y };
+              m_path.add(point);
+
+              if (i == num_points - 1) {
+                if (command.command() == Command::RelMoveTo) {
+                  m_start = point;
+                }
+
+                m_current = point;
+              }
+            }
+
+            break;
+          }
+          case Command::Rectangle: {
+            const auto r = reader.read<RectF>();
+            move_to(device_point(r.x, r.y));
+            m_path.add(device_point(r.x + r.w, r.y));
+            m_path.add(device_point(r.x, r.y + r.h));
+            m_path.add(device_point(r.x + r.w, r.y + r.h));
+            break;
+          }
+          case Command::AppendPath: {
+            const auto num_data = static_cast<int>(reader.read<std::uint32_t>());
+            const PathData* data = reader.read_array<PathData>(num_data);
+
+            for (int i = 0; i < num_data; i += data[i].header.length) {
+              const PathData* element = &data[i];
+
+              switch (element->header.type) {
+                case CAIRO_PATH_MOVE_TO:
+                  move_to(device_point(element[1].point.x, element[1].point.y));
+                  break;
+                case CAIRO_PATH_LINE_TO:
+                  segment_to(device_point(element[1].point.x, element[1].point.y));
+                  break;
+                case CAIRO_PATH_CURVE_TO:
+                  segment_to(device_point(element[1].point.x, element[1].point.y));
+                  m_path.add(device_point(element[2].point.x, element[2].point.y));
+                  m_current = device_point(element[3].point.x, element[3].point.y);
+                  m_path.add(m_current);
+                  break;
+                case CAIRO_PATH_CLOSE_PATH:
+                  m_current = m_start;
+                  break;
+              }
+            }
+
+            break;
+          }
+          default:
+            break;
+        }
+      }
+
+      State m_state;
+      std::vector<State> m_stack;
+      Matrix m_device;
+      Bounds m_path;
+      bool m_path_known = false;
+      bool m_path_empty = false;
+      Vec2F m_current = { 0.0, 0.0 };
+      Vec2F m_start = { 0.0, 0.0 };
+      bool m_has_current = false;
+      bool m_current_known = false;
+    };
+
+  }
+
+  // passes on a command buffer before its replay, each of them can be disabled
+  // - dedupe state: removes the state changes to the current value, the no-op transformations and the empty save/restore
+  // - cull: removes the fills, strokes and paints outside the clip of the target
+  // - reorder: moves a fill or a stroke next to a previous one with the same state, if all the draws it passes are disjoint with bounded operators
+  // - merge fills: fills a run of disjoint fills with the same state as one path
+  class CommandOptimizer {
+  public:
+    struct Stats {
+      std::size_t input_commands = 0;
+      std::size_t output_commands = 0;
+      std::size_t removed_state = 0;
+      std::size_t culled_draws = 0;
+      std::size_t reordered_draws = 0;
+      std::size_t merged_fills = 0;
+    };
+
+    CommandOptimizer() = default;
+
+    CommandOptimizer(Context& ctx)
+    {
+      set_target(ctx);
+    }
+
+    // the buffer will be replayed in the context, with its current matrix and clip
+    void set_target(Context& ctx)
+    {
+      const Matrix user_to_pixel = details::user_to_pixel_matrix(ctx);
+      Matrix inverse = ctx.matrix();
+      inverse.invert();
+
+      const RectF extents = ctx.clip_extents();
+      details::Bounds clip;
+      clip.add(user_to_pixel.transform_point({ extents.x, extents.y }));
+      clip.add(user_to_pixel.transform_point({ extents.x + extents.w, extents.y }));
+      clip.add(user_to_pixel.transform_point({ extents.x, extents.y + extents.h }));
+      clip.add(user_to_pixel.transform_point({ extents.x + extents.w, extents.y + extents.h }));
+      set_target(user_to_pixel, inverse * user_to_pixel, clip.rect());
+    }
+
+    // the user to pixel matrix at the start of the replay, the device to pixel transformation of the target and the clip in pixels
+    // without a target, the buffer is replayed with an identity matrix and without a clip
+    void set_target(const Matrix& matrix, const Matrix& device, const RectF& clip)
+    {
+      m_matrix = matrix;
+      m_device = device;
+      m_clip = { clip.x, clip.y, clip.x + clip.w, clip.y + clip.h };
+    }
+
+    void set_dedupe_state(bool enabled) { m_dedupe_state = enabled; }
+    bool dedupe_state() const { return m_dedupe_state; }
+    void set_cull(bool enabled) { m_cull = enabled; }
+    bool cull() const { return m_cull; }
+    void set_reorder(bool enabled) { m_reorder = enabled; }
+    bool reorder() const { return m_reorder; }
+    void set_merge_fills(bool enabled) { m_merge_fills = enabled; }
+    bool merge_fills() const { return m_merge_fills; }
+
+    // the statistics of the last optimization
+    const Stats& stats() const { return m_stats; }
+
+    void optimize(const CommandBuffer& input, CommandBuffer& output)
+    {
+      assert(&input != &output);
+      m_stats = {};
+      m_stats.input_commands = input.size();
+
+      const CommandBuffer* current = &input;
+
+      auto run = [&](bool enabled, void (CommandOptimizer::*pass)(const CommandBuffer&, CommandBuffer&)) {
+        if (!enabled) {
+          return;
+        }
+
+        CommandBuffer& next = current == &m_buffers[0] ? m_buffers[1] : m_buffers[0];
+        next.clear();
+        (this->*pass)(*current, next);
+        current = &next;
+      };
+
+      run(m_cull, &CommandOptimizer::cull_pass);
+      run(m_dedupe_state, &CommandOptimizer::dedupe_pass);
+      run(m_reorder, &CommandOptimizer::reorder_pass);
+      run(m_merge_fills, &CommandOptimizer::merge_pass);
+
+      output.clear();
+      output.append(*current);
+      m_stats.output_commands = output.size();
+
+      // the intermediate buffers keep their memory but not the patterns and surfaces
+      m_buffers[0].clear();
+      m_buffers[1].clear();
+    }
+
+    CommandBuffer optimize(const CommandBuffer& input)
+    {
+      CommandBuffer output;
+      optimize(input, output);
+      return output;
+    }
+
+  private:
+    struct Item {
+      details::StateSlots slots;
+      std::size_t first_path;
+      std::size_t last_path;
+      CommandView draw;
+      details::Bounds bounds;
+      bool movable;
+    };
+
+    static constexpr std::size_t ReorderWindow = 64;
+    static constexpr std::size_t MaxMergedFills = 256;
+
+    details::CommandSimulator simulator() const { return { m_matrix, m_device, m_clip }; }
+
+    void cull_pass(const CommandBuffer& input, CommandBuffer& output)
+    {
+      details::CommandSimulator sim = simulator();
+      // the commands since the last use of the path, that do not need the path
+      m_pending.clear();
+      // the path of the context is unknown at the start
+      bool output_path = true;
+
+      auto flush = [&]() {
+        for (const CommandView& command : m_pending) {
+          output.append(input, command);
+          output_path = output_path || details::is_path_command(command.command());
+        }
+
+        m_pending.clear();
+      };
+
+      for (const CommandView command : input) {
+        const Command type = command.command();
+        details::Bounds bounds;
+        const bool culled = sim.draw_bounds(command, bounds) && bounds.empty();
+
+        if (type == Command::Fill || type == Command::Stroke) {
+          if (culled) {
+            // the path is dropped with the draw, or cleared if it is already in the output
+            for (const CommandView& pending : m_pending) {
+              if (!details::is_path_command(pending.command())) {
+                output.append(input, pending);
+              }
+            }
+
+            m_pending.clear();
+
+            if (output_path) {
+              output.new_path();
+            }
+
+            ++m_stats.culled_draws;
+          } else {
+            flush();
+            output.append(input, command);
+          }
+
+          output_path = false;
+        } else if (culled) {
+          // a preserving draw or a paint
+          ++m_stats.culled_draws;
+        } else if (details::is_path_command(type) || details::is_transform_command(type) || details::state_slot(type) != details::StateSlot::None || type == Command::Save || type == Command::Restore) {
+          m_pending.push_back(command);
+        } else {
+          flush();
+          output.append(input, command);
+
+          if (type == Command::Clip) {
+            output_path = false;
+          }
+        }
+
+        sim.apply(command);
+      }
+
+      flush();
+    }
+
+    void dedupe_pass(const CommandBuffer& input, CommandBuffer& output)
+    {
+      details::CommandSimulator sim = simulator();
+      bool pending_save = false;
+
+      for (const CommandView command : input) {
+        const Command type = command.command();
+
+        if (pending_save) {
+          pending_save = false;
+
+          if (type == Command::Restore) {
+            m_stats.removed_state += 2;
+            sim.apply(command);
+            continue;
+          }
+
+          output.save();
+        }
+
+        bool redundant = false;
+
+        if (const details::StateSlot slot = details::state_slot(type); slot != details::StateSlot::None) {
+          const CommandView& current = sim.slot(slot);
+          redundant = current.payload() != nullptr && input.same_command(current, command);
+        } else if (details::is_transform_command(type)) {
+          redundant = no_op_transform(sim, command);
+        } else if (type == Command::Save) {
+          pending_save = true;
+          sim.apply(command);
+          continue;
+        }
+
+        if (redundant) {
+          ++m_stats.removed_state;
+        } else {
+          output.append(input, command);
+        }
+
+        sim.apply(command);
+      }
+
+      if (pending_save) {
+        output.save();
+      }
+    }
+
+    bool no_op_transform(const details::CommandSimulator& sim, const CommandView& command) const
+    {
+      details::CommandReader reader = command.reader();
+
+      switch (command.command()) {
+        case Command::Translate: {
+          const auto tx = reader.read<double>();
+          return tx == 0.0 && reader.read<double>() == 0.0;
+        }
+        case Command::Scale: {
+          const auto sx = reader.read<double>();
+          return sx == 1.0 && reader.read<double>() == 1.0;
+        }
+        case Command::Rotate:
+          return reader.read<double>() == 0.0;
+        case Command::Transform:
+          return details::same_matrix(reader.read<Matrix>(), Matrix::create_identity());
+        case Command::SetMatrix:
+          return sim.state().matrix_known && details::same_matrix(reader.read<Matrix>() * m_device, sim.state().matrix);
+        case Command::IdentityMatrix:
+          return sim.state().matrix_known && details::same_matrix(m_device, sim.state().matrix);
+        default:
+          return false;
+      }
+    }
+
+    bool same_slots(const CommandBuffer& input, const details::StateSlots& lhs, const details::StateSlots& rhs) const
+    {
+      for (std::size_t i = 0; i < details::StateSlotCount; ++i) {
+        if ((lhs[i].payload() == nullptr) != (rhs[i].payload() == nullptr)) {
+          return false;
+        }
+
+        if (lhs[i].payload() != nullptr && !input.same_command(lhs[i], rhs[i])) {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    // appends the state changes from a state to another one, all the slots unknown in the target are unknown in the origin
+    void append_state(const CommandBuffer& input, details::StateSlots& from, const details::StateSlots& to, CommandBuffer& output)
+    {
+      for (std::size_t i = 0; i < details::StateSlotCount; ++i) {
+        if (to[i].payload() == nullptr) {
+          continue;
+        }
+
+        if (from[i].payload() == nullptr || !input.same_command(from[i], to[i])) {
+          output.append(input, to[i]);
+          from[i] = to[i];
+        }
+      }
+    }
+
+    // an item can be drawn before the items between, if their shapes are disjoint and they do not use an inherited state that it sets
+    bool can_move_before(std::size_t item, std::size_t first) const
+    {
+      const Item& moved = m_items[item];
+
+      for (std::size_t i = first; i < item; ++i) {
+        if (m_done[i] != 0) {
+          continue;
+        }
+
+        const Item& passed = m_items[i];
+
+        if (!passed.movable || details::may_overlap(passed.bounds, moved.bounds)) {
+          return false;
+        }
+
+        for (std::size_t j = 0; j < details::StateSlotCount; ++j) {
+          if (passed.slots[j].payload() == nullptr && moved.slots[j].payload() != nullptr) {
+            return false;
+          }
+        }
+      }
+
+      return true;
+    }
+
+    void flush_items(const CommandBuffer& input, details::StateSlots& state, const details::StateSlots& current, std::size_t path_start, CommandBuffer& output)
+    {
+      const std::size_t count = m_items.size();
+      m_done.assign(count, 0);
+      std::size_t next = 0;
+      const Item* last = nullptr;
+
+      for (std::size_t emitted = 0; emitted < count; ++emitted) {
+        while (m_done[next] != 0) {
+          ++next;
+        }
+
+        std::size_t chosen = next;
+
+        if (last != nullptr && !same_slots(input, last->slots, m_items[next].slots)) {
+          for (std::size_t i = next + 1; i < std::min(count, next + ReorderWindow); ++i) {
+            if (m_done[i] != 0) {
+              continue;
+            }
+
+            if (!m_items[i].movable) {
+              break;
+            }
+
+            if (same_slots(input, last->slots, m_items[i].slots) && can_move_before(i, next)) {
+              chosen = i;
+              ++m_stats.reordered_draws;
+              break;
+            }
+          }
+        }
+
+        const Item& item = m_items[chosen];
+        m_done[chosen] = 1;
+        append_state(input, state, item.slots, output);
+
+        for (std::size_t i = item.first_path; i < item.last_path; ++i) {
+          output.append(input, m_paths[i]);
+        }
+
+        output.append(input, item.draw);
+        last = &item;
+      }
+
+      append_state(input, state, current, output);
+
+      // the start of a path that is not drawn yet
+      for (std::size_t i = path_start; i < m_paths.size(); ++i) {
+        output.append(input, m_paths[i]);
+      }
+
+      m_items.clear();
+      m_paths.clear();
+    }
+
+    void reorder_pass(const CommandBuffer& input, CommandBuffer& output)
+    {
+      details::CommandSimulator sim = simulator();
+      details::StateSlots state = sim.state().slots;
+      m_items.clear();
+      m_paths.clear();
+      std::size_t path_start = 0;
+      bool from_empty_path = false;
+
+      // a segment is a sequence of state changes, paths, fills and strokes, the state changes are only emitted when needed
+      for (const CommandView command : input) {
+        const Command type = command.command();
+        const bool slot = details::state_slot(type) != details::StateSlot::None;
+        const bool path = details::is_path_command(type);
+        const bool draw = type == Command::Fill || type == Command::Stroke;
+
+        if ((slot && m_paths.size() > path_start) || (!slot && !path && !draw)) {
+          flush_items(input, state, sim.state().slots, path_start, output);
+          path_start = 0;
+        }
+
+        if (path) {
+          if (m_paths.size() == path_start) {
+            from_empty_path = sim.path_empty();
+          }
+
+          m_paths.push_back(command);
+        } else if (draw) {
+          if (m_paths.size() == path_start) {
+            from_empty_path = sim.path_empty();
+          }
+
+          Item item = { sim.state().slots, path_start, m_paths.size(), command, {}, false };
+          item.movable = from_empty_path && sim.bounded_operator() && sim.draw_bounds(command, item.bounds);
+          m_items.push_back(item);
+          path_start = m_paths.size();
+        } else if (!slot) {
+          output.append(input, command);
+        }
+
+        sim.apply(command);
+
+        if (!slot && !path && !draw) {
+          state = sim.state().slots;
+        }
+      }
+
+      flush_items(input, state, sim.state().slots, path_start, output);
+    }
+
+    void merge_pass(const CommandBuffer& input, CommandBuffer& output)
+    {
+      details::CommandSimulator sim = simulator();
+      // a fill is held back while the next paths can be filled with it
+      bool merging = false;
+      CommandView fill;
+      m_paths.clear();
+      m_bounds.clear();
+
+      auto flush = [&]() {
+        output.append(input, fill);
+
+        for (const CommandView& path : m_paths) {
+          output.append(input, path);
+        }
+
+        m_paths.clear();
+        merging = false;
+      };
+
+      for (const CommandView command : input) {
+        const Command type = command.command();
+
+        if (merging) {
+          if (details::is_path_command(type) && type != Command::NewPath) {
+            m_paths.push_back(command);
+            sim.apply(command);
+            continue;
+          }
+
+          details::Bounds bounds;
+
+          if (type == Command::Fill && m_bounds.size() < MaxMergedFills && sim.draw_bounds(command, bounds)
+              && std::none_of(m_bounds.begin(), m_bounds.end(), [&bounds](const details::Bounds& other) { return details::may_overlap(bounds, other); })) {
+            // the path does not connect to the previous one
+            output.new_sub_path();
+
+            for (const CommandView& path : m_paths) {
+              output.append(input, path);
+            }
+
+            m_paths.clear();
+            m_bounds.push_back(bounds);
+            ++m_stats.merged_fills;
+            sim.apply(command);
+            continue;
+          }
+
+          flush();
+        }
+
+        details::Bounds bounds;
+
+        if (type == Command::Fill && sim.bounded_operator() && sim.draw_bounds(command, bounds)) {
+          merging = true;
+          fill = command;
+          m_bounds.clear();
+          m_bounds.push_back(bounds);
+        } else {
+          output.append(input, command);
+        }
+
+        sim.apply(command);
+      }
+
+      if (merging) {
+        flush();
+      }
+    }
+
+    bool m_dedupe_state = true;
+    bool m_cull = true;
+    bool m_reorder = true;
+    bool m_merge_fills = true;
+    Matrix m_matrix = Matrix::create_identity();
+    Matrix m_device = Matrix::create_identity();
+    details::Bounds m_clip = details::unbounded();
+    Stats m_stats;
+
+    std::array<CommandBuffer, 2> m_buffers;
+    std::vector<CommandView> m_pending;
+    std::vector<CommandView> m_paths;
+    std::vector<Item> m_items;
+    std::vector<char> m_done;
+    std::vector<details::Bounds> m_bounds;
+  };
+
+  /*
+   * display list
+   */
+
+  // draw items indexed by their bounds, so that only the items that touch a dirty area of the target are replayed
+  // each item is a command buffer in the user space of the context, replayed between save() and restore() from an empty path
+  class DisplayList {
   public:
-    Status status() { return static_cast<Status>(cairo_pattern_status(m_pattern)); }
-    PatternType type() { return static_cast<PatternType>(cairo_pattern_get_type(m_pattern)); }
+    DisplayList(double cell_size = 256.0)
+    : m_grid(cell_size)
+    {
+    }
 
-    void set_matrix(const Matrix& m) { cairo_pattern_set_matrix(m_pattern, m); }
-    Matrix matrix() { Matrix m; cairo_pattern_get_matrix(m_pattern, m); return m; }
+    // the bounds are computed from the commands, an item whose bounds are unknown is always replayed
+    // (text, strokes without line width, join or miter limit, paints, unbounded operators)
+    int add(CommandBuffer commands)
+    {
+      Item item = { std::move(commands), {}, false, true };
+      item.bounded = compute_bounds(item.commands, item.bounds);
+      return insert(std::move(item));
+    }
+
+    int add(CommandBuffer commands, const RectF& bounds)
+    {
+      return insert({ std::move(commands), bounds, true, true });
+    }
+
+    void update(int id, CommandBuffer commands)
+    {
+      erase(id);
+      Item& item = m_items[id];
+      item.commands = std::move(commands);
+      item.bounded = compute_bounds(item.commands, item.bounds);
+      index(id);
+    }
 
-    void set_extend(Extend e) { cairo_pattern_set_extend(m_pattern, static_cast<cairo_extend_t>(e)); }
-    Extend extend() { return static_cast<Extend>(cairo_pattern_get_extend(m_pattern)); }
+    void update(int id, CommandBuffer commands, const RectF& bounds)
+    {
+      erase(id);
+      Item& item = m_items[id];
+      item.commands = std::move(commands);
+      item.bounds = bounds;
+      item.bounded = true;
+      index(id);
+    }
 
-    void set_filter(Filter f) { cairo_pattern_set_filter(m_pattern, static_cast<cairo_filter_t>(f)); }
-    Filter filter() { return static_cast<Filter>(cairo_pattern_get_filter(m_pattern)); }
+    void remove(int id)
+    {
+      erase(id);
+      m_items[id].commands.clear();
+      m_items[id].present = false;
+      --m_count;
+    }
 
-  protected:
-    Pattern(cairo_pattern_t* pat)
-    : m_pattern(pat)
+    void clear()
     {
+      m_grid.clear();
+      m_items.clear();
+      m_unbounded.clear();
+      m_count = 0;
     }
 
-    Pattern(cairo_pattern_t* pat, [[maybe_unused]] details::IncreaseReferenceType incr)
-    : m_pattern(pat, details::IncreaseReference)
+    int size() const { return m_count; }
+    const CommandBuffer& commands(int id) const { return m_items[id].commands; }
+    bool bounded(int id) const { return m_items[id].bounded; }
+    const RectF& extents(int id) const { return m_items[id].bounds; }
+
+    // the number of items replayed by the last replay
+    std::size_t replayed() const { return m_replayed; }
+
+    // replays all the items in the order they were added
+    void replay(Context& ctx)
     {
+      m_replayed = 0;
+
+      for (int id = 0; id < static_cast<int>(m_items.size()); ++id) {
+        if (m_items[id].present) {
+          replay_item(ctx, id);
+        }
+      }
     }
 
-    cairo_pattern_t* raw() { return m_pattern; }
+    // replays the items that touch the dirty rectangle, in the device space of the context, clipped to the rectangle
+    // the current path of the context is cleared
+    void replay(Context& ctx, const RectI& dirty)
+    {
+      m_replayed = 0;
 
-  private:
-    friend class Context;
-    details::Handle<cairo_pattern_t, cairo_pattern_reference, cairo_pattern_destroy> m_pattern;
-  };
+      if (dirty.w <= 0 || dirty.h <= 0) {
+        return;
+      }
 
-  /*
-   * device
-   */
+      Matrix device_to_user = details::user_to_device_matrix(ctx);
 
-  enum class DeviceType : std::underlying_type_t<cairo_device_type_t> { // NOLINT(performance-enum-size)
-    Drm = CAIRO_DEVICE_TYPE_DRM,
-    Gl = CAIRO_DEVICE_TYPE_GL,
-    Script = CAIRO_DEVICE_TYPE_SCRIPT,
-    Xcb = CAIRO_DEVICE_TYPE_XCB,
-    Xlib = CAIRO_DEVICE_TYPE_XLIB,
-    Xml = CAIRO_DEVICE_TYPE_XML,
-    Cogl = CAIRO_DEVICE_TYPE_COGL,
-    Win32 = CAIRO_DEVICE_TYPE_WIN32,
+      if (device_to_user.invert() != Status::Success) {
+        return;
+      }
 
-    Invalid = CAIRO_DEVICE_TYPE_INVALID,
-  };
+      const std::array<Vec2F, 4> corners = {
+        device_to_user.transform_point({ static_cast<double>(dirty.x), static_cast<double>(dirty.y) }),
+        device_to_user.transform_point({ static_cast<double>(dirty.x + dirty.w), static_cast<double>(dirty.y) }),
+        device_to_user.transform_point({ static_cast<double>(dirty.x + dirty.w), static_cast<double>(dirty.y + dirty.h) }),
+        device_to_user.transform_point({ static_cast<double>(dirty.x), static_cast<double>(dirty.y + dirty.h) }),
+      };
 
-  class Device {
-  public:
-    DeviceType type() { return static_cast<DeviceType>(cairo_device_get_type(m_device)); }
-    Status status() { return static_cast<Status>(cairo_device_status(m_device)); }
+      details::Bounds area;
 
-    Status acquire() { return static_cast<Status>(cairo_device_acquire(m_device)); }
-    void release() { cairo_device_release(m_device); }
+      for (const Vec2F corner : corners) {
+        area.add(corner);
+      }
 
-    void flush() { cairo_device_flush(m_device); }
-    void finish() { cairo_device_finish(m_device); }
+      m_ids.clear();
+      m_ids.insert(m_ids.end(), m_unbounded.begin(), m_unbounded.end());
+
+      m_grid.query(area.rect(), [&](int id) {
+        if (details::intersects(m_items[id].bounds, area.rect())) {
+          m_ids.push_back(id);
+        }
+      });
+
+      if (m_ids.empty()) {
+        return;
+      }
+
+      std::sort(m_ids.begin(), m_ids.end());
+
+      ctx.save();
+      ctx.new_path();
+      ctx.polygon(corners);
+      ctx.clip();
+
+      for (const int id : m_ids) {
+        replay_item(ctx, id);
+      }
+
+      ctx.restore();
+    }
 
   private:
-    Device(cairo_device_t* dev, [[maybe_unused]] details::IncreaseReferenceType incr)
-    : m_device(dev, details::IncreaseReference)
+    struct Item {
+      CommandBuffer commands;
+      RectF bounds;
+      bool bounded;
+      bool present;
+    };
+
+    static bool compute_bounds(const CommandBuffer& commands, RectF& bounds)
+    {
+      details::CommandSimulator sim(Matrix::create_identity(), Matrix::create_identity(), details::unbounded());
+      sim.reset_path();
+      details::Bounds all;
+
+      for (const CommandView command : commands) {
+        switch (command.command()) {
+          case Command::Fill:
+          case Command::FillPreserve:
+          case Command::Stroke:
+          case Command::StrokePreserve:
+          case Command::Paint:
+          case Command::PaintWithAlpha:
+          case Command::Mask:
+          case Command::ShowText:
+          case Command::ShowGlyphs: {
+            details::Bounds draw;
+            const CommandView& op = sim.slot(details::StateSlot::Operator);
+
+            // the context is expected to have a bounded operator, like the default one
+            if (op.payload() != nullptr && !sim.bounded_operator()) {
+              return false;
+            }
+
+            if (!sim.draw_bounds(command, draw)) {
+              return false;
+            }
+
+            if (!draw.empty()) {
+              if (std::isinf(draw.x_min) || std::isinf(draw.y_min) || std::isinf(draw.x_max) || std::isinf(draw.y_max)) {
+                return false;
+              }
+
+              all.add(Vec2F{ draw.x_min, draw.y_min });
+              all.add(Vec2F{ draw.x_max, draw.y_max });
+            }
+
+            break;
+          }
+          default:
+            break;
+        }
+
+        sim.apply(command);
+      }
+
+      bounds = all.rect();
+      return true;
+    }
+
+    int insert(Item item)
     {
+      const int id = static_cast<int>(m_items.size());
+      m_items.push_back(std::move(item));
+      index(id);
+      ++m_count;
+      return id;
     }
 
-    friend class Surface;
-    details::Handle<cairo_device_t, cairo_device_reference, cairo_device_destroy> m_device;
+    void index(int id)
+    {
+      if (m_items[id].bounded) {
+        m_grid.insert(id, m_items[id].bounds);
+      } else {
+        m_unbounded.insert(std::lower_bound(m_unbounded.begin(), m_unbounded.end(), id), id);
+      }
+    }
+
+    void erase(int id)
+    {
+      assert(0 <= id && id < static_cast<int>(m_items.size()) && m_items[id].present);
+
+      if (m_items[id].bounded) {
+        m_grid.remove(id, m_items[id].bounds);
+      } else {
+        m_unbounded.erase(std::find(m_unbounded.begin(), m_unbounded.end(), id));
+      }
+    }
+
+    void replay_item(Context& ctx, int id)
+    {
+      ctx.save();
+      ctx.new_path();
+      m_items[id].commands.replay(ctx);
+      ctx.restore();
+      ++m_replayed;
+    }
+
+    details::GridIndex m_grid;
+    std::vector<Item> m_items;
+    std::vector<int> m_unbounded;
+    std::vector<int> m_ids;
+    int m_count = 0;
+    std::size_t m_replayed = 0;
   };
 
   /*
-   * surface
+   * scene graph
    */
 
-  enum class SurfaceType : std::underlying_type_t<cairo_surface_type_t> { // NOLINT(performance-enum-size)
-    Image = CAIRO_SURFACE_TYPE_IMAGE,
-    Pdf = CAIRO_SURFACE_TYPE_PDF,
-    Ps = CAIRO_SURFACE_TYPE_PS,
-    Xlib = CAIRO_SURFACE_TYPE_XLIB,
-    Xcb = CAIRO_SURFACE_TYPE_XCB,
-    Glitz = CAIRO_SURFACE_TYPE_GLITZ,
-    Quartz = CAIRO_SURFACE_TYPE_QUARTZ,
-    Win32 = CAIRO_SURFACE_TYPE_WIN32,
-    Beos = CAIRO_SURFACE_TYPE_BEOS,
-    Directfb = CAIRO_SURFACE_TYPE_DIRECTFB,
-    Svg = CAIRO_SURFACE_TYPE_SVG,
-    Os2 = CAIRO_SURFACE_TYPE_OS2,
-    Win32Printing = CAIRO_SURFACE_TYPE_WIN32_PRINTING,
-    QuartzImage = CAIRO_SURFACE_TYPE_QUARTZ_IMAGE,
-    Script = CAIRO_SURFACE_TYPE_SCRIPT,
-    Qt = CAIRO_SURFACE_TYPE_QT,
-    Recording = CAIRO_SURFACE_TYPE_RECORDING,
-    Vg = CAIRO_SURFACE_TYPE_VG,
-    Gl = CAIRO_SURFACE_TYPE_GL,
-    Drm = CAIRO_SURFACE_TYPE_DRM,
-    Tee = CAIRO_SURFACE_TYPE_TEE,
-    Xml = CAIRO_SURFACE_TYPE_XML,
-    Skia = CAIRO_SURFACE_TYPE_SKIA,
-    Subsurface = CAIRO_SURFACE_TYPE_SUBSURFACE,
-    Cogl = CAIRO_SURFACE_TYPE_COGL,
+  enum class SceneCache : std::uint8_t {
+    None,
+    Recording,
+    Layer,
   };
 
-  class Surface {
-  public:
-    Status status() { return static_cast<Status>(cairo_surface_status(m_surface)); }
-    SurfaceType type() { return static_cast<SurfaceType>(cairo_surface_get_type(m_surface)); }
-    Content content() { return static_cast<Content>(cairo_surface_get_content(m_surface)); }
+  namespace details {
 
-    Surface create_similar(Content cnt, int width, int height) { return cairo_surface_create_similar(m_surface, static_cast<cairo_content_t>(cnt), width, height); }
-    Surface create_similar(Content cnt, Vec2I size) { return cairo_surface_create_similar(m_surface, static_cast<cairo_content_t>(cnt), size.x, size.y); }
-    Surface create_similar_image(Format fmt, int width, int height) { return cairo_surface_create_similar_image(m_surface, static_cast<cairo_format_t>(fmt), width, height); }
-    Surface create_similar_image(Format fmt, Vec2I size) { return cairo_surface_create_similar_image(m_surface, static_cast<cairo_format_t>(fmt), size.x, size.y); }
-    Surface create_for_rectangle(double x, double y, double width, double height) { return cairo_surface_create_for_rectangle(m_surface, x, y, width, height); }
-    Surface create_for_rectangle(RectF rectangle) { return cairo_surface_create_for_rectangle(m_surface, rectangle.x, rectangle.y, rectangle.w, rectangle.h); }
+    inline Bounds device_bounds(const Matrix& matrix, const RectF& rectangle)
+    {
+      Bounds bounds;
+      bounds.add(matrix.transform_point({ rectangle.x, rectangle.y }));
+      bounds.add(matrix.transform_point({ rectangle.x + rectangle.w, rectangle.y }));
+      bounds.add(matrix.transform_point({ rectangle.x, rectangle.y + rectangle.h }));
+      bounds.add(matrix.transform_point({ rectangle.x + rectangle.w, rectangle.y + rectangle.h }));
+      return bounds;
+    }
 
-    void finish() { cairo_surface_finish(m_surface); }
+    inline void unite(Bounds& bounds, const Bounds& other)
+    {
+      if (!other.empty()) {
+        bounds.add(Vec2F{ other.x_min, other.y_min });
+        bounds.add(Vec2F{ other.x_max, other.y_max });
+      }
+    }
 
-    Device device() { return { cairo_surface_get_device(m_surface), details::IncreaseReference };  }
+    inline RectI pixels(const Bounds& bounds)
+    {
+      if (bounds.empty()) {
+        return { 0, 0, 0, 0 };
+      }
 
-#if CAIRO_HAS_PNG_FUNCTIONS
-    Status write_to_png(const char* filename) { return static_cast<Status>(cairo_surface_write_to_png(m_surface, filename)); }
-    Status write_to_png(const std::filesystem::path& filename) { return static_cast<Status>(cairo_surface_write_to_png(m_surface, filename.string().c_str())); }
-#endif
+      const auto x = static_cast<int>(std::floor(bounds.x_min));
+      const auto y = static_cast<int>(std::floor(bounds.y_min));
+      return { x, y, static_cast<int>(std::ceil(bounds.x_max)) - x, static_cast<int>(std::ceil(bounds.y_max)) - y };
+    }
 
-    FontOptions font_options() { FontOptions opt; cairo_surface_get_font_options(m_surface, opt.m_options); return opt; };
+  }
 
-    void flush() { cairo_surface_flush(m_surface); }
-    void mark_dirty() { cairo_surface_mark_dirty(m_surface); }
-    void mark_dirty_rectangle(int x, int y, int width, int height) { cairo_surface_mark_dirty_rectangle(m_surface, x, y, width, height); }
-    void mark_dirty_rectangle(RectI rectangle) { cairo_surface_mark_dirty_rectangle(m_surface, rectangle.x, rectangle.y, rectangle.w, rectangle.h); }
+  // a node of a retained scene: a matrix, a clip and an opacity for a content and children drawn in the node space
+  // a change marks the node dirty, and its ancestors as having a dirty descendant
+  // a subtree can be cached as a recording (replayed at any scale) or as a layer (at the resolution of the target)
+  class SceneNode {
+  public:
+    using DrawFunction = std::function<void(Context&)>;
 
-    void set_device_scale(double x_scale, double y_scale) { cairo_surface_set_device_scale(m_surface, x_scale, y_scale); }
-    void set_device_scale(Vec2F scale) { cairo_surface_set_device_scale(m_surface, scale.x, scale.y); }
-    Vec2F device_scale() { Vec2F scale; cairo_surface_get_device_scale(m_surface, &scale.x, &scale.y); return scale; }
-    void set_device_offset(double x_offset, double y_offset) { cairo_surface_set_device_offset(m_surface, x_offset, y_offset); }
-    void set_device_offset(Vec2F offset) { cairo_surface_set_device_offset(m_surface, offset.x, offset.y); }
-    Vec2F device_offset() { Vec2F offset; cairo_surface_get_device_offset(m_surface, &offset.x, &offset.y); return offset; }
-    void set_fallback_resolution(double x_pixels_per_inch, double y_pixels_per_inch) { cairo_surface_set_fallback_resolution(m_surface, x_pixels_per_inch, y_pixels_per_inch); }
-    void set_fallback_resolution(Vec2F pixels_per_inch) { cairo_surface_set_fallback_resolution(m_surface, pixels_per_inch.x, pixels_per_inch.y); }
-    Vec2F fallback_resolution() { Vec2F pixels_per_inch; cairo_surface_get_fallback_resolution(m_surface, &pixels_per_inch.x, &pixels_per_inch.y); return pixels_per_inch; }
+    SceneNode() = default;
+    SceneNode(const SceneNode&) = delete;
+    SceneNode(SceneNode&&) = delete;
+    ~SceneNode() = default;
+    SceneNode& operator=(const SceneNode&) = delete;
+    SceneNode& operator=(SceneNode&&) = delete;
 
-    void copy_page() { cairo_surface_copy_page(m_surface); }
-    void show_page() { cairo_surface_show_page(m_surface); }
-    bool has_show_text_glyphs() { return cairo_surface_has_show_text_glyphs(m_surface) != 0; }
+    SceneNode* parent() const { return m_parent; }
+    int child_count() const { return static_cast<int>(m_children.size()); }
+    SceneNode& child(int i) { return *m_children[i]; }
 
-  protected:
-    Surface(cairo_surface_t* surf)
-    : m_surface(surf)
+    // the child is drawn above the previous ones
+    SceneNode& add_child()
     {
+      m_children.push_back(std::make_unique<SceneNode>());
+      SceneNode& child = *m_children.back();
+      child.m_parent = this;
+      child.mark_ancestors();
+      return child;
     }
 
-    Surface(cairo_surface_t* surf, [[maybe_unused]] details::IncreaseReferenceType incr)
-    : m_surface(surf, details::IncreaseReference)
+    void remove_child(SceneNode& child)
     {
+      auto it = std::find_if(m_children.begin(), m_children.end(), [&child](const std::unique_ptr<SceneNode>& node) { return node.get() == &child; });
+      assert(it != m_children.end());
+      m_removed.unite(details::pixels(child.m_bounds));
+      m_children.erase(it);
+      m_descendant_dirty = true;
+      mark_ancestors();
     }
 
-    cairo_surface_t* raw() { return m_surface; }
+    void set_matrix(const Matrix& matrix) { m_matrix = matrix; invalidate(); }
+    const Matrix& matrix() const { return m_matrix; }
 
-  private:
-    friend class Context;
-    friend class SurfacePattern;
-    details::Handle<cairo_surface_t, cairo_surface_reference, cairo_surface_destroy> m_surface;
-  };
+    // a clip in the node space, for the content and the children
+    void set_clip(const RectF& clip) { m_clip = clip; m_has_clip = true; invalidate(); }
+    void reset_clip() { m_has_clip = false; invalidate(); }
 
-  /*
-   * context
-   */
+    void set_opacity(double opacity) { m_opacity = opacity; invalidate(); }
+    double opacity() const { return m_opacity; }
 
-  struct DashArray {
-    std::vector<double> dashes;
-    double offset = 0.0;
-  };
+    void set_visible(bool visible) { m_visible = visible; invalidate(); }
+    bool visible() const { return m_visible; }
 
-  class Context {
-  public:
-    Context(Surface& surf)
-    : m_context(cairo_create(surf.m_surface))
+    // the content is drawn in the node space, inside the bounds, before the children
+    void set_content(DrawFunction draw, const RectF& bounds) { m_draw = std::move(draw); m_content_bounds = bounds; invalidate(); }
+
+    void set_cache(SceneCache cache) { m_cache = cache; invalidate(); }
+    SceneCache cache() const { return m_cache; }
+
+    // the node must be drawn again, for example because the data shown by the content changed
+    void invalidate()
     {
+      m_dirty = true;
+      mark_ancestors();
     }
 
-    Status status() { return static_cast<Status>(cairo_status(m_context)); }
-    Surface target() { return { cairo_get_target(m_context), details::IncreaseReference }; }
+    bool dirty() const { return m_dirty; }
 
-    void save() { cairo_save(m_context); }
-    void restore() { cairo_restore(m_context); }
+  private:
+    friend class Scene;
 
-    void push_group() { cairo_push_group(m_context); }
-    void push_group_with_content(Content c) { cairo_push_group_with_content(m_context, static_cast<cairo_content_t>(c)); }
-    Pattern pop_group() { return cairo_pop_group(m_context); }
-    void pop_group_to_source() { cairo_pop_group_to_source(m_context); }
-    Surface group_target() { return { cairo_get_group_target(m_context), details::IncreaseReference }; }
+    void mark_ancestors()
+    {
+      for (SceneNode* node = m_parent; node != nullptr && !node->m_descendant_dirty; node = node->m_parent) {
+        node->m_descendant_dirty = true;
+      }
+    }
 
-    // modify state
+    details::Bounds clip_bounds(const Matrix& matrix, const details::Bounds& parent_clip) const
+    {
+      return m_has_clip ? details::intersection(parent_clip, details::device_bounds(matrix, m_clip)) : parent_clip;
+    }
 
-    void set_compositing_operator(Operator op) { cairo_set_operator(m_context, static_cast<cairo_operator_t>(op)); }
-    Operator compositing_operator() { return static_cast<Operator>(cairo_get_operator(m_context)); }
-    void set_source(Pattern& pat) { cairo_set_source(m_context, pat.m_pattern); }
-    Pattern source() { return { cairo_get_source(m_context), details::IncreaseReference }; }
-    void set_source(Surface& surf, double x, double y) { cairo_set_source_surface(m_context, surf.m_surface, x, y); }
-    void set_source(Surface& surf, Vec2F origin) { cairo_set_source_surface(m_context, surf.m_surface, origin.x, origin.y); }
-    void set_source_rgb(double red, double green, double blue) { cairo_set_source_rgb(m_context, red, green, blue); }
-    void set_source_rgba(double red, double green, double blue, double alpha) { cairo_set_source_rgba(m_context, red, green, blue, alpha); }
-    void set_source_color(Color col) { cairo_set_source_rgba(m_context, col.r, col.g, col.b, col.a); }
-    void set_tolerance(double tolerance) { cairo_set_tolerance(m_context, tolerance); }
-    double tolerance() { return cairo_get_tolerance(m_context); }
+    // the new bounds of the whole subtree, in pixels of the target
+    void update(const Matrix& parent_matrix, const details::Bounds& parent_clip)
+    {
+      const Matrix matrix = m_matrix * parent_matrix;
+      const details::Bounds clip = clip_bounds(matrix, parent_clip);
+      m_bounds = {};
 
-    void set_antialias(Antialias aa) { cairo_set_antialias(m_context, static_cast<cairo_antialias_t>(aa)); }
-    Antialias antialias() { return static_cast<Antialias>(cairo_get_antialias(m_context)); }
+      if (m_visible) {
+        if (m_draw) {
+          details::unite(m_bounds, details::intersection(details::device_bounds(matrix, m_content_bounds), clip));
+        }
 
-    void set_fill_rule(FillRule fr) { cairo_set_fill_rule(m_context, static_cast<cairo_fill_rule_t>(fr)); }
-    FillRule fill_rule() { return static_cast<FillRule>(cairo_get_fill_rule(m_context)); }
-    void set_line_width(double width) { cairo_set_line_width(m_context, width); }
-    double line_width() { return cairo_get_line_width(m_context); }
-    void set_line_cap(LineCap lc) { cairo_set_line_cap(m_context, static_cast<cairo_line_cap_t>(lc)); }
-    LineCap line_cap() { return static_cast<LineCap>(cairo_get_line_cap(m_context)); }
-    void set_line_join(LineJoin lj) { cairo_set_line_join(m_context, static_cast<cairo_line_join_t>(lj)); }
-    LineJoin line_join() { return static_cast<LineJoin>(cairo_get_line_join(m_context)); }
+        for (auto& child : m_children) {
+          child->update(matrix, clip);
+          details::unite(m_bounds, child->m_bounds);
+        }
+      }
 
-    void set_dash(const double* dashes, int num_dashes, double offset) { cairo_set_dash(m_context, dashes, num_dashes, offset); };
-    template<typename T>
-    void set_dash(const T& dashes, double offset) { cairo_set_dash(m_context, std::data(dashes), static_cast<int>(std::size(dashes)), offset); }
-    int dash_count() { return cairo_get_dash_count(m_context); }
-    DashArray dash()
-    {
-      const int count = dash_count();
-      DashArray array;
-      array.dashes.resize(count);
-      cairo_get_dash(m_context, array.dashes.data(), &array.offset);
-      return array;
+      // the recording is drawn whole in the node space and does not depend on the ancestors
+      // the layer is drawn whole inside its pixels, it is checked against its pixel matrix and pixels when it is drawn
+      if (m_dirty || m_descendant_dirty) {
+        m_cache_valid = false;
+      }
+
+      m_removed.clear();
+      m_dirty = false;
+      m_descendant_dirty = false;
     }
 
-    void set_miter_limit(double limit) { cairo_set_miter_limit(m_context, limit); }
-    double mitter_limit() { return cairo_get_miter_limit(m_context); }
+    // adds the pixels of the target that changed since the last frame
+    void collect(const Matrix& parent_matrix, const details::Bounds& parent_clip, Region& damage)
+    {
+      if (!m_dirty && !m_descendant_dirty) {
+        return;
+      }
 
-    Context& translate(double tx, double ty) { cairo_translate(m_context, tx, ty); return *this; };
-    Context& translate(Vec2F translation) { cairo_translate(m_context, translation.x, translation.y); return *this; };
-    Context& scale(double sx, double sy) { cairo_scale(m_context, sx, sy); return *this; }
-    Context& scale(Vec2F scale) { cairo_scale(m_context, scale.x, scale.y); return *this; }
-    Context& rotate(double angle) { cairo_rotate(m_context, angle); return *this; }
-    Context& transform(const Matrix& m) { cairo_transform(m_context, m); return *this; }
+      damage.unite(m_removed);
+
+      if (m_dirty) {
+        damage.unite(details::pixels(m_bounds));
+        update(parent_matrix, parent_clip);
+        damage.unite(details::pixels(m_bounds));
+        return;
+      }
+
+      // only some descendants changed
+      const Matrix matrix = m_matrix * parent_matrix;
+      const details::Bounds clip = clip_bounds(matrix, parent_clip);
+      m_bounds = {};
+
+      if (m_visible) {
+        if (m_draw) {
+          details::unite(m_bounds, details::intersection(details::device_bounds(matrix, m_content_bounds), clip));
+        }
+
+        for (auto& child : m_children) {
+          child->collect(matrix, clip, damage);
+          details::unite(m_bounds, child->m_bounds);
+        }
+      }
+
+      m_removed.clear();
+      m_descendant_dirty = false;
+      m_cache_valid = false;
+    }
+
+    // without an area, the whole subtree is drawn for a cache: the bounds are only used to cull the damaged area
+    // in a recording, the subtree is drawn in the node space, where the pixel bounds of the layers do not apply
+    void draw(Context& ctx, const details::Bounds* area, bool recording)
+    {
+      if (!m_visible) {
+        return;
+      }
 
-    void set_matrix(const Matrix& m) { cairo_set_matrix(m_context, m); }
-    Matrix matrix() { Matrix m; cairo_get_matrix(m_context, m); return m; }
-    void identity_matrix() { cairo_identity_matrix(m_context); }
+      if (area != nullptr && details::intersection(*area, m_bounds).empty()) {
+        return;
+      }
 
-    Vec2F user_to_device(double x, double y) { cairo_user_to_device(m_context, &x, &y); return { x, y }; }
-    Vec2F user_to_device(Vec2F point) { cairo_user_to_device(m_context, &point.x, &point.y); return point; }
-    Vec2F user_to_device_distance(double dx, double dy) { cairo_user_to_device_distance(m_context, &dx, &dy); return { dx, dy }; }
-    Vec2F user_to_device_distance(Vec2F distance) { cairo_user_to_device_distance(m_context, &distance.x, &distance.y); return distance; }
-    Vec2F device_to_user(double x, double y) { cairo_device_to_user(m_context, &x, &y); return { x, y }; }
-    Vec2F device_to_user(Vec2F point) { cairo_device_to_user(m_context, &point.x, &point.y); return point; }
-    Vec2F device_to_user_distance(double dx, double dy) { cairo_device_to_user_distance(m_context, &dx, &dy); return { dx, dy }; }
-    Vec2F device_to_user_distance(Vec2F distance) { cairo_device_to_user_distance(m_context, &distance.x, &distance.y); return distance; }
+      Subcontext sub(ctx);
+      ctx.transform(m_matrix);
 
-    // path creation function
+      if (m_has_clip) {
+        ctx.new_path();
+        ctx.rectangle(m_clip);
+        ctx.clip();
+      }
 
-    Context& new_path() { cairo_new_path(m_context); return *this; }
-    Context& new_sub_path() { cairo_new_sub_path(m_context); return *this; }
-    Context& move_to(double x, double y) { cairo_move_to(m_context, x, y); return *this; }
-    Context& move_to(Vec2F point) { cairo_move_to(m_context, point.x, point.y); return *this; }
-    Context& line_to(double x, double y) { cairo_line_to(m_context, x, y); return *this; }
-    Context& line_to(Vec2F point) { cairo_line_to(m_context, point.x, point.y); return *this; }
-    Context& curve_to(double x1, double y1, double x2, double y2, double x3, double y3) { cairo_curve_to(m_context, x1, y1, x2, y2, x3, y3); return *this; }
-    Context& curve_to(Vec2F p1, Vec2F p2, Vec2F p3) { cairo_curve_to(m_context, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y); return *this; }
-    Context& arc(double xc, double yc, double radius, double angle1, double angle2) { cairo_arc(m_context, xc, yc, radius, angle1, angle2); return *this; }
-    Context& arc(Vec2F center, double radius, double angle1, double angle2) { cairo_arc(m_context, center.x, center.y, radius, angle1, angle2); return *this; }
-    Context& arc_negative(double xc, double yc, double radius, double angle1, double angle2) { cairo_arc_negative(m_context, xc, yc, radius, angle1, angle2); return *this; }
-    Context& arc_negative(Vec2F center, double radius, double angle1, double angle2) { cairo_arc_negative(m_context, center.x, center.y, radius, angle1, angle2); return *this; }
-    Context& rel_move_to(double dx, double dy) { cairo_rel_move_to(m_context, dx, dy); return *this; }
-    Context& rel_move_to(Vec2F d) { cairo_rel_move_to(m_context, d.x, d.y); return *this; }
-    Context& rel_line_to(double dx, double dy) { cairo_rel_line_to(m_context, dx, dy); return *this; }
-    Context& rel_line_to(Vec2F d) { cairo_rel_line_to(m_context, d.x, d.y); return *this; }
-    Context& rel_curve_to(double dx1, double dy1, double dx2, double dy2, double dx3, double dy3) { cairo_rel_curve_to(m_context, dx1, dy1, dx2, dy2, dx3, dy3); return *this; }
-    Context& rel_curve_to(Vec2F d1, Vec2F d2, Vec2F d3) { cairo_curve_to(m_context, d1.x, d1.y, d2.x, d2.y, d3.x, d3.y); return *this; }
-    Context& rectangle(double x, double y, double w, double h) { cairo_rectangle(m_context, x, y, w, h); return *this; }
-    Context& rectangle(const RectF& r) { cairo_rectangle(m_context, r.x, r.y, r.w, r.h); return *this; }
-    void close_path() { cairo_close_path(m_context); }
+      const SceneCache cache = recording && m_cache == SceneCache::Layer ? SceneCache::None : m_cache;
+
+      switch (cache) {
+        case SceneCache::None:
+          if (m_opacity < 1.0) {
+            ctx.push_group();
+            draw_subtree(ctx, area, recording);
+            ctx.pop_group_to_source();
+            ctx.paint_with_alpha(m_opacity);
+          } else {
+            draw_subtree(ctx, area, recording);
+          }
+
+          break;
+        case SceneCache::Recording:
+          if (!m_cache_valid || !m_recording) {
+            m_recording = RecordingSurface::create(Content::ColorAlpha);
+            Context recording_context(*m_recording);
+            draw_subtree(recording_context, nullptr, true);
+            m_cache_valid = true;
+          }
+
+          ctx.set_source(*m_recording, 0.0, 0.0);
+          ctx.paint_with_alpha(m_opacity);
+          break;
+        case SceneCache::Layer: {
+          const Matrix pixel = details::user_to_pixel_matrix(ctx);
+          const RectI pixels = details::pixels(m_bounds);
+
+          if (!m_cache_valid || !m_layer || !details::same_matrix(pixel, m_layer_matrix) || pixels.x != m_layer_pixels.x || pixels.y != m_layer_pixels.y || pixels.w != m_layer_pixels.w || pixels.h != m_layer_pixels.h) {
+            // the whole subtree is drawn in the group, not only the damaged area
+            Subcontext layer_sub(ctx);
+            ctx.reset_clip();
+            ctx.clip_region(pixels);
+
+            if (m_has_clip) {
+              ctx.rectangle(m_clip);
+              ctx.clip();
+            }
+
+            ctx.push_group();
+            draw_subtree(ctx, nullptr, false);
+            m_layer = ctx.pop_group();
+            m_layer_matrix = pixel;
+            m_layer_pixels = pixels;
+            m_cache_valid = true;
+          }
+
+          ctx.set_source(*m_layer);
+          ctx.paint_with_alpha(m_opacity);
+          break;
+        }
+      }
+    }
 
-    RectF path_extents()
+    void draw_subtree(Context& ctx, const details::Bounds* area, bool recording)
     {
-      double x1 = 0.0;
-      double y1 = 0.0;
-      double x2 = 0.0;
-      double y2 = 0.0;
-      cairo_path_extents(m_context, &x1, &y1, &x2, &y2);
-      return { x1, y1, x2 - x1, y2 -y1 };
+      if (m_draw) {
+        Subcontext sub(ctx);
+        ctx.new_path();
+        m_draw(ctx);
+      }
+
+      for (auto& child : m_children) {
+        child->draw(ctx, area, recording);
+      }
     }
 
-    bool has_current_point() { return cairo_has_current_point(m_context) != 0; }
-    Vec2F current_point() { Vec2F point; cairo_get_current_point(m_context, &point.x, &point.y); return point; }
+    SceneNode* m_parent = nullptr;
+    std::vector<std::unique_ptr<SceneNode>> m_children;
+    Matrix m_matrix = Matrix::create_identity();
+    RectF m_clip = { 0.0, 0.0, 0.0, 0.0 };
+    bool m_has_clip = false;
+    double m_opacity = 1.0;
+    bool m_visible = true;
+    DrawFunction m_draw;
+    RectF m_content_bounds = { 0.0, 0.0, 0.0, 0.0 };
+    SceneCache m_cache = SceneCache::None;
+
+    bool m_dirty = true;
+    bool m_descendant_dirty = false;
+    details::Bounds m_bounds;
+    Region m_removed;
+
+    bool m_cache_valid = false;
+    std::optional<RecordingSurface> m_recording;
+    std::optional<Pattern> m_layer;
+    Matrix m_layer_matrix = Matrix::create_identity();
+    RectI m_layer_pixels = { 0, 0, 0, 0 };
+  };
 
-    Path copy_path() { return cairo_copy_path(m_context); }
-    Path copy_path_flat() { return cairo_copy_path_flat(m_context); }
-    void append_path(const Path& p) { cairo_append_path(m_context, p.m_path); }
+  // a tree of nodes rendered incrementally: only the damaged pixels of the target are drawn again in the next frames
+  // the damaged area is not cleared, the content of the root usually paints the background
+  class Scene {
+  public:
+    SceneNode& root() { return m_root; }
 
-    // painting
+    // draws the damaged area in the context and returns it, in pixels of the target
+    // a change of the matrix of the context or of the device scale of the target damages the whole scene
+    Region render(Context& ctx)
+    {
+      const Matrix matrix = details::user_to_pixel_matrix(ctx);
 
-    void paint() { cairo_paint(m_context); }
-    void paint_with_alpha(double alpha) { cairo_paint_with_alpha(m_context, alpha); }
-    void mask(Pattern& pat) { cairo_mask(m_context, pat.m_pattern); }
-    void mask(Surface& surf, double surface_x, double surface_y) { cairo_mask_surface(m_context, surf.m_surface, surface_x, surface_y); }
-    void mask(Surface& surf, Vec2F origin) { cairo_mask_surface(m_context, surf.m_surface, origin.x, origin.y); }
-    void stroke() { cairo_stroke(m_context); }
-    void stroke_preserve() { cairo_stroke_preserve(m_context); }
-    void fill() { cairo_fill(m_context); }
-    void fill_preserve() { cairo_fill_preserve(m_context); }
-    void copy_page() { cairo_copy_page(m_context); }
-    void show_page() { cairo_show_page(m_context); }
+      if (!details::same_matrix(matrix, m_matrix)) {
+        m_matrix = matrix;
+        m_root.invalidate();
+      }
 
-    // insideness testing
+      Region damage;
+      m_root.collect(m_matrix, details::unbounded(), damage);
 
-    bool in_stroke(double x, double y) { return cairo_in_stroke(m_context, x, y) != 0; }
-    bool in_stroke(Vec2F point) { return cairo_in_stroke(m_context, point.x, point.y) != 0; }
-    bool in_fill(double x, double y) { return cairo_in_fill(m_context, x, y) != 0; }
-    bool in_fill(Vec2F point) { return cairo_in_fill(m_context, point.x, point.y) != 0; }
-    bool in_clip(double x, double y) { return cairo_in_clip(m_context, x, y) != 0; }
-    bool in_clip(Vec2F point) { return cairo_in_clip(m_context, point.x, point.y) != 0; }
+      if (damage.empty()) {
+        return damage;
+      }
 
-    // rectangular extents
+      const RectI extents = damage.extents();
+      details::Bounds area;
+      area.add(RectF{ static_cast<double>(extents.x), static_cast<double>(extents.y), static_cast<double>(extents.w), static_cast<double>(extents.h) });
 
-    RectF stroke_extents()
+      Subcontext sub(ctx);
+      ctx.clip_region(damage);
+      m_root.draw(ctx, &area, false);
+      return damage;
+    }
+
+    // draws the whole scene
+    void render_all(Context& ctx)
     {
-      double x1 = 0.0;
-      double y1 = 0.0;
-      double x2 = 0.0;
-      double y2 = 0.0;
-      cairo_stroke_extents(m_context, &x1, &y1, &x2, &y2);
-      return { x1, y1, x2 - x1, y2 -y1 };
+      m_root.invalidate();
+      render(ctx);
     }
 
-    RectF fill_extents()
+  private:
+    SceneNode m_root;
+    Matrix m_matrix = Matrix::create_identity();
+  };
+
+  /*
+   * layer cache
+   */
+
+  namespace details {
+
+    // the same scale and rotation, and a translation by whole pixels of the target
+    inline bool same_pixel_grid(const Matrix& lhs, const Matrix& rhs)
     {
-      double x1 = 0.0;
-      double y1 = 0.0;
-      double x2 = 0.0;
-      double y2 = 0.0;
-      cairo_fill_extents(m_context, &x1, &y1, &x2, &y2);
-      return { x1, y1, x2 - x1, y2 -y1 };
+      const Affine a = affine(lhs);
+      const Affine b = affine(rhs);
+
+      if (a.xx != b.xx || a.yx != b.yx || a.xy != b.xy || a.yy != b.yy) {
+        return false;
+      }
+
+      constexpr double Epsilon = 1e-6;
+      const double dx = a.x0 - b.x0;
+      const double dy = a.y0 - b.y0;
+      return std::abs(dx - std::round(dx)) < Epsilon && std::abs(dy - std::round(dy)) < Epsilon;
     }
 
-    // clipping
+  }
 
-    void reset_clip() { cairo_reset_clip(m_context); }
-    void clip() { cairo_clip(m_context); }
-    void clip_preserve() { cairo_clip_preserve(m_context); }
-    RectF clip_extents()
+  // groups kept at device resolution between frames, keyed by an id and a version of their content
+  // the least recently used layers are evicted when the layers use more than the budget
+  class LayerCache {
+  public:
+    struct Stats {
+      std::size_t hits = 0;
+      std::size_t misses = 0;
+      std::size_t evictions = 0;
+    };
+
+    // the budget is in bytes of pixels
+    explicit LayerCache(std::size_t budget = 64 * 1024 * 1024)
+    : m_budget(budget)
     {
-      double x1 = 0.0;
-      double y1 = 0.0;
-      double x2 = 0.0;
-      double y2 = 0.0;
-      cairo_clip_extents(m_context, &x1, &y1, &x2, &y2);
-      return { x1, y1, x2 - x1, y2 -y1 };
     }
 
-    std::vector<RectF> clip_rectangle_list()
+    // paints the content of the id with the alpha, with the same result as a group painted with paint_with_alpha
+    // the layer is used again if the version is the same and the context has the same scale and rotation, with a
+    // translation by whole pixels of the target; otherwise draw(ctx) is called again in a group that covers the bounds
+    // the bounds of the content are in user space, the content is not clipped by the clip of the context
+    template<typename Func>
+    void paint(Context& ctx, std::uint64_t id, std::uint64_t version, const RectF& bounds, double alpha, Func draw)
     {
-      std::unique_ptr<cairo_rectangle_list_t, decltype(&cairo_rectangle_list_destroy)> ptr(cairo_copy_clip_rectangle_list(m_context), cairo_rectangle_list_destroy);
+      const Matrix pixel = details::user_to_pixel_matrix(ctx);
+      SourceScope source_scope(ctx);
+
+      if (auto iterator = m_index.find(id); iterator != m_index.end()) {
+        Entry& entry = *iterator->second;
+
+        if (entry.version == version && details::same_pixel_grid(entry.matrix, pixel)) {
+          ++m_stats.hits;
+          m_entries.splice(m_entries.begin(), m_entries, iterator->second);
+          ctx.set_source(entry.layer);
+          ctx.paint_with_alpha(alpha);
+          return;
+        }
 
-      if (ptr->status != CAIRO_STATUS_SUCCESS) {
-        return {};
+        remove(iterator);
       }
 
-      std::vector<RectF> list;
+      ++m_stats.misses;
 
-      for (int i = 0; i < ptr->num_rectangles; ++i) {
-        auto r = ptr->rectangles[i];
-        list.push_back({ r.x, r.y, r.width, r.height });
+      const RectI pixels = ctx.target_pixels(bounds);
+      const auto bytes = static_cast<std::size_t>(std::max(pixels.w, 0)) * static_cast<std::size_t>(std::max(pixels.h, 0)) * 4;
+
+      if (bytes > m_budget) {
+        // too large to be kept, drawn without a layer
+        Subcontext sub(ctx);
+        ctx.push_group();
+        draw(ctx);
+        ctx.pop_group_to_source();
+        ctx.paint_with_alpha(alpha);
+        return;
       }
 
-      return list;
+      Pattern layer = render(ctx, pixels, draw);
+      ctx.set_source(layer);
+      ctx.paint_with_alpha(alpha);
+
+      m_entries.push_front({ id, version, pixel, std::move(layer), bytes });
+      m_index[id] = m_entries.begin();
+      m_bytes += bytes;
+      trim();
     }
 
-    // logical structure tagging functions
+    // paints the content of the id as an opaque group
+    template<typename Func>
+    void paint(Context& ctx, std::uint64_t id, std::uint64_t version, const RectF& bounds, Func draw)
+    {
+      paint(ctx, id, version, bounds, 1.0, draw);
+    }
 
-    void tag_begin(const char* tag_name, const char* attributes) { cairo_tag_begin(m_context, tag_name, attributes); }
-    void tag_end(const char* tag_name) { cairo_tag_end(m_context, tag_name); }
+    bool contains(std::uint64_t id) const { return m_index.find(id) != m_index.end(); }
 
-    // text
+    void invalidate(std::uint64_t id)
+    {
+      if (auto iterator = m_index.find(id); iterator != m_index.end()) {
+        remove(iterator);
+      }
+    }
 
-    void select_font_face(const char* family, FontSlant slant, FontWeight weight) { cairo_select_font_face(m_context, family, static_cast<cairo_font_slant_t>(slant), static_cast<cairo_font_weight_t>(weight)); }
-    void set_font_size(double size) { cairo_set_font_size(m_context, size); }
-    void set_font_matrix(const Matrix& m) { cairo_set_font_matrix(m_context, m); }
-    Matrix font_matrix() { Matrix m; cairo_get_font_matrix(m_context, m); return m; }
-    void set_font_options(const FontOptions& opt) { cairo_set_font_options(m_context, opt.m_options); }
-    FontOptions font_options() { FontOptions opt; cairo_get_font_options(m_context, opt.m_options); return opt; }
-    void set_font_face(FontFace& font) { cairo_set_font_face(m_context, font.m_font); }
-    FontFace font_face() { return { cairo_get_font_face(m_context), details::IncreaseReference }; }
-    void set_scaled_font(ScaledFont& font) { cairo_set_scaled_font(m_context, font.m_font); }
-    ScaledFont scaled_font() { return { cairo_get_scaled_font(m_context), details::IncreaseReference }; }
+    void clear()
+    {
+      m_entries.clear();
+      m_index.clear();
+      m_bytes = 0;
+    }
 
-    void show_text(const char* utf8) { cairo_show_text(m_context, utf8); }
-    void show_glyphs(const glyph* glyphs, int num_glyphs) { cairo_show_glyphs(m_context, glyphs, num_glyphs); }
-    template<typename T>
-    void show_glyphs(const T& glyphs) { cairo_show_glyphs(m_context, std::data(glyphs), static_cast<int>(std::size(glyphs))); }
-    void show_text_glyphs(const char* utf8, int utf8_len, const glyph* glyphs, int num_glyphs, const text_cluster* clusters, int num_clusters, TextClusterFlags cluster_flags = TextClusterFlags::None) { cairo_show_text_glyphs(m_context, utf8, utf8_len, glyphs, num_glyphs, clusters, num_clusters, static_cast<cairo_text_cluster_flags_t>(cluster_flags)); }
-    template<typename T, typename U>
-    void show_text_glyphs(std::string_view utf8, const T& glyphs, const U& clusters, TextClusterFlags cluster_flags = TextClusterFlags::None) { cairo_show_text_glyphs(m_context, std::data(utf8), static_cast<int>(std::size(utf8)), std::data(glyphs), static_cast<int>(std::size(glyphs)), std::data(clusters), static_cast<int>(std::size(clusters)), cluster_flags); }
-    void text_path(const char* utf8) { cairo_text_path(m_context, utf8); }
-    void glyph_path(const glyph* glyphs, int num_glyphs) { cairo_glyph_path(m_context, glyphs, num_glyphs); }
-    template<typename T>
-    void glyph_path(const T& glyphs) { cairo_glyph_path(m_context, std::data(glyphs), static_cast<int>(std::size(glyphs))); }
+    std::size_t size() const { return m_entries.size(); }
+    std::size_t bytes() const { return m_bytes; }
 
-    TextExtents text_extents(const char* utf8) { TextExtents extents; cairo_text_extents(m_context, utf8, &extents); return extents; }
-    TextExtents glyph_extents(const glyph* glyphs, int num_glyphs) { TextExtents extents; cairo_glyph_extents(m_context, glyphs, num_glyphs, &extents); return extents; }
-    template<typename T>
-    TextExtents glyph_extents(const T& glyphs) { TextExtents extents; cairo_glyph_extents(m_context, std::data(glyphs), static_cast<int>(std::size(glyphs)), &extents); return extents; }
-    FontExtents font_extents() { FontExtents extents; cairo_font_extents(m_context, &extents); return extents; }
+    void set_budget(std::size_t budget)
+    {
+      m_budget = budget;
+      trim();
+    }
+
+    std::size_t budget() const { return m_budget; }
+
+    const Stats& stats() const { return m_stats; }
+    void reset_stats() { m_stats = Stats(); }
 
   private:
-    details::Handle<cairo_t, cairo_reference, cairo_destroy> m_context;
-  };
+    struct Entry {
+      std::uint64_t id = 0;
+      std::uint64_t version = 0;
+      Matrix matrix = Matrix::create_identity();
+      Pattern layer;
+      std::size_t bytes = 0;
+    };
 
-  class Subcontext {
-  public:
-    Subcontext(Context& ctx)
-    : m_context(&ctx)
+    using EntryList = std::list<Entry>;
+
+    template<typename Func>
+    static Pattern render(Context& ctx, const RectI& pixels, Func& draw)
     {
-      m_context->save();
+      // the whole content is drawn in the group, not only the part inside the current clip
+      Subcontext sub(ctx);
+      ctx.reset_clip();
+      ctx.clip_region(pixels);
+
+      ctx.push_group();
+      draw(ctx);
+      return ctx.pop_group();
     }
 
-    Subcontext(const Subcontext&) = delete;
-    Subcontext(Subcontext&&) noexcept = delete;
-
-    ~Subcontext()
+    void remove(std::unordered_map<std::uint64_t, EntryList::iterator>::iterator iterator)
     {
-      m_context->restore();
+      m_bytes -= iterator->second->bytes;
+      m_entries.erase(iterator->second);
+      m_index.erase(iterator);
     }
 
-    Subcontext& operator=(const Subcontext&) = delete;
-    Subcontext& operator=(Subcontext&&) noexcept = delete;
+    void trim()
+    {
+      while (m_bytes > m_budget && !m_entries.empty()) {
+        ++m_stats.evictions;
+        remove(m_index.find(m_entries.back().id));
+      }
+    }
 
-  private:
-    Context* m_context = nullptr;
+    std::size_t m_budget = 0;
+    std::size_t m_bytes = 0;
+    EntryList m_entries;
+    std::unordered_map<std::uint64_t, EntryList::iterator> m_index;
+    Stats m_stats;
   };
 
   /*
-   * patterns
+   * thread pool
    */
 
-  class SolidPattern : public Pattern {
-  public:
-    static SolidPattern create_rgb(double red, double green, double blue) { return cairo_pattern_create_rgb(red, green, blue); }
-    static SolidPattern create_rgba(double red, double green, double blue, double alpha) { return cairo_pattern_create_rgba(red, green, blue, alpha); }
-    static SolidPattern create_color(Color col) { return cairo_pattern_create_rgba(col.r, col.g, col.b, col.a); }
+  namespace details {
 
-    Color color() { Color col; cairo_pattern_get_rgba(raw(), &col.r, &col.g, &col.b, &col.a); return col; }
+    class ThreadPool {
+    public:
+      // 0 for the number of hardware threads
+      explicit ThreadPool(std::size_t threads = 0)
+      {
+        if (threads == 0) {
+          threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
 
+        m_threads.reserve(threads);
 
-  private:
-    SolidPattern(cairo_pattern_t* pat)
-    : Pattern(pat)
+        try {
+          for (std::size_t i = 0; i < threads; ++i) {
+            m_threads.emplace_back([this]() { work(); });
+          }
+        } catch (...) {
+          // the started threads must be joined before they are destroyed
+          stop();
+          throw;
+        }
+      }
+
+      ThreadPool(const ThreadPool&) = delete;
+      ThreadPool(ThreadPool&&) noexcept = delete;
+
+      // the queued tasks are run before the threads are joined
+      ~ThreadPool()
+      {
+        stop();
+      }
+
+      ThreadPool& operator=(const ThreadPool&) = delete;
+      ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+      template<typename Func>
+      auto submit(Func func) -> std::future<decltype(func())>
+      {
+        auto task = std::make_shared<std::packaged_task<decltype(func())()>>(std::move(func));
+        auto future = task->get_future();
+
+        {
+          const std::lock_guard<std::mutex> lock(m_mutex);
+          m_tasks.emplace_back([task]() { (*task)(); });
+        }
+
+        m_condition.notify_one();
+        return future;
+      }
+
+      std::size_t size() const { return m_threads.size(); }
+
+    private:
+      void stop()
+      {
+        {
+          const std::lock_guard<std::mutex> lock(m_mutex);
+          m_stopping = true;
+        }
+
+        m_condition.notify_all();
+
+        for (auto& thread : m_threads) {
+          thread.join();
+        }
+      }
+
+      void work()
+      {
+        for (;;) {
+          std::function<void()> task;
+
+          {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+
+            if (m_tasks.empty()) {
+              return;
+            }
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+          }
+
+          task();
+        }
+      }
+
+      std::mutex m_mutex;
+      std::condition_variable m_condition;
+      std::deque<std::function<void()>> m_tasks;
+      bool m_stopping = false;
+      std::vector<std::thread> m_threads;
+    };
+
+  }
+
+  /*
+   * multi-scale rendering
+   */
+
+  // a drawing recorded once in a command buffer and rendered at several device scales concurrently, e.g. 1x, 2x and 3x
+  // the command buffer is only read during the rendering, the patterns and surfaces it references are shared by the threads,
+  // except for recording surfaces that cairo modifies during a replay: with one of them, the scales are rendered one by one
+  class MultiScaleRenderer {
+  public:
+    // 0 for the number of hardware threads
+    explicit MultiScaleRenderer(std::size_t threads = 0)
+    : m_pool(threads)
     {
     }
-  };
 
-  class SurfacePattern : public Pattern {
-  public:
-    static SurfacePattern create(Surface& surf) { return cairo_pattern_create_for_surface(surf.m_surface); }
+    // an image surface of ceil(size * scale) pixels with the scale as device scale, so the size is in user units
+    static ImageSurface render(const CommandBuffer& commands, Format format, Vec2I size, double scale)
+    {
+      const auto width = static_cast<int>(std::ceil(size.x * scale));
+      const auto height = static_cast<int>(std::ceil(size.y * scale));
+      ImageSurface surface = ImageSurface::create(format, width, height);
+      surface.set_device_scale(scale, scale);
+
+      {
+        Context ctx(surface);
+        commands.replay(ctx);
+      }
 
-    Surface surface() { cairo_surface_t* surface = nullptr; cairo_pattern_get_surface(raw(), &surface); return { surface, details::IncreaseReference }; }
+      surface.flush();
+      return surface;
+    }
 
-  private:
-    SurfacePattern(cairo_pattern_t* pat)
-    : Pattern(pat)
+    // renders each scale in a thread of the renderer, output(index, surface) is called in that thread as soon as the
+    // scale at the index is rendered, so it can be called concurrently for different scales
+    template<typename Func>
+    void render(const CommandBuffer& commands, Format format, Vec2I size, const double* scales, std::size_t num_scales, Func output)
     {
-    }
-  };
+      if (commands.uses_recording_surface()) {
+        for (std::size_t i = 0; i < num_scales; ++i) {
+          ImageSurface surface = render(commands, format, size, scales[i]);
+          output(i, surface);
+        }
 
-  class GradientPattern : public Pattern {
-  public:
+        return;
+      }
 
-    void add_color_stop_rgb(double offset, double red, double green, double blue) { cairo_pattern_add_color_stop_rgb(raw(), offset, red, green, blue); }
-    void add_color_stop_rgba(double offset, double red, double green, double blue, double alpha) { cairo_pattern_add_color_stop_rgba(raw(), offset, red, green, blue, alpha); }
-    void add_color_stop_color(double offset, Color col) { cairo_pattern_add_color_stop_rgba(raw(), offset, col.r, col.g, col.b, col.a); }
+      std::vector<std::future<void>> tasks;
+      tasks.reserve(num_scales);
 
-    std::pair<double, Color> color_stop(int index)
-    {
-      double offset = 0.0;
-      Color col;
-      [[maybe_unused]] auto result = cairo_pattern_get_color_stop_rgba(raw(), index, &offset, &col.r, &col.g, &col.b, &col.a);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return { offset, col };
+      for (std::size_t i = 0; i < num_scales; ++i) {
+        tasks.push_back(m_pool.submit([&commands, &output, format, size, scale = scales[i], i]() {
+          ImageSurface surface = render(commands, format, size, scale);
+          output(i, surface);
+        }));
+      }
+
+      // all the tasks use the parameters, they must be finished before an exception of one of them is rethrown
+      for (auto& task : tasks) {
+        task.wait();
+      }
+
+      for (auto& task : tasks) {
+        task.get();
+      }
     }
 
-    int color_stop_count()
+    template<typename C, typename Func>
+    void render(const CommandBuffer& commands, Format format, Vec2I size, const C& scales, Func output)
     {
-      int count = 0;
-      [[maybe_unused]] auto result = cairo_pattern_get_color_stop_count(raw(), &count);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return count;
+      render(commands, format, size, std::data(scales), std::size(scales), std::move(output));
     }
 
-  protected:
-    GradientPattern(cairo_pattern_t* pat)
-    : Pattern(pat)
+#if CAIRO_HAS_PNG_FUNCTIONS
+    // encodes each scale as a png in the thread that rendered it, write(index, data, length) receives the bytes of the
+    // png of the scale at the index as they are encoded and returns a Status, it can be called concurrently for different scales
+    template<typename Func>
+    std::vector<Status> write_to_png_stream(const CommandBuffer& commands, Vec2I size, const double* scales, std::size_t num_scales, Func write)
     {
-    }
-  };
+      std::vector<Status> statuses(num_scales, Status::Success);
 
-  class LinearGradientPattern : public GradientPattern {
-  public:
-    static LinearGradientPattern create(double x0, double y0, double x1, double y1) { return cairo_pattern_create_linear(x0, y0, x1, y1); }
-    static LinearGradientPattern create(Vec2F p0, Vec2F p1) { return cairo_pattern_create_linear(p0.x, p0.y, p1.x, p1.y); }
+      render(commands, Format::Argb32, size, scales, num_scales, [&statuses, &write](std::size_t index, ImageSurface& surface) {
+        statuses[index] = surface.write_to_png_stream([&write, index](const unsigned char* data, unsigned int length) {
+          return write(index, data, length);
+        });
+      });
 
-    std::pair<Vec2F, Vec2F> linear_points()
-    {
-      Vec2F p0;
-      Vec2F p1;
-      [[maybe_unused]] auto result = cairo_pattern_get_linear_points(raw(), &p0.x, &p0.y, &p1.x, &p1.y);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return { p0, p1 };
+      return statuses;
     }
 
-  private:
-    LinearGradientPattern(cairo_pattern_t* pat)
-    : GradientPattern(pat)
+    template<typename C, typename Func>
+    std::vector<Status> write_to_png_stream(const CommandBuffer& commands, Vec2I size, const C& scales, Func write)
     {
+      return write_to_png_stream(commands, size, std::data(scales), std::size(scales), std::move(write));
     }
+#endif
+
+    std::size_t threads() const { return m_pool.size(); }
+
+  private:
+    details::ThreadPool m_pool;
   };
 
-  class RadialGradientPattern : public GradientPattern {
-  public:
-    static RadialGradientPattern create(double cx0, double cy0, double radius0, double cx1, double cy1, double radius1) { return cairo_pattern_create_radial(cx0, cy0, radius0, cx1, cy1, radius1); }
-    static RadialGradientPattern create(Vec2F center0, double radius0, Vec2F center1, double radius1) { return cairo_pattern_create_radial(center0.x, center0.y, radius0, center1.x, center1.y, radius1); }
+#if CAIRO_HAS_PDF_SURFACE
 
-    std::tuple<Vec2F, double, Vec2F, double> radial_circles()
+  /*
+   * pdf job
+   */
+
+  // the pages of a pdf drawn concurrently, each one in its own recording surface, and then written in order
+  // the drawing functions run in the threads of the job and must not share cairo objects, except font faces
+  class PdfJob {
+  public:
+    using PageFunction = std::function<void(Context&)>;
+
+    // the window is the maximum number of pages drawn or recorded but not written yet, 0 for twice the number of threads
+    explicit PdfJob(PdfSurface& surface, std::size_t threads = 0, std::size_t window = 0)
+    : m_surface(surface)
+    , m_context(surface)
+    , m_pool(threads)
+    , m_window(window > 0 ? window : 2 * m_pool.size())
     {
-      Vec2F center0;
-      double radius0 = 0.0;
-      Vec2F center1;
-      double radius1 = 0.0;
-      [[maybe_unused]] auto result = cairo_pattern_get_radial_circles(raw(), &center0.x, &center0.y, &radius0, &center1.x, &center1.y, &radius1);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return { center0, radius0, center1, radius1 };
     }
 
-  private:
-    RadialGradientPattern(cairo_pattern_t* pat)
-    : GradientPattern(pat)
+    PdfJob(const PdfJob&) = delete;
+    PdfJob(PdfJob&&) noexcept = delete;
+
+    // the pages of the page functions that threw are skipped, call finish() to get their exceptions
+    ~PdfJob()
     {
+      while (!m_pages.empty()) {
+        try {
+          write_page();
+        } catch (...) { // NOLINT(bugprone-empty-catch)
+        }
+      }
+
+      m_surface.flush();
     }
-  };
 
-  class MeshPattern : public Pattern {
-  public:
-    static MeshPattern create() { return cairo_pattern_create_mesh(); }
+    PdfJob& operator=(const PdfJob&) = delete;
+    PdfJob& operator=(PdfJob&&) noexcept = delete;
 
-    void begin_patch() { cairo_mesh_pattern_begin_patch(raw()); }
-    void end_patch() { cairo_mesh_pattern_end_patch(raw()); }
-    void move_to(double x, double y) { cairo_mesh_pattern_move_to(raw(), x, y); }
-    void move_to(Vec2F point) { cairo_mesh_pattern_move_to(raw(), point.x, point.y); }
-    void line_to(double x, double y) { cairo_mesh_pattern_line_to(raw(), x, y); }
-    void line_to(Vec2F point) { cairo_mesh_pattern_line_to(raw(), point.x, point.y); }
-    void curve_to(double x1, double y1, double x2, double y2, double x3, double y3) { cairo_mesh_pattern_curve_to(raw(), x1, y1, x2, y2, x3, y3); }
-    void curve_to(Vec2F p1, Vec2F p2, Vec2F p3) { cairo_mesh_pattern_curve_to(raw(), p1.x, p1.y, p2.x, p2.y, p3.x, p3.y); }
+    // queues a page of the size, in points, the oldest pages are written if the window is full
+    // the page is queued even if the exception of a page function written before it is rethrown
+    void add_page(double width_in_points, double height_in_points, PageFunction draw)
+    {
+      std::exception_ptr exception;
 
-    void set_control_point(unsigned point_num, double x, double y) { cairo_mesh_pattern_set_control_point(raw(), point_num, x, y); }
-    void set_control_point(unsigned point_num, Vec2F point) { cairo_mesh_pattern_set_control_point(raw(), point_num, point.x, point.y); }
-    void set_corner_color_rgb(unsigned corner_num, double red, double green, double blue) { cairo_mesh_pattern_set_corner_color_rgb(raw(), corner_num, red, green, blue); }
-    void set_corner_color_rgba(unsigned corner_num, double red, double green, double blue, double alpha) { cairo_mesh_pattern_set_corner_color_rgba(raw(), corner_num, red, green, blue, alpha); }
-    void set_corner_color(unsigned corner_num, Color col) { cairo_mesh_pattern_set_corner_color_rgba(raw(), corner_num, col.r, col.g, col.b, col.a); }
+      while (m_pages.size() >= m_window) {
+        try {
+          write_page();
+        } catch (...) {
+          exception = std::current_exception();
+        }
+      }
 
-    unsigned patch_count()
-    {
-      unsigned count = 0;
-      [[maybe_unused]] auto result = cairo_mesh_pattern_get_patch_count(raw(), &count);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return count;
-    }
+      auto recording = m_pool.submit([width_in_points, height_in_points, draw = std::move(draw)]() {
+        RecordingSurface recording = RecordingSurface::create(Content::ColorAlpha, { 0.0, 0.0, width_in_points, height_in_points });
+        Context ctx(recording);
+        draw(ctx);
+        recording.flush();
+        return recording;
+      });
 
-    Path path(unsigned patch_num) { return cairo_mesh_pattern_get_path(raw(), patch_num); }
+      m_pages.push_back({ width_in_points, height_in_points, std::move(recording) });
 
-    Color corner_color(unsigned patch_num, unsigned corner_num)
-    {
-      Color col;
-      [[maybe_unused]] auto result = cairo_mesh_pattern_get_corner_color_rgba(raw(), patch_num, corner_num, &col.r, &col.g, &col.b, &col.a);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return col;
+      if (exception) {
+        std::rethrow_exception(exception);
+      }
     }
 
-    Vec2F control_point(unsigned patch_num, unsigned point_num)
+    void add_page(Vec2F size_in_points, PageFunction draw) { add_page(size_in_points.x, size_in_points.y, std::move(draw)); }
+
+    // writes the remaining pages and returns the status of the pdf surface
+    // the exception of a page function is rethrown, the next call writes the pages after it
+    Status finish()
     {
-      Vec2F point;
-      [[maybe_unused]] auto result = cairo_mesh_pattern_get_control_point(raw(), patch_num, point_num, &point.x, &point.y);
-      assert(result == CAIRO_STATUS_SUCCESS);
-      return point;
+      while (!m_pages.empty()) {
+        write_page();
+      }
+
+      m_surface.flush();
+      return m_surface.status();
     }
 
+    std::size_t pending() const { return m_pages.size(); }
+    std::size_t written() const { return m_written; }
+
   private:
-    MeshPattern(cairo_pattern_t* pat)
-    : Pattern(pat)
+    struct Page {
+      double width = 0.0;
+      double height = 0.0;
+      std::future<RecordingSurface> recording;
+    };
+
+    void write_page()
     {
+      Page page = std::move(m_pages.front());
+      m_pages.pop_front();
+
+      RecordingSurface recording = page.recording.get();
+      m_surface.set_size(page.width, page.height);
+      m_context.set_source(recording, 0.0, 0.0);
+      m_context.paint();
+      m_context.show_page();
+      // the context does not keep the recording alive
+      m_context.set_source_rgb(0.0, 0.0, 0.0);
+      ++m_written;
     }
+
+    PdfSurface m_surface;
+    Context m_context;
+    details::ThreadPool m_pool;
+    std::size_t m_window = 0;
+    std::deque<Page> m_pages;
+    std::size_t m_written = 0;
   };
 
+#endif
+
+#if CAIRO_HAS_PNG_FUNCTIONS
+
   /*
-   * surfaces
+   * image cache
    */
 
-  inline int format_stride_for_width(Format fmt, int width) { return cairo_format_stride_for_width(static_cast<cairo_format_t>(fmt), width); }
-
-  class ImageSurface : public Surface {
+  // decoded png files shared by all the threads, decoded again if the file is modified
+  // the least recently used images are evicted when the images use more than the budget
+  class ImageCache {
   public:
-    static ImageSurface create(Format fmt, int width, int height) { return cairo_image_surface_create(static_cast<cairo_format_t>(fmt), width, height); }
-    static ImageSurface create(Format fmt, Vec2I size) { return cairo_image_surface_create(static_cast<cairo_format_t>(fmt), size.x, size.y); }
-    static ImageSurface create_for_data(unsigned char* data, Format fmt, int width, int height, int stride) { return cairo_image_surface_create_for_data(data, static_cast<cairo_format_t>(fmt), width, height, stride); }
-    static ImageSurface create_for_data(unsigned char* data, Format fmt, Vec2I size, int stride) { return cairo_image_surface_create_for_data(data, static_cast<cairo_format_t>(fmt), size.x, size.y, stride); }
+    struct Stats {
+      std::size_t hits = 0;
+      std::size_t misses = 0;
+      std::size_t evictions = 0;
+    };
 
-#if CAIRO_HAS_PNG_FUNCTIONS
-    static ImageSurface create_from_png(const char* filename) { return cairo_image_surface_create_from_png(filename);  }
-    static ImageSurface create_from_png(const std::filesystem::path& filename) { return cairo_image_surface_create_from_png(filename.string().c_str());  }
-#endif
+    // the budget is in bytes of pixels
+    explicit ImageCache(std::size_t budget = 64 * 1024 * 1024)
+    : m_budget(budget)
+    {
+    }
 
-    unsigned char* data() { return cairo_image_surface_get_data(raw()); }
-    Format format() { return static_cast<Format>(cairo_image_surface_get_format(raw())); }
-    int width() { return cairo_image_surface_get_width(raw()); }
-    int height() { return cairo_image_surface_get_height(raw()); }
-    int stride() { return cairo_image_surface_get_stride(raw()); }
+    // the image of the file, a file is decoded only once even if several threads load it at the same time
+    // the returned surface is shared, it must not be modified
+    ImageSurface load_png(const std::filesystem::path& filename)
+    {
+      std::error_code error;
+      const std::filesystem::file_time_type time = std::filesystem::last_write_time(filename, error);
+      const std::uintmax_t file_size = std::filesystem::file_size(filename, error);
+      const std::string key = filename.string();
 
+      std::promise<ImageSurface> promise;
+      std::shared_future<ImageSurface> image;
+      std::uint64_t generation = 0;
 
-  private:
-    ImageSurface(cairo_surface_t* surf)
-    : Surface(surf)
-    {
-    }
-  };
+      {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (auto iterator = m_index.find(key); iterator != m_index.end()) {
+          Entry& entry = *iterator->second;
+
+          if (entry.time == time && entry.file_size == file_size) {
+            ++m_stats.hits;
+            m_entries.splice(m_entries.begin(), m_entries, iterator->second);
+            image = entry.image;
+          } else {
+            remove(iterator);
+          }
+        }
 
-  class RecordingSurface : public Surface {
-  public:
-    static RecordingSurface create(Content cnt, RectF extents) { const cairo_rectangle_t rectangle = { extents.x, extents.y, extents.w, extents.h }; return cairo_recording_surface_create(static_cast<cairo_content_t>(cnt), &rectangle); }
+        if (!image.valid()) {
+          ++m_stats.misses;
+          generation = ++m_generation;
+          image = promise.get_future().share();
+          m_entries.push_front({ key, time, file_size, generation, image, 0 });
+          m_index[key] = m_entries.begin();
+        }
+      }
 
-    RectF ink_extents() { RectF extents; cairo_recording_surface_ink_extents(raw(), &extents.x, &extents.y, &extents.w, &extents.h); return extents; }
-    std::pair<bool, RectF> extents() { cairo_rectangle_t extents; auto ret = cairo_recording_surface_get_extents(raw(), &extents); return { ret != 0, { extents.x, extents.y, extents.width, extents.height }}; }
+      if (generation == 0) {
+        return image.get();
+      }
 
-  private:
-    RecordingSurface(cairo_surface_t* surf)
-    : Surface(surf)
-    {
-    }
-  };
+      std::optional<ImageSurface> decoded;
 
-#if CAIRO_HAS_PDF_SURFACE
+      try {
+        decoded.emplace(ImageSurface::create_from_png(filename));
+      } catch (...) {
+        // the threads waiting for the image get the exception, the next load tries again
+        promise.set_exception(std::current_exception());
+        forget(key, generation);
+        throw;
+      }
 
-  enum class PdfVersion : std::underlying_type_t<cairo_pdf_version_t> { // NOLINT(performance-enum-size)
-    V_1_4,
-    V_1_5,
-  };
+      promise.set_value(*decoded);
 
-  inline std::string_view to_string(PdfVersion version) { return cairo_pdf_version_to_string(static_cast<cairo_pdf_version_t>(version)); }
+      if (decoded->status() != Status::Success) {
+        // errors are not kept, the next load tries again
+        forget(key, generation);
+        return *decoded;
+      }
 
-  enum class PdfOutlineFlags : std::underlying_type_t<cairo_pdf_outline_flags_t> { // NOLINT(performance-enum-size)
-    Open = CAIRO_PDF_OUTLINE_FLAG_OPEN,
-    Bold = CAIRO_PDF_OUTLINE_FLAG_BOLD,
-    Italic = CAIRO_PDF_OUTLINE_FLAG_ITALIC,
-  };
+      const std::lock_guard<std::mutex> lock(m_mutex);
 
-  inline constexpr int PdfOutlineRoot = CAIRO_PDF_OUTLINE_ROOT;
+      if (auto iterator = m_index.find(key); iterator != m_index.end() && iterator->second->generation == generation) {
+        iterator->second->bytes = static_cast<std::size_t>(decoded->stride()) * static_cast<std::size_t>(decoded->height());
+        m_bytes += iterator->second->bytes;
+        trim();
+      }
 
-  enum class PdfMetadata : std::underlying_type_t<cairo_pdf_metadata_t> { // NOLINT(performance-enum-size)
-    Title = CAIRO_PDF_METADATA_TITLE,
-    Author = CAIRO_PDF_METADATA_AUTHOR,
-    Subject = CAIRO_PDF_METADATA_SUBJECT,
-    Keywords = CAIRO_PDF_METADATA_KEYWORDS,
-    Creator = CAIRO_PDF_METADATA_CREATOR,
-    Date = CAIRO_PDF_METADATA_CREATE_DATE,
-    ModDate = CAIRO_PDF_METADATA_MOD_DATE,
-  };
+      return *decoded;
+    }
 
-  class PdfSurface : public Surface {
-  public:
-    static PdfSurface create(const char* filename, double width_in_points, double height_in_points) { return cairo_pdf_surface_create(filename, width_in_points, height_in_points); }
-    static PdfSurface create(const std::filesystem::path& filename, double width_in_points, double height_in_points) { return cairo_pdf_surface_create(filename.string().c_str(), width_in_points, height_in_points); }
+    void invalidate(const std::filesystem::path& filename)
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
 
-    void restrict_to_version(PdfVersion version) { cairo_pdf_surface_restrict_to_version(raw(), static_cast<cairo_pdf_version_t>(version)); }
+      if (auto iterator = m_index.find(filename.string()); iterator != m_index.end()) {
+        remove(iterator);
+      }
+    }
 
-    void set_size(double width_in_points, double height_in_points) {cairo_pdf_surface_set_size(raw(), width_in_points, height_in_points); }
-    void set_size(Vec2F size_in_points) {cairo_pdf_surface_set_size(raw(), size_in_points.x, size_in_points.y); }
+    void clear()
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      m_entries.clear();
+      m_index.clear();
+      m_bytes = 0;
+    }
 
-    void add_outline(int parent_id, const char* utf8, const char* link_attribs, PdfOutlineFlags flags) { cairo_pdf_surface_add_outline(raw(), parent_id, utf8, link_attribs, static_cast<cairo_pdf_outline_flags_t>(flags)); }
+    std::size_t size() const
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      return m_entries.size();
+    }
 
-    void set_metadata(PdfMetadata metadata, const char* utf8) { cairo_pdf_surface_set_metadata(raw(), static_cast<cairo_pdf_metadata_t>(metadata), utf8); }
-    void set_page_label(const char* utf8) { cairo_pdf_surface_set_page_label(raw(), utf8); }
-    void set_thumbnail_size(int width, int height) { cairo_pdf_surface_set_thumbnail_size(raw(), width, height); }
-    void set_thumbnail_size(Vec2I size) { cairo_pdf_surface_set_thumbnail_size(raw(), size.x, size.y); }
+    std::size_t bytes() const
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      return m_bytes;
+    }
 
-    static std::vector<PdfVersion> versions()
+    void set_budget(std::size_t budget)
     {
-      const cairo_pdf_version_t* raw_versions = nullptr;
-      int raw_num_versions = 0;
-      cairo_pdf_get_versions(&raw_versions, &raw_num_versions);
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      m_budget = budget;
+      trim();
+    }
 
-      std::vector<PdfVersion> versions;
-      versions.reserve(raw_num_versions);
+    std::size_t budget() const
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      return m_budget;
+    }
 
-      for (int i = 0; i < raw_num_versions; ++i) {
-        versions.push_back(static_cast<PdfVersion>(raw_versions[i]));
-      }
+    Stats stats() const
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      return m_stats;
+    }
 
-      return versions;
+    void reset_stats()
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+      m_stats = Stats();
     }
 
   private:
-    PdfSurface(cairo_surface_t* surf)
-    : Surface(surf)
+    struct Entry {
+      std::string key;
+      std::filesystem::file_time_type time;
+      std::uintmax_t file_size = 0;
+      std::uint64_t generation = 0;
+      std::shared_future<ImageSurface> image;
+      std::size_t bytes = 0;
+    };
+
+    using EntryList = std::list<Entry>;
+
+    void remove(std::unordered_map<std::string, EntryList::iterator>::iterator iterator)
+    {
+      m_bytes -= iterator->second->bytes;
+      m_entries.erase(iterator->second);
+      m_index.erase(iterator);
+    }
+
+    // removes the entry of a load, unless it was already replaced by another one
+    void forget(const std::string& key, std::uint64_t generation)
+    {
+      const std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (auto iterator = m_index.find(key); iterator != m_index.end() && iterator->second->generation == generation) {
+        remove(iterator);
+      }
+    }
+
+    // the images being decoded use no bytes yet, they are evicted last
+    void trim()
     {
+      auto iterator = m_entries.end();
+
+      while (m_bytes > m_budget && iterator != m_entries.begin()) {
+        --iterator;
+
+        if (iterator->bytes == 0) {
+          continue;
+        }
+
+        ++m_stats.evictions;
+        auto next = std::next(iterator);
+        remove(m_index.find(iterator->key));
+        iterator = next;
+      }
     }
+
+    mutable std::mutex m_mutex;
+    std::size_t m_budget = 0;
+    std::size_t m_bytes = 0;
+    std::uint64_t m_generation = 0;
+    EntryList m_entries;
+    std::unordered_map<std::string, EntryList::iterator> m_index;
+    Stats m_stats;
   };
 
 #endif